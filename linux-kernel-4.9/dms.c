@@ -25,13 +25,31 @@
 #include <linux/dm-io.h>
 #include <linux/dm-dirty-log.h>
 #include <linux/dm-kcopyd.h>
+#include <linux/rbtree.h>
+#include <linux/interval_tree_generic.h>
+#include <linux/crc32c.h>
+#include <linux/lcm.h>
+#include <linux/hashtable.h>
+#include <linux/srcu.h>
+#include <linux/llist.h>
+#include <linux/percpu.h>
 
 #include "dms.h"			/* Local mirror_sync header file */
 
 #define DM_MSG_PREFIX "mirror_sync"
 
+/* kcopyd I/O throttle (in %) for the background resync of legs... */
+DECLARE_DM_KCOPYD_THROTTLE_WITH_MODULE_PARM(mirror_sync_resync_throttle,
+	"A percentage of time allocated for copying regions to recovering or added legs");
+
 
 void mirror_sync_emit_status(struct mirror_sync_set *ms, char *result, unsigned int maxlen);
+static void dms_behind_fail(struct mirror *m);
+static void dms_behind_clean(struct mirror_sync_set *ms);
+static void dms_flush_end(struct mirror_sync_set *ms, struct bio *leader);
+static void read_callback(unsigned long error, void *context);
+static void do_share_dispatch(struct work_struct *work);
+static void dms_carry_legs(struct mirror_sync_set *newms);
 
 /* All mirrors are equal, but this is used in some cases (inherited from the mirror module */
 #define DEFAULT_MIRROR 0
@@ -59,44 +77,479 @@ static void bio_set_m(struct bio *bio, struct dms_bio_map_info *bmi)
 }
 
 /*----------------------------------------------------------------------------------
- * CAUTION: these functions use the bi_private pointer, which can only be used for queueing bios
- * 			to handle read failures, not for pointer passing via dm_io()... */
-static void bio_push_m_priv(struct bio *bio, struct dms_bio_map_info *bmi)
+ * The per-bio data is sized to the legs of the set: the bmi, the indices of the
+ * legs a write goes to and, above DMS_IO_GROUP legs, one dms_io_group per dm_io. */
+static size_t dms_bmi_groups_off(unsigned int nr_mirrors)
+{
+	return ALIGN(offsetof(struct dms_bio_map_info, bmi_wm) + nr_mirrors, sizeof(void *));
+}
+
+static size_t dms_bmi_size(unsigned int nr_mirrors)
+{
+	size_t sz = dms_bmi_groups_off(nr_mirrors);
+
+	if ( nr_mirrors > DMS_IO_GROUP )
+		sz += DIV_ROUND_UP(nr_mirrors, DMS_IO_GROUP) * sizeof(struct dms_io_group);
+	return sz;
+}
+
+static inline struct dms_bio_map_info *dms_bio_bmi(struct mirror_sync_set *ms, struct bio *bio)
+{
+	return dm_per_bio_data(bio, ms->ti->per_io_data_size);
+}
+
+static inline struct dms_io_group *dms_bmi_groups(struct dms_bio_map_info *bmi)
+{
+	return (void *) bmi + dms_bmi_groups_off(bmi->bmi_ms->nr_mirrors);
+}
+
+/* i-th leg the write of bmi goes to */
+static inline struct mirror *dms_bmi_leg(struct dms_bio_map_info *bmi, unsigned int i)
+{
+	return bmi->bmi_ms->mirror + bmi->bmi_wm[i];
+}
+
+/*---------------------------------------------------------------------------------- */
+
+/*-----------------------------------------------------------------
+ * Resources shared by the instances: one workqueue (per-CPU) for the
+ * read retries, deferred bios, flush rounds & events of all of them, instead of a
+ * thread each, and dm_io clients (with their mempools) shared by up
+ * to DMS_IO_CLIENT_SHARE instances each, so that their number follows
+ * the number of instances...
+ *---------------------------------------------------------------*/
+static struct workqueue_struct *dms_wq = NULL;
+static struct workqueue_struct *dms_share_wq = NULL;	/* fair share dispatch, high priority */
+static struct workqueue_struct *dms_jr_wq = NULL;		/* journal replay, long running */
+
+static DEFINE_MUTEX(dms_io_clients_lock);
+static LIST_HEAD(dms_io_clients);
+
+static int dms_io_client_get(struct mirror_sync_set *ms)
+{
+	struct dms_io_client *c;
+
+	mutex_lock(&dms_io_clients_lock);
+	list_for_each_entry(c, &dms_io_clients, list)
+		if (c->users < DMS_IO_CLIENT_SHARE)
+			goto found;
+
+	c = kzalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		goto bad;
+	c->client = dm_io_client_create();
+	if (IS_ERR(c->client)) {
+		kfree(c);
+		goto bad;
+	}
+	list_add(&c->list, &dms_io_clients); /* filled first */
+found:
+	c->users++;
+	mutex_unlock(&dms_io_clients_lock);
+
+	ms->io_shared = c;
+	ms->io_client = c->client;
+	return 0;
+bad:
+	mutex_unlock(&dms_io_clients_lock);
+	return -ENOMEM;
+}
+
+static void dms_io_client_put(struct mirror_sync_set *ms)
+{
+	struct dms_io_client *c = ms->io_shared;
+
+	if (!c)
+		return;
+
+	mutex_lock(&dms_io_clients_lock);
+	if (!--c->users) {
+		list_del(&c->list);
+		dm_io_client_destroy(c->client);
+		kfree(c);
+	}
+	mutex_unlock(&dms_io_clients_lock);
+	ms->io_shared = NULL;
+	ms->io_client = NULL;
+}
+
+/*-----------------------------------------------------------------
+ * Leg set: the legs attached to an instance, replaced as a whole by the
+ * leg messages (io_cmd detach_leg/attach_leg/...) and published with RCU.
+ * The paths that pick the legs of an I/O and issue it run in a read
+ * section of dms_legs_srcu (sleepable, dm_io may wait for memory): a
+ * grace period after a leg was taken out, no new I/O goes to it and all
+ * the I/O it still has is counted in its inflight_ios...
+ *---------------------------------------------------------------*/
+DEFINE_STATIC_SRCU(dms_legs_srcu);
+
+static struct dms_leg_set *dms_legs_alloc(struct mirror_sync_set *ms, unsigned long attached)
 {
-	bmi->bi_private = bio->bi_private;
-	bio->bi_private = (void *) bmi;
+	struct dms_leg_set *legs;
+	unsigned int i;
+
+	legs = kzalloc(sizeof(*legs) + ms->nr_mirrors * sizeof(legs->leg[0]), GFP_KERNEL);
+	if (!legs)
+		return NULL;
+
+	legs->attached = attached;
+	for_each_set_bit(i, &legs->attached, ms->nr_mirrors)
+		legs->leg[legs->nr++] = ms->mirror + i;
+
+	return legs;
 }
 
-static struct dms_bio_map_info *bio_pop_m_priv(struct bio *bio)
+/* Publish a new leg set and wait until no I/O path sees the old one [legs_lock held] */
+static int dms_legs_publish(struct mirror_sync_set *ms, unsigned long attached)
 {
-	struct dms_bio_map_info *bmi = bio->bi_private;
+	struct dms_leg_set *legs = dms_legs_alloc(ms, attached), *old;
+
+	if (!legs)
+		return -ENOMEM;
+
+	old = rcu_dereference_protected(ms->legs, lockdep_is_held(&ms->legs_lock));
+	rcu_assign_pointer(ms->legs, legs);
+	synchronize_srcu(&dms_legs_srcu);
+	kfree(old);
+
+	return 0;
+}
 
-	assert_bug( bmi );
-	bio->bi_private = bmi->bi_private;
+/* Position of attached leg m in the set (its index in the table line) */
+static inline unsigned int dms_leg_pos(struct dms_leg_set *legs, struct mirror *m)
+{
+	unsigned int idx = m - m->ms->mirror;
 
-	return bmi;
+	return idx ? bitmap_weight(&legs->attached, idx) : 0;
 }
 
 /*---------------------------------------------------------------------------------- */
 
+/* Run the read retries queued on the CPUs now (e.g. to requeue them on a noflush suspend) */
 static void wake(struct mirror_sync_set *ms)
 {
-	queue_work(ms->kmirror_syncd_wq, &ms->kmirror_syncd_work);
+	struct dms_retry_cpu *rq;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		rq = per_cpu_ptr(ms->retry, cpu);
+		if ( !llist_empty(&rq->list) )
+			queue_work_on(cpu, dms_wq, &rq->work);
+	}
+}
+
+/* Wait for the read retries queued on the CPUs */
+static void dms_retry_flush(struct mirror_sync_set *ms)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		flush_work(&per_cpu_ptr(ms->retry, cpu)->work);
 }
 
 
 /*----------------------------------------------------------------- */
 
-static int
+/* NOTE: the error bits & count of a leg tell why it is dead (for the status),
+ *       the live_mask of the set whether it is: one word for all the legs, so
+ *       the I/O paths take a snapshot of it once per I/O (dms_live_legs()).
+ *       It is only changed by fail_mirror() & reinstate_mirror() (and at
+ *       ctr/reload time), after the error bits... */
+static inline int
 mirror_is_alive( struct mirror *m )
 {
-	if ( test_bit(DM_RAID1_WRITE_ERROR, &(m->error_type)) ||
-		 test_bit(DM_RAID1_SYNC_ERROR, &(m->error_type)) ||
-		 test_bit(DM_RAID1_READ_ERROR, &(m->error_type)) ||
-		 atomic_read(&m->error_count) )
-		return 0; /* dead */
-	else
-		return 1; /* alive ! */
+	return test_bit(m - m->ms->mirror, &m->ms->live_mask);
+}
+
+static inline unsigned long dms_live_legs(struct mirror_sync_set *ms)
+{
+	return READ_ONCE(ms->live_mask);
+}
+
+/* Was the leg taken out of the set (io_cmd detach_leg)? It counts as failed, but is not probed */
+static inline int dms_leg_detached(struct mirror *m)
+{
+	return test_bit(DMS_LEG_DETACHED, &m->error_type);
+}
+
+/* Is the journaled leg behind (entries not replayed yet)? It can't serve reads then... */
+static inline int dms_journal_lagging(struct mirror *m)
+{
+	return unlikely(m == m->ms->jr_leg) && READ_ONCE(m->ms->jr_nr);
+}
+
+/* A leg that is alive gets all writes, but it can only serve reads
+ * once it has caught up all the regions it missed while failed... */
+static int
+mirror_is_readable( struct mirror *m )
+{
+	return mirror_is_alive(m) && atomic_read(&m->state) != DMS_LEG_RECOVERING &&
+		   !dms_journal_lagging(m);
+}
+
+/* Get the range of resync regions a bio covers... returns 0 for empty bios (e.g. flushes) */
+static int dms_bio_regions(struct mirror_sync_set *ms, struct bio *bio,
+						   unsigned long *first, unsigned long *last)
+{
+	sector_t sector;
+
+	if (unlikely(!bio_sectors(bio)))
+		return 0;
+
+	sector = dm_target_offset(ms->ti, bio->bi_iter.bi_sector);
+	*first = sector >> DMS_REGION_SHIFT;
+	*last = (sector + bio_sectors(bio) - 1) >> DMS_REGION_SHIFT;
+
+	assert_return( *last < ms->nr_regions, 0 );
+	return 1;
+}
+
+/* Is one of the regions [first, last] being copied to leg m right now? */
+static int dms_region_in_copy(struct mirror_sync_set *ms, struct mirror *m,
+							  unsigned long first, unsigned long last)
+{
+	int i, nr;
+
+	/* CAUTION: resync_nr is published last (after the leg and the regions) and
+	 * cleared first, so it has to be read first here, pairs with the smp_wmb()
+	 * of dms_resync_batch()... */
+	nr = atomic_read(&ms->resync_nr);
+	if (!nr)
+		return 0;
+	smp_rmb();
+	if ( READ_ONCE(ms->resync_mirror) != m )
+		return 0;
+
+	for (i = 0; i < nr; i++)
+		if ( ms->resync_batch[i] >= first && ms->resync_batch[i] <= last )
+			return 1;
+
+	return 0;
+}
+
+/* A write in flight to a write-behind (async) leg, on its own copy of the data:
+ * the original bio completes without waiting for it... */
+struct dms_behind_io {
+	struct rb_node rb;
+	sector_t start, last, __subtree_last;	/* target sectors written */
+	struct list_head list;
+	unsigned long issued;					/* jiffies */
+	struct mirror *m;
+	unsigned int epoch;						/* write epoch it is counted in */
+	unsigned int sectors;
+	struct dms_quorum_io *q;				/* quorum write it is a leg of, if any */
+	struct bio *bio;						/* the leg write, until issued */
+	struct dms_behind_io *next;				/* set up by the same write */
+};
+
+#define BEHIND_START(io) ((io)->start)
+#define BEHIND_LAST(io) ((io)->last)
+INTERVAL_TREE_DEFINE(struct dms_behind_io, rb, sector_t, __subtree_last,
+					 BEHIND_START, BEHIND_LAST, static, dms_behind_it);
+
+/* Does a bio overlap a write still in flight to the write-behind leg m? */
+static int dms_behind_overlap(struct mirror *m, struct bio *bio)
+{
+	unsigned long flags;
+	sector_t start;
+	int ret;
+
+	if ( likely(!atomic_read(&m->behind_ios)) || !bio_sectors(bio) )
+		return 0;
+
+	start = dm_target_offset(m->ms->ti, bio->bi_iter.bi_sector);
+	spin_lock_irqsave(&m->behind_lock, flags);
+	ret = dms_behind_it_iter_first(&m->behind_tree, start, start + bio_sectors(bio) - 1) != NULL;
+	spin_unlock_irqrestore(&m->behind_lock, flags);
+
+	return ret;
+}
+
+/*-----------------------------------------------------------------
+ * Shared disk load: many instances (e.g. per-VM mirrors, or striped
+ * RAID10 sets) may have legs on the same physical disk, so the load
+ * that the least load read policy looks at is the whole disk's, from
+ * all instances, not the slice of one instance.
+ *---------------------------------------------------------------*/
+static DEFINE_MUTEX(dms_disks_lock);	/* protects the registry (ctr/dtr only) */
+static DEFINE_HASHTABLE(dms_disks, DMS_DISK_HASH_BITS);
+
+/* Get the registry entry of the disk of bdev (created on first use) */
+static struct dms_disk *__dms_disk_get(struct block_device *bdev)
+{
+	dev_t dev = bdev->bd_disk ? disk_devt(bdev->bd_disk) : bdev->bd_dev;
+	struct dms_disk *d;
+
+	mutex_lock(&dms_disks_lock);
+	hash_for_each_possible(dms_disks, d, node, dev)
+		if (d->dev == dev)
+			goto found;
+
+	d = kzalloc_node(sizeof(*d), GFP_KERNEL, bdev_get_queue(bdev)->node);
+	if (!d) {
+		mutex_unlock(&dms_disks_lock);
+		return NULL;
+	}
+	d->dev = dev;
+	d->nid = bdev_get_queue(bdev)->node;
+	atomic_set(&d->inflight_ios, 0);
+	atomic_set(&d->inflight_sectors, 0);
+	spin_lock_init(&d->share_lock);
+	INIT_LIST_HEAD(&d->share_active);
+	INIT_WORK(&d->share_work, do_share_dispatch);
+	hash_add(dms_disks, &d->node, dev);
+found:
+	d->users++;
+	mutex_unlock(&dms_disks_lock);
+
+	return d;
+}
+
+static void __dms_disk_put(struct dms_disk *d)
+{
+	mutex_lock(&dms_disks_lock);
+	if (!--d->users) {
+		hash_del(&d->node);
+		cancel_work_sync(&d->share_work);
+		kfree(d);
+	}
+	mutex_unlock(&dms_disks_lock);
+}
+
+/* Attach leg m (no I/O on it) to the registry entry of its disk d */
+static void dms_disk_set(struct mirror *m, struct dms_disk *d)
+{
+	m->disk = d;
+	m->nid = d->nid;
+	INIT_LIST_HEAD(&m->share_active);
+	INIT_LIST_HEAD(&m->share_queue);
+	m->share_queued = 0;
+	m->share_deficit = 0;
+}
+
+static int dms_disk_get(struct mirror *m)
+{
+	struct dms_disk *d = __dms_disk_get(m->dev->bdev);
+
+	if (!d)
+		return -ENOMEM;
+
+	dms_disk_set(m, d);
+	return 0;
+}
+
+static void dms_disk_put(struct mirror *m)
+{
+	if (!m->disk)
+		return;
+
+	__dms_disk_put(m->disk);
+	m->disk = NULL;
+}
+
+/* Read latency of the disk (EWMA, 1/8 weight per read) */
+static inline void dms_disk_latency(struct mirror *m, struct dms_bio_map_info *bmi)
+{
+	unsigned long lat, ewma = READ_ONCE(m->disk->lat_us);
+
+	if ( unlikely(!bmi->start_ns) )
+		return;
+
+	lat = (unsigned long) div_u64(ktime_get_ns() - bmi->start_ns, NSEC_PER_USEC);
+	WRITE_ONCE(m->disk->lat_us, ewma ? ewma - (ewma >> 3) + (lat >> 3) : lat);
+}
+
+/* Expected wait of a read on the disk of leg m: the I/Os in flight on it
+ * (from all instances) times its read latency */
+static inline u64 dms_disk_load(struct mirror *m)
+{
+	return (u64) (atomic_read(&m->disk->inflight_ios) + 1) * max(READ_ONCE(m->disk->lat_us), 1UL);
+}
+
+/* What deferred writes wait for may have changed (a behind write or leg I/O
+ * completed, a leg failed, the journal was applied...): let them retry */
+static inline void dms_defer_kick(struct mirror_sync_set *ms)
+{
+	atomic_inc(&ms->defer_gen);
+	smp_mb__after_atomic(); /* pairs with dms_defer_add() */
+	if ( unlikely(waitqueue_active(&ms->defer_wait)) )
+		wake_up(&ms->defer_wait);
+	if ( READ_ONCE(ms->defer_queued) )
+		queue_work(dms_wq, &ms->defer_work);
+}
+
+/* In-flight I/O accounting of a leg, for the caps (io_cmd set_leg_caps)
+ * & the shared load of its disk... */
+static inline void dms_leg_issue(struct mirror *m, unsigned int sectors)
+{
+	atomic_inc(&m->inflight_ios);
+	atomic_add(sectors, &m->inflight_sectors);
+	atomic_inc(&m->disk->inflight_ios);
+	atomic_add(sectors, &m->disk->inflight_sectors);
+}
+
+static inline void dms_leg_done(struct mirror *m, unsigned int sectors)
+{
+	atomic_dec(&m->inflight_ios);
+	atomic_sub(sectors, &m->inflight_sectors);
+	atomic_dec(&m->disk->inflight_ios);
+	atomic_sub(sectors, &m->disk->inflight_sectors);
+	if ( unlikely(wq_has_sleeper(&m->ms->cap_wait)) )
+		wake_up(&m->ms->cap_wait);
+
+	/* writes deferred for the caps: see if they fit now */
+	if ( unlikely(atomic_read(&m->ms->cap_kb) | atomic_read(&m->ms->cap_ios)) )
+		dms_defer_kick(m->ms);
+}
+
+/* Is leg m at one of its in-flight caps? */
+static int dms_leg_capped(struct mirror *m)
+{
+	struct mirror_sync_set *ms = m->ms;
+	int cap_kb = atomic_read(&ms->cap_kb), cap_ios = atomic_read(&ms->cap_ios);
+
+	return (cap_ios && atomic_read(&m->inflight_ios) >= cap_ios) ||
+		   (cap_kb && atomic_read(&m->inflight_sectors) / 2 >= cap_kb);
+}
+
+/* Can a write go to the legs? Not while a live one is at its caps... */
+static int dms_legs_room(struct mirror_sync_set *ms)
+{
+	unsigned long live;
+	unsigned int i;
+
+	if ( likely(!atomic_read(&ms->cap_kb) && !atomic_read(&ms->cap_ios)) )
+		return 1;
+
+	live = dms_live_legs(ms);
+	for_each_set_bit(i, &live, ms->nr_mirrors)
+		if ( dms_leg_capped(ms->mirror + i) )
+			return 0;
+
+	return 1;
+}
+
+/* Region level check for reads: a recovering leg (e.g. one just added with
+ * "rebuild") can already serve reads for the regions it has caught up, and
+ * a write-behind leg for the sectors it has no writes in flight to... */
+static int
+mirror_read_ok( struct mirror *m, struct bio *bio )
+{
+	struct mirror_sync_set *ms = m->ms;
+	unsigned long first, last;
+
+	if ( !mirror_is_alive(m) || dms_journal_lagging(m) )
+		return 0;
+
+	if ( unlikely(atomic_read(&m->state) == DMS_LEG_RECOVERING) ) {
+		if ( !dms_bio_regions(ms, bio, &first, &last) || dms_region_in_copy(ms, m, first, last) )
+			return 0;
+		if ( find_next_bit(m->stale_map, last + 1, first) <= last )
+			return 0;
+	}
+
+	/* a write-behind leg may not have the latest data of these sectors yet */
+	return !dms_behind_overlap(m, bio);
 }
 
 /*---------------------------------------------------------------------------------- */
@@ -112,10 +565,10 @@ struct mirror *get_mirror_weight_max_live( struct mirror_sync_set *ms )
 	assert_bug( ms->nr_mirrors <= MAX_MIRRORS );
 	for (i = 0; i < ms->nr_mirrors; i++) {
 		mirr = ms->mirror + i;
-		if ( atomic_read( &ms->mirror_weights[i] ) > max &&
-				mirror_is_alive(mirr)) { /* alive? */
+		if ( atomic_read( &ms->mirror[i].weight ) > max &&
+				mirror_is_readable(mirr)) { /* alive & in sync? */
 			
-			max = atomic_read( &ms->mirror_weights[i] );
+			max = atomic_read( &ms->mirror[i].weight );
 			maxi = i;
 		}
 	}
@@ -136,16 +589,17 @@ struct mirror *get_mirror_weight_max_live( struct mirror_sync_set *ms )
 
 /* choose_read_mirror
  * @ms: the mirror set
- * @sector: logical sector no for read
+ * @bio: the read (its logical sector is used by the policies)
  *
  * This function is used for read balancing according to the policy set AND/OR
  * for redirecting reads to working mirrors on failures.
  *
  * Returns: chosen LIVE mirror, or NULL on failure of all mirrors
  */
-static struct mirror *choose_read_mirror(struct mirror_sync_set *ms, sector_t sector)
+static struct mirror *__choose_read_mirror(struct mirror_sync_set *ms, struct bio *bio)
 {
-	struct mirror *start_mirror, *curr_mirror, *ret =  ms->default_mirror;
+	struct mirror *start_mirror, *curr_mirror, *ret =  READ_ONCE(ms->default_mirror);
+	sector_t sector = bio->bi_iter.bi_sector;
 
 	switch( atomic_read( &ms->rdpolicy ) ) {
 		
@@ -164,12 +618,12 @@ static struct mirror *choose_read_mirror(struct mirror_sync_set *ms, sector_t se
 		ret = ms->mirror + mm; /* get the mirror index */
 
 		/* check if mirror has errors & deal with it... */
-		if (unlikely(!mirror_is_alive(ret))) {
+		if (unlikely(!mirror_read_ok(ret, bio))) {
 		
 			/* NOTE: on error, we switch to next-available-live mirror policy */
 			curr_mirror = start_mirror = ms->mirror + mm;
 			do {
-				if (likely(mirror_is_alive(ret)))
+				if (likely(mirror_read_ok(ret, bio)))
 					break;
 	
 				if (curr_mirror-- == ms->mirror)
@@ -182,7 +636,7 @@ static struct mirror *choose_read_mirror(struct mirror_sync_set *ms, sector_t se
 			 * We've rejected every mirror.
 			 * Confirm the default_mirror can be used.
 			 */
-			if (!mirror_is_alive(ret))
+			if (!mirror_read_ok(ret, bio))
 			      ret = NULL;
 		}
 	}
@@ -200,7 +654,7 @@ static struct mirror *choose_read_mirror(struct mirror_sync_set *ms, sector_t se
 		 */
 		ret = start_mirror = ms->read_mirror;
 		do {
-			if ( mirror_is_alive(ret) &&
+			if ( mirror_read_ok(ret, bio) &&
 				   !atomic_dec_and_test(&ms->rr_ios))
 				goto use_mirror;
 
@@ -217,7 +671,7 @@ static struct mirror *choose_read_mirror(struct mirror_sync_set *ms, sector_t se
 		 * FAILURE: We've rejected every mirror due to failures.
 		 * Confirm the start_mirror can be used.
 		 */
-		if (!mirror_is_alive(ret))
+		if (!mirror_read_ok(ret, bio))
 			ret = NULL;
 
 use_mirror:
@@ -230,23 +684,24 @@ use_mirror:
 	{
 		int maxi = atomic_read( &ms->mirror_weight_max_live );
 
-		assert_bug( ms->nr_mirrors < MAX_MIRRORS );
+		assert_bug( ms->nr_mirrors <= MAX_MIRRORS );
 		assert_bug( maxi >= 0 && maxi < ms->nr_mirrors );
 
 		/* get the pointer to the mirror with the current max weight => changes on failure/reconfig*/
 		ret = ms->mirror + maxi;
 
 		/* check if mirror has errors & deal with it... */
-		if (!mirror_is_alive(ret)) {
+		if (!mirror_read_ok(ret, bio)) {
 
 			curr_mirror = start_mirror = get_mirror_weight_max_live(ms);
-			if ( ! curr_mirror ) /* no live mirror found ! */
+			if ( ! curr_mirror ) { /* no live mirror found ! */
 				ret = NULL;
 				break;
+			}
 
 			ret = curr_mirror;
 			do {
-				if (mirror_is_alive(ret))
+				if (mirror_read_ok(ret, bio))
 					break;
 
 				curr_mirror = get_mirror_weight_max_live(ms); /* re-calc */
@@ -255,12 +710,56 @@ use_mirror:
 			} while (ret != start_mirror);
 
 			/*
-			 * We've rejected every mirror.
-			 * Confirm the default_mirror can be used.
+			 * The max weight leg can't serve this bio (its regions are stale, or
+			 * behind writes to them are in flight): the live leg with the highest
+			 * weight that can, as the other policies do.
 			 */
-			if (unlikely(!mirror_is_alive(ret)))
-			      ret = NULL;
+			if (unlikely(!mirror_read_ok(ret, bio))) {
+				unsigned long live = dms_live_legs(ms);
+				unsigned int i;
+
+				ret = NULL;
+				for_each_set_bit(i, &live, ms->nr_mirrors) {
+					curr_mirror = ms->mirror + i;
+					if ( mirror_read_ok(curr_mirror, bio) &&
+						 (!ret || atomic_read(&curr_mirror->weight) > atomic_read(&ret->weight)) )
+						ret = curr_mirror;
+				}
+			}
+		}
+	}
+	/* -------------------------------------------------*/
+	break;
+
+	case DMS_LEAST_LOAD:
+	/* -------------------------------------------------*/
+	{
+		struct mirror *last = READ_ONCE(ms->read_mirror);
+		unsigned long live = dms_live_legs(ms);
+		unsigned int i;
+		u64 load, min = 0;
+
+		/* the leg on the least loaded disk (by all instances on it)... */
+		ret = NULL;
+		for_each_set_bit(i, &live, ms->nr_mirrors) {
+			curr_mirror = ms->mirror + i;
+			if ( !mirror_read_ok(curr_mirror, bio) )
+				continue;
+			load = dms_disk_load(curr_mirror);
+			if (!ret || load < min) {
+				ret = curr_mirror;
+				min = load;
+			}
 		}
+
+		/* ...but stay on the last one (sequential reads), unless it is
+		 * more than ll_hyst % more loaded */
+		if ( ret && ret != last && mirror_read_ok(last, bio) &&
+			 dms_disk_load(last) * 100 <= min * (100 + atomic_read(&ms->ll_hyst)) )
+			ret = last;
+
+		if (ret)
+			WRITE_ONCE(ms->read_mirror, ret);
 	}
 	/* -------------------------------------------------*/
 	break;
@@ -270,17 +769,97 @@ use_mirror:
 }
 /*----------------------------------------------------------------- */
 
-static struct mirror *get_valid_mirror(struct mirror_sync_set *ms)
+/* Returns the first in-sync (i.e. not recovering or warming up) leg... */
+static struct mirror *get_insync_mirror(struct mirror_sync_set *ms)
 {
 	struct mirror *m;
 
 	for (m = ms->mirror; m < ms->mirror + ms->nr_mirrors; m++)
-		if ( mirror_is_alive(m) )
+		if ( mirror_is_alive(m) && atomic_read(&m->state) == DMS_LEG_INSYNC )
 			return m;
 
 	return NULL;
 }
 
+/* A leg on the NUMA node of the submitting CPU to read from instead of m (not
+ * there): the least loaded one there, unless it is more than numa_margin % more
+ * loaded than m, i.e. busy... */
+static struct mirror *dms_numa_leg(struct mirror_sync_set *ms, struct mirror *m, struct bio *bio)
+{
+	unsigned long live = dms_live_legs(ms);
+	int nid = numa_node_id();
+	struct mirror *alt, *best = NULL;
+	unsigned int i;
+	u64 load, min = 0;
+
+	for_each_set_bit(i, &live, ms->nr_mirrors) {
+		alt = ms->mirror + i;
+		if ( alt->nid != nid || atomic_read(&alt->state) != DMS_LEG_INSYNC ||
+			 !mirror_read_ok(alt, bio) )
+			continue;
+		load = dms_disk_load(alt);
+		if (!best || load < min) {
+			best = alt;
+			min = load;
+		}
+	}
+
+	if ( !best || dms_leg_capped(best) ||
+		 min * 100 > dms_disk_load(m) * (100 + atomic_read(&ms->numa_margin)) )
+		return m;
+
+	atomic_inc(&ms->numa_local);
+	return best;
+}
+
+/* choose_read_mirror
+ *
+ * Wrapper of the read policies: a reinstated leg that is warming up only gets
+ * warm_level out of DMS_WARM_STEPS of the reads that the policy sends to it,
+ * the rest go to an in-sync leg (if there is one)...
+ */
+static struct mirror *choose_read_mirror(struct mirror_sync_set *ms, struct bio *bio)
+{
+	struct mirror *m = __choose_read_mirror(ms, bio), *alt;
+
+	if ( m && unlikely(atomic_read(&m->state) == DMS_LEG_WARMING) &&
+		 (atomic_inc_return(&m->warm_reads) % DMS_WARM_STEPS) >= atomic_read(&m->warm_level) ) {
+
+		alt = get_insync_mirror(ms);
+		if (alt)
+			m = alt;
+	}
+
+	/* legs on the node of the submitting CPU first (io_cmd set_numa_reads) */
+	if ( m && unlikely(atomic_read(&ms->numa_reads)) && m->nid != numa_node_id() )
+		m = dms_numa_leg(ms, m, bio);
+
+	/* a leg at its in-flight caps is passed over, if another one can serve the read */
+	if ( m && unlikely(dms_leg_capped(m)) ) {
+		for (alt = ms->mirror; alt < ms->mirror + ms->nr_mirrors; alt++)
+			if ( alt != m && !dms_leg_capped(alt) && mirror_read_ok(alt, bio) ) {
+				m = alt;
+				break;
+			}
+	}
+
+	return m;
+}
+/*----------------------------------------------------------------- */
+
+static struct mirror *get_valid_mirror(struct mirror_sync_set *ms)
+{
+	unsigned long live = dms_live_legs(ms);
+	unsigned int i;
+
+	for_each_set_bit(i, &live, ms->nr_mirrors)
+		if ( atomic_read(&ms->mirror[i].state) != DMS_LEG_RECOVERING &&
+			 !dms_journal_lagging(ms->mirror + i) )
+			return ms->mirror + i;
+
+	return NULL;
+}
+
 /*----------------------------------------------------------------- */
 
 /* fail_mirror
@@ -311,6 +890,26 @@ static void fail_mirror(struct mirror *m, enum dm_raid1_error error_type)
 	set_bit( DM_RAID1_WRITE_ERROR, &m->error_type);
 	set_bit( DM_RAID1_SYNC_ERROR, &m->error_type);
 	set_bit( DM_RAID1_READ_ERROR, &m->error_type);
+	clear_bit(m - ms->mirror, &ms->live_mask);
+
+	/* from now on the writes it misses are tracked in its stale_map,
+	 * and it has to catch them up if the prober reinstates it... */
+	atomic_set(&m->state, DMS_LEG_RECOVERING);
+	atomic_set(&m->probe_ok, 0);
+	WRITE_ONCE(ms->heat_on, 1); /* find the hot regions to catch up first */
+
+	/* the writes it lags behind by (async leg) are stale too... */
+	dms_behind_fail(m);
+
+	/* writes deferred for it (caps, behind writes) go on without it */
+	wake_up_all(&ms->cap_wait);
+	dms_defer_kick(ms);
+
+	/* ...and its journal entries get dropped, don't wait for them */
+	if (m == ms->jr_leg) {
+		queue_work(dms_jr_wq, &ms->jr_work);
+		wake_up_all(&ms->jr_wait);
+	}
 
 	if ( atomic_read(&m->error_count) < DMS_MAX_ERRORS ) {
 		char b[BDEVNAME_SIZE];
@@ -320,13 +919,14 @@ static void fail_mirror(struct mirror *m, enum dm_raid1_error error_type)
 	}
 
 	/*
-	 * If the default mirror fails, change it.
+	 * If the default mirror fails, change it (unless a concurrent failure
+	 * or the resync already did).
 	 */
-	if (m == ms->default_mirror) {
+	if (m == READ_ONCE(ms->default_mirror)) {
 
 		new = get_valid_mirror(ms);
 		if (new)
-			ms->default_mirror = new;
+			cmpxchg(&ms->default_mirror, m, new);
 		else {
 			unsigned int maxlen = 256;
 			char buf[ maxlen ];
@@ -339,7 +939,7 @@ static void fail_mirror(struct mirror *m, enum dm_raid1_error error_type)
 		}
 	}
 
-	schedule_work(&ms->trigger_event);
+	queue_work(dms_wq, &ms->trigger_event);
 }
 
 /*----------------------------------------------------------------- */
@@ -394,52 +994,2022 @@ static void trigger_event(struct work_struct *work)
 }
 
 /*-----------------------------------------------------------------
- *  I/O handler functions (reads/writes/etc.)
+ *  Stale region tracking, health probing & reinstatement of legs
  *---------------------------------------------------------------*/
 
-/*----------------------------------------------------------------- */
-#ifdef DEBUG_WRITE_TO_SINGLE_MIRROR
-// supports only a SINGLE write case... debug leftover...
-static void dispatch_bio( struct dms_bio_map_info *bmi, struct bio *bio, int rw )
+/* Record that the data of a write never made it to leg m... */
+static void dms_mark_stale(struct mirror *m, struct bio *bio)
 {
-	if (rw == WRITE) {
-		DMSDEBUG("dispatch_bio() WRITE enter...\n");
-		// FIXME: this goes to the default mirror for now...
-		map_bio( bmi->bmi_m, bio);
-		generic_make_request(bio);
-		//DMSDEBUG("dispatch_bio() WRITE exit...\n");
+	unsigned long r, first, last;
+
+	if (!dms_bio_regions(m->ms, bio, &first, &last))
 		return;
-	}
 
-	/* All about the reads now */
-	DMSDEBUG("dispatch_bio() READ enter...\n");
-	read_async_bio( bmi, bio);
-	DMSDEBUG("dispatch_bio() READ exit...\n");
+	for (r = first; r <= last; r++)
+		set_bit(r, m->stale_map);
 }
-#endif
-
-/* ----------------------------------------------------------------
- * Queue bio function -> queues failed bios for retry in thread...
- */
 
-static void queue_bio(struct mirror_sync_set *ms, struct bio *bio, int rw)
+/* Same, for nr sectors from (target) sector... */
+static void dms_mark_stale_range(struct mirror *m, sector_t sector, unsigned int nr)
 {
-	unsigned long flags;
-	int should_wake = 0;
-	struct bio_list *bl;
+	unsigned long r;
 
-	bl = &ms->read_failures;
-	spin_lock_irqsave(&ms->lock, flags);
-	should_wake = !(bl->head);
-	bio_list_add(bl, bio);
-	spin_unlock_irqrestore(&ms->lock, flags);
+	if (!nr)
+		return;
 
-	if (should_wake)
-		wake(ms);
+	for (r = sector >> DMS_REGION_SHIFT; r <= (sector + nr - 1) >> DMS_REGION_SHIFT; r++)
+		set_bit(r, m->stale_map);
 }
 
-/*-----------------------------------------------------------------
- * CAUTION: AFTER ALL async I/O we MUST call unplug! Else the I/O will not
+/* Should this write skip a recovering leg? It does if any of its regions is
+ * still stale on the leg (it will be copied later anyway), or is being copied
+ * right now (the copy may read the source before this write lands there). */
+static int dms_resync_skip_leg(struct mirror *m, struct bio *bio)
+{
+	struct mirror_sync_set *ms = m->ms;
+	unsigned long first, last;
+
+	if (!dms_bio_regions(ms, bio, &first, &last))
+		return 0;
+
+	if ( find_next_bit(m->stale_map, last + 1, first) <= last ||
+		 dms_region_in_copy(ms, m, first, last) ) {
+
+		dms_mark_stale(m, bio); /* NOTE: re-dirties a region being copied */
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Writes are counted in the current epoch, so that a region copy can wait for
+ * all the writes that were issued before it started (see dms_resync_batch()). */
+static unsigned int dms_write_epoch_enter(struct mirror_sync_set *ms)
+{
+	unsigned int e;
+
+	for (;;) {
+		e = READ_ONCE(ms->resync_epoch);
+		atomic_inc(&ms->resync_inflight[e]);
+		smp_mb__after_atomic();
+		if (likely(READ_ONCE(ms->resync_epoch) == e))
+			return e;
+
+		/* raced with an epoch flip, retry in the new one... */
+		if (atomic_dec_and_test(&ms->resync_inflight[e]))
+			wake_up(&ms->resync_wait);
+	}
+}
+
+static void dms_write_epoch_exit(struct mirror_sync_set *ms, unsigned int e)
+{
+	if (atomic_dec_and_test(&ms->resync_inflight[e]))
+		wake_up(&ms->resync_wait);
+}
+
+/* A write completes once its legs (dm_io) and its journal entry, if any, are done */
+static void dms_write_done(struct bio *bio)
+{
+	struct dms_bio_map_info *bmi = bio_get_m(bio);
+
+	assert( bmi ); /* bug trap... */
+	if ( !atomic_dec_and_test(&bmi->bmi_wait) )
+		return;
+
+	dms_write_epoch_exit(bmi->bmi_ms, bmi->resync_epoch);
+	bio_set_m(bio, NULL);
+
+	/* a flush round leader completes the flushes merged into it */
+	if ( unlikely(bio == READ_ONCE(bmi->bmi_ms->flush_leader)) )
+		dms_flush_end(bmi->bmi_ms, bio);
+	bio_endio(bio);
+}
+
+/*----------------------------------------------------------------- */
+
+static void dms_probe_put(struct dms_probe *p)
+{
+	if ( atomic_dec_and_test(&p->refs) ) {
+		__free_page(p->page);
+		kfree(p);
+	}
+}
+
+static void probe_endio(struct bio *bio)
+{
+	struct dms_probe *p = bio->bi_private;
+
+	WRITE_ONCE(p->state, bio->bi_error ? DMS_PROBE_FAILED : DMS_PROBE_OK);
+	bio_put(bio);
+	dms_probe_put(p);
+}
+
+/* Forget the test read of leg m (its result is stale), done or not */
+static void dms_probe_drop(struct mirror *m)
+{
+	if (m->probe) {
+		dms_probe_put(m->probe);
+		m->probe = NULL;
+	}
+}
+
+/* Small test read from a failed leg: returns 1 if the last one succeeded, and
+ * issues the next one (none while the last one is still in flight, hung leg) */
+static int dms_probe_read(struct mirror *m)
+{
+	struct mirror_sync_set *ms = m->ms;
+	struct dms_probe *p = m->probe;
+	struct bio *bio;
+	sector_t sector;
+	int ret = 0;
+
+	if (p) {
+		if ( READ_ONCE(p->state) == DMS_PROBE_INFLIGHT )
+			return 0;
+		ret = p->state == DMS_PROBE_OK;
+		dms_probe_drop(m);
+	}
+
+	/* rotate the probed region, so that we don't just hit the device cache */
+	sector = (sector_t) (atomic_inc_return(&m->probe_seq) % ms->nr_regions) << DMS_REGION_SHIFT;
+	if (sector + (PAGE_SIZE >> 9) > ms->ti->len)
+		sector = 0;
+
+	p = kzalloc(sizeof(*p), GFP_NOIO);
+	if (!p)
+		return ret;
+	p->page = alloc_pages_node(m->nid, GFP_NOIO, 0);
+	bio = bio_alloc(GFP_NOIO, 1);
+	if ( !p->page || !bio || !bio_add_page(bio, p->page, PAGE_SIZE, 0) ) {
+		if (bio)
+			bio_put(bio);
+		if (p->page)
+			__free_page(p->page);
+		kfree(p);
+		return ret;
+	}
+
+	atomic_set(&p->refs, 2); /* the leg's & the bio's */
+	p->state = DMS_PROBE_INFLIGHT;
+	bio->bi_bdev = m->dev->bdev;
+	bio->bi_iter.bi_sector = m->offset + sector;
+	bio_set_op_attrs(bio, REQ_OP_READ, REQ_SYNC);
+	bio->bi_end_io = probe_endio;
+	bio->bi_private = p;
+	m->probe = p;
+	generic_make_request(bio);
+
+	return ret;
+}
+
+/* Put a failed leg back in the set: it gets writes from now on, and the
+ * resync work catches up its stale regions before it gets any reads. */
+static void reinstate_mirror(struct mirror *m)
+{
+	struct mirror_sync_set *ms = m->ms;
+	char b[BDEVNAME_SIZE];
+
+	assert( atomic_read(&m->state) == DMS_LEG_RECOVERING );
+	atomic_set(&m->probe_ok, 0);
+	atomic_set(&m->warm_level, 0);
+	atomic_set(&m->warm_reads, 0);
+	WRITE_ONCE(ms->resync_hot_pass, 1);
+	WRITE_ONCE(m->flush_gen, atomic_read(&m->wr_gen) - 1); /* flush it next time */
+
+	smp_mb__before_atomic();
+	atomic_set(&m->error_count, 0);
+	clear_bit( DM_RAID1_READ_ERROR, &m->error_type);
+	clear_bit( DM_RAID1_SYNC_ERROR, &m->error_type);
+	clear_bit( DM_RAID1_WRITE_ERROR, &m->error_type);
+	smp_mb__before_atomic();
+	set_bit(m - ms->mirror, &ms->live_mask);
+
+	DMWARN("[%s] Mirror device %s (%s) is back ONLINE, catching up %d stale regions", ms->name,
+			m->dev->name, bdevname(m->dev->bdev, b), bitmap_weight(m->stale_map, ms->nr_regions));
+
+	queue_work(dms_wq, &ms->trigger_event);
+	queue_work(system_long_wq, &ms->resync_work);
+}
+
+/*----------------------------------------------------------------- */
+
+/* The heat of region r, halved for every decay round since it was last looked at.
+ * NOTE: the rounds are counted mod 256, a region left alone for that long may
+ * come back a bit warmer than it should, which only reorders its copy... */
+static unsigned char dms_heat_get(struct mirror_sync_set *ms, unsigned long r)
+{
+	unsigned char round = READ_ONCE(ms->heat_round);
+	unsigned char age = round - ms->heat_gen[r];
+	unsigned char h = ms->heat[r];
+
+	if (age) {
+		h = age >= 8 ? 0 : h >> age;
+		ms->heat[r] = h;
+		ms->heat_gen[r] = round;
+	}
+	return h;
+}
+
+/* Track the heat of the regions a bio covers, while some leg is being caught up.
+ * Regions that turn hot go to a small ring, so that the resync copies them next. */
+static void dms_heat_bio(struct mirror_sync_set *ms, struct bio *bio)
+{
+	unsigned long r, first, last;
+	unsigned char h;
+
+	if ( likely(!READ_ONCE(ms->heat_on)) || !dms_bio_regions(ms, bio, &first, &last) )
+		return;
+
+	for (r = first; r <= last; r++) {
+		/* NOTE: racy by design, a lost update here just makes a region a bit cooler... */
+		h = dms_heat_get(ms, r);
+		if (h == 255)
+			continue;
+		ms->heat[r] = h + 1;
+		if (h + 1 == DMS_HEAT_HOT)
+			WRITE_ONCE(ms->hot_ring[atomic_inc_return(&ms->hot_head) % DMS_HOT_RING], r);
+	}
+}
+
+/* Called every housekeeping round: halve all the region heat (lazily, see dms_heat_get()),
+ * and stop the tracking when all legs are in sync... */
+static void dms_heat_decay(struct mirror_sync_set *ms)
+{
+	struct mirror *m;
+	int on = 0;
+
+	for (m = ms->mirror; m < ms->mirror + ms->nr_mirrors; m++)
+		if ( atomic_read(&m->state) != DMS_LEG_INSYNC || !mirror_is_alive(m) )
+			on = 1;
+
+	if ( READ_ONCE(ms->heat_on) )
+		WRITE_ONCE(ms->heat_round, ms->heat_round + 1);
+
+	WRITE_ONCE(ms->heat_on, on);
+}
+
+/* Foreground latency (EWMA, 1/8 weight per I/O) of completed reads & writes, for
+ * pacing the resync. The baseline (1/64 weight) only follows while no resync
+ * copies are in flight... */
+static void dms_account_latency(struct mirror_sync_set *ms, struct dms_bio_map_info *bmi)
+{
+	unsigned long lat, ewma;
+
+	if ( unlikely(!bmi->start_ns) )
+		return;
+
+	lat = (unsigned long) div_u64(ktime_get_ns() - bmi->start_ns, NSEC_PER_USEC);
+
+	ewma = READ_ONCE(ms->fg_lat_us);
+	WRITE_ONCE(ms->fg_lat_us, ewma - (ewma >> 3) + (lat >> 3));
+
+	if ( !READ_ONCE(ms->resync_busy) ) {
+		ewma = READ_ONCE(ms->fg_lat_base_us);
+		WRITE_ONCE(ms->fg_lat_base_us, ewma ? ewma - (ewma >> 6) + (lat >> 6) : lat);
+	}
+}
+
+/*----------------------------------------------------------------- */
+
+struct dms_resync_batch {
+	atomic_t pending;
+	struct completion done;
+	struct dms_resync_job {
+		struct dms_resync_batch *batch;
+		struct mirror *src;
+		int read_err;
+		unsigned long write_err;
+	} job[DMS_RESYNC_MAX_SRCS];
+};
+
+static void resync_callback(int read_err, unsigned long write_err, void *context)
+{
+	struct dms_resync_job *job = context;
+
+	job->read_err = read_err;
+	job->write_err = write_err;
+	if (atomic_dec_and_test(&job->batch->pending))
+		complete(&job->batch->done);
+}
+
+static int dms_region_listed(unsigned long *regions, unsigned int n, unsigned long r)
+{
+	while (n--)
+		if (regions[n] == r)
+			return 1;
+	return 0;
+}
+
+/* Pick up to max stale regions of leg m to copy next: first the regions that
+ * recently turned hot, then the next ones of the stale map sweep. The first sweep
+ * after a leg starts recovering only takes hot regions (bounded scan), the later
+ * sweeps take them all. Returns the number of regions picked, 0 when m is in sync. */
+static unsigned int dms_resync_pick(struct mirror_sync_set *ms, struct mirror *m,
+									unsigned long *regions, unsigned int max)
+{
+	unsigned int i, n = 0, scanned = 0, wraps = 0;
+	unsigned long r;
+
+	for (i = 0; i < DMS_HOT_RING && n < max; i++) {
+		r = READ_ONCE(ms->hot_ring[i]);
+		if ( r < ms->nr_regions && test_bit(r, m->stale_map) &&
+			 !dms_region_listed(regions, n, r) )
+			regions[n++] = r;
+	}
+
+	r = ms->resync_cursor;
+	while ( n < max && wraps < 2 ) {
+
+		r = find_next_bit(m->stale_map, ms->nr_regions, r);
+		if (r >= ms->nr_regions) {
+			r = 0;
+			wraps++;
+			ms->resync_hot_pass = 0;
+			continue;
+		}
+
+		if ( dms_region_listed(regions, n, r) ) {
+			r++;
+			continue;
+		}
+
+		/* cold region in the hot pass: skip it, unless we scanned enough for now */
+		if ( ms->resync_hot_pass && dms_heat_get(ms, r) < DMS_HEAT_HOT ) {
+			if ( ++scanned < DMS_RESYNC_SCAN ) {
+				r++;
+				continue;
+			}
+			if (n)
+				break;
+		}
+
+		regions[n++] = r++;
+	}
+
+	ms->resync_cursor = r;
+	return n;
+}
+
+/* Copy a batch of stale regions to the recovering leg m, each region from a
+ * different in-sync leg (srcs[]), all in parallel. Returns the bytes copied. */
+static unsigned long long dms_resync_batch(struct mirror_sync_set *ms, struct mirror *m,
+										   struct mirror **srcs, unsigned long *regions,
+										   unsigned int n)
+{
+	struct dms_resync_batch b, *batch = &b;
+	struct dm_io_region from, to;
+	unsigned long long bytes = 0;
+	sector_t sector;
+	unsigned int i, old;
+
+	/* CAUTION: the order matters here! We clear the stale bits first and then
+	 * publish the regions, so a write that races with us either re-dirties a
+	 * region or is counted in the old epoch, which we drain before copying. */
+	for (i = 0; i < n; i++) {
+		clear_bit(regions[i], m->stale_map);
+		ms->resync_batch[i] = regions[i];
+	}
+	WRITE_ONCE(ms->resync_mirror, m);
+	smp_wmb();
+	atomic_set(&ms->resync_nr, n);
+	smp_mb();
+
+	old = ms->resync_epoch;
+	WRITE_ONCE(ms->resync_epoch, old ^ 1);
+	smp_mb();
+	wait_event(ms->resync_wait, !atomic_read(&ms->resync_inflight[old]));
+
+	WRITE_ONCE(ms->resync_busy, 1);
+	init_completion(&batch->done);
+	atomic_set(&batch->pending, n + 1);
+
+	for (i = 0; i < n; i++) {
+		struct dms_resync_job *job = &batch->job[i];
+
+		sector = (sector_t) regions[i] << DMS_REGION_SHIFT;
+		from.bdev = srcs[i]->dev->bdev;
+		from.sector = srcs[i]->offset + sector;
+		from.count = min_t(sector_t, 1 << DMS_REGION_SHIFT, ms->ti->len - sector);
+		to.bdev = m->dev->bdev;
+		to.sector = m->offset + sector;
+		to.count = from.count;
+
+		job->batch = batch;
+		job->src = srcs[i];
+		job->read_err = 0;
+		job->write_err = 0;
+		if (dm_kcopyd_copy(ms->kcopyd_client, &from, 1, &to, 0, resync_callback, job)) {
+			job->read_err = 1;
+			atomic_dec(&batch->pending);
+		}
+	}
+
+	if (!atomic_dec_and_test(&batch->pending))
+		wait_for_completion(&batch->done);
+	atomic_inc(&m->wr_gen); /* the copies need a flush of the leg too */
+
+	WRITE_ONCE(ms->resync_busy, 0);
+	atomic_set(&ms->resync_nr, 0);
+	smp_wmb();
+	WRITE_ONCE(ms->resync_mirror, NULL);
+	smp_mb();
+
+	for (i = 0; i < n; i++) {
+		struct dms_resync_job *job = &batch->job[i];
+
+		if (unlikely(job->read_err || job->write_err)) {
+
+			set_bit(regions[i], m->stale_map); /* still stale... */
+
+			if (job->read_err)
+				fail_mirror(job->src, DM_RAID1_READ_ERROR);
+			if (job->write_err)
+				fail_mirror(m, DM_RAID1_WRITE_ERROR);
+			continue;
+		}
+
+		sector = (sector_t) regions[i] << DMS_REGION_SHIFT;
+		bytes += to_bytes( min_t(sector_t, 1 << DMS_REGION_SHIFT, ms->ti->len - sector) );
+		atomic_inc(&ms->resync_regions_done);
+	}
+
+	return bytes;
+}
+
+/* Returns the next alive leg with stale regions to catch up... */
+static struct mirror *get_recovering_mirror(struct mirror_sync_set *ms)
+{
+	struct mirror *m;
+
+	for (m = ms->mirror; m < ms->mirror + ms->nr_mirrors; m++)
+		if ( mirror_is_alive(m) && atomic_read(&m->state) == DMS_LEG_RECOVERING )
+			return m;
+
+	return NULL;
+}
+
+/* Collect the legs to copy from: the readable legs that are not being caught up
+ * (up to DMS_RESYNC_MAX_SRCS of them)... */
+static unsigned int get_resync_sources(struct mirror_sync_set *ms, struct mirror **srcs)
+{
+	struct mirror *m;
+	unsigned int n = 0;
+
+	for (m = ms->mirror; m < ms->mirror + ms->nr_mirrors && n < DMS_RESYNC_MAX_SRCS; m++)
+		if ( mirror_is_readable(m) )
+			srcs[n++] = m;
+
+	return n;
+}
+
+/* Sleep (in small steps, to notice a stop) for msecs... */
+static void dms_resync_sleep(struct mirror_sync_set *ms, unsigned int msecs)
+{
+	unsigned long end = jiffies + msecs_to_jiffies(msecs);
+
+	while ( time_before(jiffies, end) && !atomic_read(&ms->resync_stop) )
+		msleep_interruptible( min_t(unsigned int, jiffies_to_msecs(end - jiffies), 100) );
+}
+
+/* Pace the copies: back off (double the pause between batches) while the
+ * foreground latency is above DMS_RESYNC_LAT_FACTOR x its baseline, speed up
+ * (halve the pause) otherwise; and stay under the resync_rate cap if one is set. */
+static void dms_resync_throttle(struct mirror_sync_set *ms, unsigned long *wstart,
+								unsigned long long *wbytes, unsigned int *fg_ios)
+{
+	unsigned int rate = atomic_read(&ms->resync_rate);
+	unsigned int elapsed, ios, delay = ms->resync_delay_ms;
+	unsigned long lat = READ_ONCE(ms->fg_lat_us), base = READ_ONCE(ms->fg_lat_base_us);
+	unsigned long long due;
+
+	/* no foreground I/O completed since the last batch => nobody to slow down */
+	ios = atomic_read(&ms->read_ios_total) + atomic_read(&ms->write_ios_total);
+	if ( ios != *fg_ios && base && lat > base * DMS_RESYNC_LAT_FACTOR )
+		delay = min(delay * 2 + 1, (unsigned int) DMS_RESYNC_MAX_DELAY);
+	else
+		delay >>= 1;
+	*fg_ios = ios;
+	ms->resync_delay_ms = delay;
+
+	if (delay)
+		dms_resync_sleep(ms, delay);
+
+	elapsed = jiffies_to_msecs(jiffies - *wstart);
+	if (rate) {
+		due = div_u64(*wbytes * MSEC_PER_SEC, rate * 1024);
+		if (due > elapsed)
+			dms_resync_sleep(ms, due - elapsed);
+		elapsed = jiffies_to_msecs(jiffies - *wstart);
+	}
+
+	if (elapsed >= DMS_RESYNC_RATE_WINDOW) {
+		atomic_set(&ms->resync_kbps, div_u64(*wbytes * MSEC_PER_SEC, elapsed * 1024ULL));
+		*wstart = jiffies;
+		*wbytes = 0;
+	}
+}
+
+/* Resync work: catch up the stale regions of all reinstated legs, copying a batch
+ * of regions at a time from all in-sync legs in parallel, hot regions first; then
+ * let the legs into read selection gradually (warming). */
+static void do_resync(struct work_struct *work)
+{
+	struct mirror_sync_set *ms = container_of(work, struct mirror_sync_set, resync_work);
+	struct mirror *m, *srcs[DMS_RESYNC_MAX_SRCS];
+	unsigned long regions[DMS_RESYNC_MAX_SRCS], wstart = jiffies;
+	unsigned long long wbytes = 0;
+	unsigned int n, nr_srcs, fg_ios = 0;
+
+	DMSDEBUG_CALL("do_resync() ENTERING...\n");
+
+	/* NOTE: the kcopyd client (a thread, a dm_io client & a page pool) only lives
+	 * while a resync runs, most instances never need one */
+	ms->kcopyd_client = dm_kcopyd_client_create(&dm_kcopyd_throttle);
+	if ( IS_ERR(ms->kcopyd_client) ) {
+		DMERR("[%s] Error creating kcopyd client, no resync until the next one", ms->name);
+		ms->kcopyd_client = NULL;
+		return;
+	}
+
+	WRITE_ONCE(ms->heat_on, 1);
+	ms->resync_delay_ms = 0;
+
+	while ( !atomic_read(&ms->resync_stop) && (m = get_recovering_mirror(ms)) ) {
+
+		nr_srcs = get_resync_sources(ms, srcs);
+		if (!nr_srcs) {
+			DMERR("[%s] No in-sync mirror device to resync from!", ms->name);
+			break;
+		}
+
+		n = dms_resync_pick(ms, m, regions, nr_srcs);
+		if (!n) {
+			char b[BDEVNAME_SIZE];
+
+			atomic_set(&m->state, DMS_LEG_WARMING);
+			if ( !mirror_is_readable(READ_ONCE(ms->default_mirror)) )
+				WRITE_ONCE(ms->default_mirror, m);
+			get_mirror_weight_max_live( ms ); /* re-calc mirror_weight_max_live */
+
+			DMINFO("[%s] Mirror device %s (%s) caught up, returning to read selection",
+					ms->name, m->dev->name, bdevname(m->dev->bdev, b));
+			queue_work(dms_wq, &ms->trigger_event);
+			continue;
+		}
+
+		wbytes += dms_resync_batch(ms, m, srcs, regions, n);
+
+		dms_resync_throttle(ms, &wstart, &wbytes, &fg_ios);
+		cond_resched();
+	}
+
+	dm_kcopyd_client_destroy(ms->kcopyd_client);
+	ms->kcopyd_client = NULL;
+	atomic_set(&ms->resync_kbps, 0);
+	ms->resync_delay_ms = 0;
+}
+
+/*----------------------------------------------------------------- */
+
+/* Health prober: issues small test reads to failed legs and reinstates them after
+ * probe_threshold consecutive successes (a read still in flight is a failure). */
+static void do_probe(struct work_struct *work)
+{
+	struct mirror_sync_set *ms = container_of(to_delayed_work(work), struct mirror_sync_set, probe_work);
+	unsigned int interval;
+	struct mirror *m;
+
+	for (m = ms->mirror; m < ms->mirror + ms->nr_mirrors; m++) {
+
+		if ( atomic_read(&ms->resync_stop) )
+			return;
+
+		/* out of the set, until attached again */
+		if ( mirror_is_alive(m) || dms_leg_detached(m) ) {
+			dms_probe_drop(m);
+			continue;
+		}
+
+		if ( dms_probe_read(m) ) {
+			if ( atomic_inc_return(&m->probe_ok) >= atomic_read(&ms->probe_threshold) ) {
+				dms_probe_drop(m);
+				reinstate_mirror(m);
+			}
+		} else
+			atomic_set(&m->probe_ok, 0);
+	}
+
+	interval = atomic_read(&ms->probe_interval);
+	if ( interval && !atomic_read(&ms->resync_stop) )
+		queue_delayed_work(system_long_wq, &ms->probe_work, msecs_to_jiffies(interval));
+}
+
+/* Housekeeping, whatever the probe interval: ramps up the read share of warming
+ * legs, decays the region heat & forgets the caught-up regions of async legs */
+static void do_tick(struct work_struct *work)
+{
+	struct mirror_sync_set *ms = container_of(to_delayed_work(work), struct mirror_sync_set, tick_work);
+	struct mirror *m;
+
+	for (m = ms->mirror; m < ms->mirror + ms->nr_mirrors; m++)
+		if ( mirror_is_alive(m) && atomic_read(&m->state) == DMS_LEG_WARMING &&
+			 atomic_inc_return(&m->warm_level) >= DMS_WARM_STEPS )
+			atomic_set(&m->state, DMS_LEG_INSYNC);
+
+	dms_heat_decay(ms);
+	dms_behind_clean(ms);
+
+	if ( !atomic_read(&ms->resync_stop) )
+		queue_delayed_work(system_wq, &ms->tick_work, msecs_to_jiffies(DMS_TICK_INTERVAL));
+}
+
+static void dms_start_probe(struct mirror_sync_set *ms)
+{
+	unsigned int interval = atomic_read(&ms->probe_interval);
+
+	atomic_set(&ms->resync_stop, 0);
+	if (interval)
+		mod_delayed_work(system_long_wq, &ms->probe_work, msecs_to_jiffies(interval));
+	mod_delayed_work(system_wq, &ms->tick_work, msecs_to_jiffies(DMS_TICK_INTERVAL));
+	if ( get_recovering_mirror(ms) )
+		queue_work(system_long_wq, &ms->resync_work);
+}
+
+/* NOTE: may block until a region copy in progress completes (not for the test
+ * reads in flight, see struct dms_probe)... */
+static void dms_stop_probe(struct mirror_sync_set *ms)
+{
+	atomic_set(&ms->resync_stop, 1);
+	cancel_delayed_work_sync(&ms->probe_work);
+	cancel_delayed_work_sync(&ms->tick_work);
+	cancel_work_sync(&ms->resync_work);
+}
+
+/*-----------------------------------------------------------------
+ *  Write-behind (async) legs
+ *---------------------------------------------------------------*/
+
+/* Is there room for another behind write to leg m? Called with behind_lock held */
+static int dms_behind_room(struct mirror *m, unsigned int sectors)
+{
+	struct mirror_sync_set *ms = m->ms;
+	struct dms_behind_io *oldest;
+
+	if ( list_empty(&m->behind_list) )
+		return 1; /* always let one in, whatever its size */
+
+	if ( (atomic_read(&m->behind_sectors) + sectors) / 2 > atomic_read(&ms->behind_max_kb) )
+		return 0;
+
+	oldest = list_first_entry(&m->behind_list, struct dms_behind_io, list);
+	return jiffies_to_msecs(jiffies - oldest->issued) <= atomic_read(&ms->behind_max_lag);
+}
+
+/* Try to add a behind write to the in-flight set of leg m. Fails while the leg
+ * lags too far behind, or a write to the same sectors is still in flight to it
+ * (CAUTION: the block layer doesn't order them, the older one could land last!) */
+static int dms_behind_add(struct mirror *m, struct dms_behind_io *io)
+{
+	unsigned long flags, r;
+	int ret = 0;
+
+	spin_lock_irqsave(&m->behind_lock, flags);
+
+	if ( !dms_behind_room(m, io->sectors) ||
+		 (io->sectors && dms_behind_it_iter_first(&m->behind_tree, io->start, io->last)) )
+		goto out;
+
+	if (io->sectors) {
+		dms_behind_it_insert(io, &m->behind_tree);
+		for (r = io->start >> DMS_REGION_SHIFT; r <= io->last >> DMS_REGION_SHIFT; r++)
+			set_bit(r, m->behind_map);
+	}
+	list_add_tail(&io->list, &m->behind_list);
+	io->issued = jiffies;
+	atomic_add(io->sectors, &m->behind_sectors);
+	atomic_inc(&m->behind_ios);
+	ret = 1;
+out:
+	spin_unlock_irqrestore(&m->behind_lock, flags);
+	return ret;
+}
+
+static void dms_behind_free(struct bio *bio)
+{
+	struct bio_vec *bv;
+	int i;
+
+	bio_for_each_segment_all(bv, bio, i)
+		__free_page(bv->bv_page);
+	bio_put(bio);
+}
+
+/* A write issued to each leg separately, on a shared copy of its data, that
+ * completes once "need" legs acked it. The legs that didn't ack yet (stragglers)
+ * are tracked like behind writes (dms_behind_io) until they finish... */
+struct dms_quorum_io {
+	struct mirror_sync_set *ms;
+	struct bio *bio;			/* the original write */
+	atomic_t pending;			/* leg writes in flight (+1 while issuing) */
+	atomic_t acks;
+	atomic_t finished;			/* legs done (acked or failed) */
+	unsigned int need;
+	unsigned int nr_legs;
+	unsigned int epoch;
+	unsigned int nr_pages;
+	struct page *pages[0];
+};
+
+/* The legs of a quorum write are done, as for write_callback()... */
+static void dms_quorum_end(struct dms_quorum_io *q, int error)
+{
+	struct mirror_sync_set *ms = q->ms;
+	struct bio *bio = q->bio;
+	struct dms_bio_map_info *bmi = bio_get_m(bio);
+
+	assert( bmi ); /* bug trap... */
+
+	if ( error && atomic_read( &ms->supress_err_messages ) < MAX_ERR_MESSAGES ) {
+		DMERR("[%s] All mirror devices dead, failing I/O write", ms->name);
+		atomic_inc( &ms->supress_err_messages );
+	}
+
+	if ( atomic_read(&q->finished) < q->nr_legs )
+		atomic_inc(&ms->quorum_early);
+
+	bio->bi_error = error;
+	dms_write_done(bio);
+}
+
+/* A leg write of a quorum write is done (or was never issued), or the issuer
+ * dropped its ref (leg == 0)... */
+static void dms_quorum_put(struct dms_quorum_io *q, int leg, int ack)
+{
+	unsigned int i, acks;
+
+	if (leg)
+		atomic_inc(&q->finished);
+	if ( ack && atomic_inc_return(&q->acks) == q->need )
+		dms_quorum_end(q, 0);
+
+	if ( !atomic_dec_and_test(&q->pending) )
+		return;
+
+	/* all legs done: did anyone survive, if we didn't get the quorum? */
+	acks = atomic_read(&q->acks);
+	if (acks < q->need)
+		dms_quorum_end(q, acks ? 0 : -EIO);
+
+	dms_write_epoch_exit(q->ms, q->epoch);
+	for (i = 0; i < q->nr_pages; i++)
+		__free_page(q->pages[i]);
+	kfree(q);
+}
+
+/* Take a behind write out of the in-flight set of its leg (done, or never issued) */
+static void dms_behind_remove(struct dms_behind_io *io)
+{
+	struct mirror *m = io->m;
+	unsigned long flags;
+
+	spin_lock_irqsave(&m->behind_lock, flags);
+	if (io->sectors)
+		dms_behind_it_remove(io, &m->behind_tree);
+	list_del(&io->list);
+	atomic_sub(io->sectors, &m->behind_sectors);
+	smp_mb__before_atomic(); /* wr_gen before behind_ios, for dms_flush_clean() */
+	atomic_dec(&m->behind_ios);
+	spin_unlock_irqrestore(&m->behind_lock, flags);
+
+	wake_up(&m->ms->behind_wait);
+	dms_defer_kick(m->ms);
+}
+
+/* Completion of a behind write (irq context)... */
+static void behind_endio(struct bio *bio)
+{
+	struct dms_behind_io *io = bio->bi_private;
+	struct mirror *m = io->m;
+	struct mirror_sync_set *ms = m->ms;
+
+	if (unlikely(bio->bi_error)) {
+		DMSDEBUG("behind_endio() write-behind to leg FAILED (%d)...\n", bio->bi_error);
+		fail_mirror(m, DM_RAID1_WRITE_ERROR);
+		dms_mark_stale_range(m, io->start, io->sectors);
+	} else if (io->sectors)
+		atomic_inc(&m->wr_gen);
+
+	dms_leg_done(m, io->sectors);
+	dms_behind_remove(io);
+	dms_write_epoch_exit(ms, io->epoch);
+
+	if (io->q) {
+		/* NOTE: the data pages are shared by all legs of a quorum write */
+		dms_quorum_put(io->q, 1, !bio->bi_error);
+		bio_put(bio);
+	} else
+		dms_behind_free(bio);
+	kfree(io);
+}
+
+/* Set up a write to the async leg m on a copy of its data, and add it to the
+ * in-flight set of the leg: dms_behind_issue() sends it, without waiting for it.
+ * Returns NULL if it can't (no memory, too big), the caller writes to m synchronously
+ * then, ERR_PTR(-EAGAIN) while the leg lags too far behind (see dms_behind_add()),
+ * the write is deferred then, or ERR_PTR(-ENODEV) if the leg died meanwhile. */
+static struct dms_behind_io *dms_behind_prep(struct mirror *m, struct bio *bio)
+{
+	struct mirror_sync_set *ms = m->ms;
+	unsigned int i, len, nr_pages = DIV_ROUND_UP(bio->bi_iter.bi_size, PAGE_SIZE);
+	sector_t sector = dm_target_offset(ms->ti, bio->bi_iter.bi_sector);
+	struct dms_behind_io *io;
+	struct bio *behind;
+	struct page *page;
+
+	if (nr_pages > BIO_MAX_PAGES)
+		return NULL;
+
+	io = kmalloc(sizeof(*io), GFP_NOIO);
+	if (!io)
+		return NULL;
+
+	io->m = m;
+	io->q = NULL;
+	io->start = sector;
+	io->sectors = bio_sectors(bio);
+	io->last = sector + io->sectors - 1;
+	INIT_LIST_HEAD(&io->list);
+
+	/* NOTE: before copying the data, a lagging leg defers the write anyway */
+	if ( !dms_behind_add(m, io) ) {
+		kfree(io);
+		if ( !mirror_is_alive(m) ) {
+			dms_mark_stale(m, bio);
+			return ERR_PTR(-ENODEV);
+		}
+		return ERR_PTR(-EAGAIN);
+	}
+
+	behind = bio_alloc(GFP_NOIO, nr_pages);
+	if (!behind)
+		goto bad;
+
+	for (i = 0; i < nr_pages; i++) {
+		len = min_t(unsigned int, PAGE_SIZE, bio->bi_iter.bi_size - i * PAGE_SIZE);
+		page = alloc_pages_node(m->nid, GFP_NOIO, 0);
+		if ( !page || !bio_add_page(behind, page, len, 0) ) {
+			if (page)
+				__free_page(page);
+			dms_behind_free(behind);
+			goto bad;
+		}
+	}
+	if (nr_pages)
+		bio_copy_data(behind, bio);
+
+	behind->bi_bdev = m->dev->bdev;
+	behind->bi_iter.bi_sector = m->offset + sector;
+	bio_set_op_attrs(behind, REQ_OP_WRITE, bio->bi_opf & (REQ_PREFLUSH | REQ_FUA));
+	behind->bi_end_io = behind_endio;
+	behind->bi_private = io;
+	io->bio = behind;
+	return io;
+
+bad:
+	dms_behind_remove(io);
+	kfree(io);
+	return NULL;
+}
+
+/* Drop a behind write set up by dms_behind_prep(), the write was deferred */
+static void dms_behind_unprep(struct dms_behind_io *io)
+{
+	dms_behind_remove(io);
+	dms_behind_free(io->bio);
+	kfree(io);
+}
+
+static void dms_behind_issue(struct dms_behind_io *io, unsigned int epoch)
+{
+	/* CAUTION: counted in the epoch of the original write (still held by it), so
+	 * that a resync copy waits for the data to land on this leg too... */
+	io->epoch = epoch;
+	atomic_inc(&io->m->ms->resync_inflight[epoch]);
+
+	dms_leg_issue(io->m, io->sectors);
+	generic_make_request(io->bio);
+}
+
+/* The leg writes of a quorum write, while they are set up */
+struct dms_quorum_leg {
+	struct mirror *m;
+	struct bio *bio;
+	struct dms_behind_io *io;
+};
+
+/* Issue a write to its nr_legs synchronous legs (bmi->bmi_wm[]) separately, and
+ * complete it once need of them acked. Returns 0 if it can't (no memory, too big,
+ * a leg lagging too far behind), the caller writes to all legs with dm_io() then.
+ * CAUTION: the bio may complete as soon as the first legs are issued, don't touch
+ * it (or its bmi) after that! */
+static int dms_quorum_write(struct dms_bio_map_info *bmi, struct bio *bio,
+							unsigned int nr_legs, unsigned int need)
+{
+	struct mirror_sync_set *ms = bmi->bmi_ms;
+	unsigned int i, len, nr_pages = DIV_ROUND_UP(bio->bi_iter.bi_size, PAGE_SIZE);
+	sector_t sector = dm_target_offset(ms->ti, bio->bi_iter.bi_sector);
+	unsigned int sectors = bio_sectors(bio), op_flags = bio->bi_opf & REQ_SYNC;
+	struct dms_quorum_leg *leg;
+	struct dms_quorum_io *q;
+
+	if ( !nr_pages || nr_pages > BIO_MAX_PAGES )
+		return 0;
+
+	leg = kcalloc(nr_legs, sizeof(*leg), GFP_NOIO);
+	if (!leg)
+		return 0;
+	q = kzalloc(sizeof(*q) + nr_pages * sizeof(struct page *), GFP_NOIO);
+	if (!q) {
+		kfree(leg);
+		return 0;
+	}
+
+	/* NOTE: one copy of the data for all legs, on the node of the first one */
+	for (i = 0; i < nr_pages; i++) {
+		q->pages[i] = alloc_pages_node(dms_bmi_leg(bmi, 0)->nid, GFP_NOIO, 0);
+		if (!q->pages[i])
+			goto bad;
+		q->nr_pages++;
+	}
+
+	for (i = 0; i < nr_legs; i++) {
+		unsigned int p;
+
+		leg[i].m = dms_bmi_leg(bmi, i);
+		leg[i].io = kmalloc(sizeof(struct dms_behind_io), GFP_NOIO);
+		leg[i].bio = bio_alloc(GFP_NOIO, nr_pages);
+		if (!leg[i].io || !leg[i].bio)
+			goto bad;
+
+		for (p = 0; p < nr_pages; p++) {
+			len = min_t(unsigned int, PAGE_SIZE, bio->bi_iter.bi_size - p * PAGE_SIZE);
+			if ( !bio_add_page(leg[i].bio, q->pages[p], len, 0) )
+				goto bad;
+		}
+
+		leg[i].bio->bi_bdev = leg[i].m->dev->bdev;
+		leg[i].bio->bi_iter.bi_sector = leg[i].m->offset + sector;
+		bio_set_op_attrs(leg[i].bio, REQ_OP_WRITE, op_flags);
+		leg[i].bio->bi_end_io = behind_endio;
+		leg[i].bio->bi_private = leg[i].io;
+
+		leg[i].io->m = leg[i].m;
+		leg[i].io->q = q;
+		leg[i].io->start = sector;
+		leg[i].io->sectors = sectors;
+		leg[i].io->last = sector + sectors - 1;
+		INIT_LIST_HEAD(&leg[i].io->list);
+	}
+	bio_copy_data(leg[0].bio, bio);
+
+	q->ms = ms;
+	q->bio = bio;
+	q->need = need;
+	q->nr_legs = nr_legs;
+	atomic_set(&q->finished, 0);
+	atomic_set(&q->pending, nr_legs + 1);
+	atomic_set(&q->acks, 0);
+
+	/* all legs or none: the stragglers are tracked (and limited) like behind writes.
+	 * NOTE: no older write to the same sectors is in flight, write_async_bios()
+	 * deferred this one until they were done (see dms_behind_busy()) */
+	for (i = 0; i < nr_legs; i++)
+		if ( !dms_behind_add(leg[i].m, leg[i].io) && mirror_is_alive(leg[i].m) ) {
+			while (i--)
+				if ( !list_empty(&leg[i].io->list) )
+					dms_behind_remove(leg[i].io);
+			goto bad;
+		}
+
+	/* NOTE: our own ref in the epoch of the write, until all legs are issued & done */
+	q->epoch = bmi->resync_epoch;
+	atomic_inc(&ms->resync_inflight[q->epoch]);
+
+	for (i = 0; i < nr_legs; i++) {
+		struct mirror *m = leg[i].m;
+
+		if ( list_empty(&leg[i].io->list) ) {
+			/* the leg died meanwhile... */
+			dms_mark_stale_range(m, sector, sectors);
+			bio_put(leg[i].bio);
+			kfree(leg[i].io);
+			dms_quorum_put(q, 1, 0);
+			continue;
+		}
+
+		leg[i].io->epoch = q->epoch;
+		atomic_inc(&ms->resync_inflight[q->epoch]);
+		dms_leg_issue(m, leg[i].io->sectors);
+		generic_make_request(leg[i].bio);
+	}
+
+	kfree(leg);
+	dms_quorum_put(q, 0, 0);
+	return 1;
+
+bad:
+	for (i = 0; i < nr_legs; i++) {
+		if (leg[i].bio)
+			bio_put(leg[i].bio);
+		kfree(leg[i].io);
+	}
+	for (i = 0; i < q->nr_pages; i++)
+		__free_page(q->pages[i]);
+	kfree(q);
+	kfree(leg);
+	return 0;
+}
+
+/* Can this write go to an async leg behind? Not if it's not a plain write,
+ * nor a flush/FUA write that must reach all legs (DMS_BEHIND_FLUSH_ALL)... */
+static int dms_behind_ok(struct mirror_sync_set *ms, struct bio *bio)
+{
+	if ( bio_op(bio) != REQ_OP_WRITE )
+		return 0;
+
+	return !( (bio->bi_opf & (REQ_PREFLUSH | REQ_FUA)) &&
+			  atomic_read(&ms->behind_flush) == DMS_BEHIND_FLUSH_ALL );
+}
+
+/* Must a synchronous write to leg m wait for its behind writes still in flight?
+ * For the ones to the same sectors, or for all of them before a flush... */
+static int dms_behind_busy(struct mirror *m, struct bio *bio)
+{
+	if ( likely(!atomic_read(&m->behind_ios)) || !mirror_is_alive(m) )
+		return 0;
+
+	if (bio->bi_opf & REQ_PREFLUSH)
+		return 1;
+	return dms_behind_overlap(m, bio);
+}
+
+/* A failed async leg must catch up all regions it lagged behind in... */
+static void dms_behind_fail(struct mirror *m)
+{
+	struct mirror_sync_set *ms = m->ms;
+	unsigned long flags, r;
+
+	spin_lock_irqsave(&m->behind_lock, flags);
+	for_each_set_bit(r, m->behind_map, ms->nr_regions)
+		set_bit(r, m->stale_map);
+	spin_unlock_irqrestore(&m->behind_lock, flags);
+
+	wake_up(&ms->behind_wait);
+}
+
+/* Forget the lagging regions of async legs that caught up (probe work)... */
+static void dms_behind_clean(struct mirror_sync_set *ms)
+{
+	struct mirror *m;
+	unsigned long flags;
+
+	for (m = ms->mirror; m < ms->mirror + ms->nr_mirrors; m++) {
+		if ( atomic_read(&m->behind_ios) )
+			continue;
+
+		spin_lock_irqsave(&m->behind_lock, flags);
+		if ( list_empty(&m->behind_list) )
+			bitmap_zero(m->behind_map, ms->nr_regions);
+		spin_unlock_irqrestore(&m->behind_lock, flags);
+	}
+}
+
+/* Wait for all behind writes to complete (suspend/dtr)... */
+static void dms_behind_drain(struct mirror_sync_set *ms)
+{
+	struct mirror *m;
+
+	for (m = ms->mirror; m < ms->mirror + ms->nr_mirrors; m++)
+		wait_event(ms->behind_wait, !atomic_read(&m->behind_ios));
+}
+
+/*-----------------------------------------------------------------
+ *  Ordered write journal of a remote leg
+ *---------------------------------------------------------------*/
+
+/* A write to the journaled leg, staged in the journal. It is acknowledged once
+ * it (and all entries before it) are durable there; the replayer applies it to
+ * the leg later, in journal order... */
+struct dms_jentry {
+	struct list_head list;
+	struct list_head ack_list;
+	struct mirror_sync_set *ms;
+	u64 seq;
+	sector_t pos;				/* journal sector of the header */
+	sector_t sector;			/* target sector */
+	unsigned int nr;			/* data sectors */
+	unsigned int len;			/* ring sectors used, with the wrap gap before it */
+	unsigned int flags;			/* REQ_PREFLUSH / REQ_FUA of the write */
+	unsigned long issued;		/* jiffies */
+	int state;
+	struct bio *bio;			/* the original write, until acknowledged */
+	struct bio *jbio;			/* the journal write, until issued */
+	struct page *hdr;
+};
+
+enum { DMS_JE_INFLIGHT, DMS_JE_DONE, DMS_JE_ACKING, DMS_JE_ACKED };
+
+/* Synchronous I/O to the journal device or the journaled leg... */
+static int dms_journal_io(struct mirror_sync_set *ms, struct block_device *bdev, int op,
+						  int op_flags, sector_t sector, unsigned int count,
+						  enum dm_io_mem_type type, void *buf)
+{
+	struct dm_io_region where = {
+		.bdev = bdev,
+		.sector = sector,
+		.count = count,
+	};
+	struct dm_io_request io_req = {
+		.bi_op = op,
+		.bi_op_flags = op_flags,
+		.mem.type = type,
+		.mem.ptr.addr = buf,
+		.notify.fn = NULL,
+		.client = ms->io_client,
+	};
+	unsigned long error = 0;
+
+	if ( dm_io(&io_req, 1, &where, &error) || error )
+		return -EIO;
+
+	return 0;
+}
+
+static int dms_journal_write_sb(struct mirror_sync_set *ms)
+{
+	struct dms_journal_sb *sb = ms->jr_sb;
+	unsigned long flags;
+
+	memset(sb, 0, 1 << SECTOR_SHIFT);
+	sb->magic = cpu_to_le32(DMS_JOURNAL_MAGIC);
+	sb->version = cpu_to_le32(DMS_JOURNAL_VERSION);
+	sb->ring_sectors = cpu_to_le64(ms->jr_ring_sectors);
+	spin_lock_irqsave(&ms->jr_lock, flags);
+	sb->tail_seq = cpu_to_le64(ms->jr_tail_seq);
+	sb->tail_pos = cpu_to_le64(ms->jr_tail);
+	spin_unlock_irqrestore(&ms->jr_lock, flags);
+
+	return dms_journal_io(ms, ms->jr_dev->bdev, REQ_OP_WRITE, REQ_FUA | REQ_SYNC,
+						  0, 1, DM_IO_KMEM, sb);
+}
+
+/* Reserve ring space for entry e: fails while the journal is full... */
+static int dms_journal_reserve(struct mirror_sync_set *ms, struct dms_jentry *e)
+{
+	sector_t need = DMS_JOURNAL_HDR_SECTORS + e->nr, gap = 0;
+	sector_t end = DMS_JOURNAL_RING_START + ms->jr_ring_sectors;
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&ms->jr_lock, flags);
+
+	/* entries are contiguous, skip the end of the ring if it doesn't fit there */
+	if (ms->jr_head + need > end)
+		gap = end - ms->jr_head;
+
+	if (ms->jr_used + gap + need <= ms->jr_ring_sectors) {
+		if (gap)
+			ms->jr_head = DMS_JOURNAL_RING_START;
+		e->pos = ms->jr_head;
+		e->len = gap + need;
+		e->seq = ms->jr_head_seq++;
+		ms->jr_head += need;
+		ms->jr_used += e->len;
+		ms->jr_nr++;
+		list_add_tail(&e->list, &ms->jr_inflight);
+		ret = 1;
+	}
+
+	spin_unlock_irqrestore(&ms->jr_lock, flags);
+	return ret;
+}
+
+/* Acknowledge the writes of the durable entries, in journal order, so that an
+ * acknowledged entry is never after a hole in the journal (see dms_journal_load()) */
+static void dms_journal_ack(struct mirror_sync_set *ms)
+{
+	struct dms_jentry *e, *tmp;
+	unsigned long flags;
+	LIST_HEAD(acked);
+
+	INIT_LIST_HEAD(&acked);
+	spin_lock_irqsave(&ms->jr_lock, flags);
+	while ( !list_empty(&ms->jr_inflight) ) {
+		e = list_first_entry(&ms->jr_inflight, struct dms_jentry, list);
+		if (e->state != DMS_JE_DONE)
+			break;
+		e->state = DMS_JE_ACKING;
+		list_del(&e->list);
+		list_add_tail(&e->list, &ms->jr_entries);
+		list_add_tail(&e->ack_list, &acked);
+	}
+	spin_unlock_irqrestore(&ms->jr_lock, flags);
+
+	/* NOTE: the replayer leaves the entries alone until they are ACKED */
+	list_for_each_entry_safe(e, tmp, &acked, ack_list) {
+		dms_write_done(e->bio);
+		spin_lock_irqsave(&ms->jr_lock, flags);
+		e->bio = NULL;
+		e->state = DMS_JE_ACKED;
+		spin_unlock_irqrestore(&ms->jr_lock, flags);
+	}
+
+	queue_work(dms_jr_wq, &ms->jr_work);
+}
+
+/* Completion of a journal write (irq context)... */
+static void journal_endio(struct bio *jbio)
+{
+	struct dms_jentry *e = jbio->bi_private;
+	struct mirror_sync_set *ms = e->ms;
+	unsigned long flags;
+
+	/* NOTE: without the journal, the leg can't be kept in sync anymore: the
+	 * replayer drops its entries (marking them stale) once the leg is failed */
+	if (unlikely(jbio->bi_error)) {
+		DMERR_LIMIT("[%s] Write journal I/O error %d, failing the journaled leg",
+					ms->name, jbio->bi_error);
+		fail_mirror(ms->jr_leg, DM_RAID1_WRITE_ERROR);
+	}
+
+	__free_page(e->hdr);
+	e->hdr = NULL;
+	bio_put(jbio);
+
+	spin_lock_irqsave(&ms->jr_lock, flags);
+	e->state = DMS_JE_DONE;
+	spin_unlock_irqrestore(&ms->jr_lock, flags);
+
+	dms_journal_ack(ms);
+}
+
+/* Set up the journal entry of a write to the journaled leg, on the pages of the bio
+ * itself (it completes after the entry is durable). Returns NULL if it can't (too big,
+ * no memory), the caller writes the leg directly then. */
+static struct dms_jentry *dms_journal_prep(struct mirror_sync_set *ms, struct bio *bio)
+{
+	struct dms_journal_hdr *hdr;
+	struct dms_jentry *e;
+	struct bio *jbio = NULL;
+	struct bio_vec bv;
+	struct bvec_iter iter;
+	u32 crc = 0;
+	void *p;
+
+	if ( DMS_JOURNAL_HDR_SECTORS + bio_sectors(bio) > DMS_JOURNAL_BATCH )
+		return NULL;
+
+	e = kzalloc(sizeof(*e), GFP_NOIO);
+	if (!e)
+		return NULL;
+
+	e->hdr = alloc_page(GFP_NOIO);
+	jbio = bio_alloc(GFP_NOIO, bio_segments(bio) + 1);
+	if ( !e->hdr || !jbio ||
+		 !bio_add_page(jbio, e->hdr, to_bytes(DMS_JOURNAL_HDR_SECTORS), 0) )
+		goto bad;
+
+	bio_for_each_segment(bv, bio, iter) {
+		p = kmap_atomic(bv.bv_page);
+		crc = crc32c(crc, p + bv.bv_offset, bv.bv_len);
+		kunmap_atomic(p);
+		if ( !bio_add_page(jbio, bv.bv_page, bv.bv_len, bv.bv_offset) )
+			goto bad;
+	}
+
+	e->ms = ms;
+	e->bio = bio;
+	e->jbio = jbio;
+	e->sector = bio_sectors(bio) ? dm_target_offset(ms->ti, bio->bi_iter.bi_sector) : 0;
+	e->nr = bio_sectors(bio);
+	e->flags = bio->bi_opf & (REQ_PREFLUSH | REQ_FUA);
+	e->issued = jiffies;
+	e->state = DMS_JE_INFLIGHT;
+
+	hdr = page_address(e->hdr);
+	memset(hdr, 0, PAGE_SIZE);
+	hdr->magic = cpu_to_le32(DMS_JOURNAL_MAGIC);
+	hdr->flags = cpu_to_le32(e->flags);
+	hdr->sector = cpu_to_le64(e->sector);
+	hdr->nr_sectors = cpu_to_le32(e->nr);
+	hdr->crc = cpu_to_le32(crc);
+	return e;
+
+bad:
+	if (jbio)
+		bio_put(jbio);
+	if (e->hdr)
+		__free_page(e->hdr);
+	kfree(e);
+	return NULL;
+}
+
+/* Drop an entry set up by dms_journal_prep() that got no ring space (journal
+ * full): the write is deferred */
+static void dms_journal_unprep(struct dms_jentry *e)
+{
+	bio_put(e->jbio);
+	__free_page(e->hdr);
+	kfree(e);
+}
+
+/* Issue the journal write of an entry with its ring space reserved
+ * (see dms_journal_reserve()) */
+static void dms_journal_issue(struct dms_jentry *e, struct dms_bio_map_info *bmi)
+{
+	struct dms_journal_hdr *hdr = page_address(e->hdr);
+	struct bio *jbio = e->jbio;
+
+	hdr->seq = cpu_to_le64(e->seq);
+	e->jbio = NULL;
+
+	jbio->bi_bdev = e->ms->jr_dev->bdev;
+	jbio->bi_iter.bi_sector = e->pos;
+	bio_set_op_attrs(jbio, REQ_OP_WRITE, REQ_FUA | REQ_SYNC);
+	jbio->bi_end_io = journal_endio;
+	jbio->bi_private = e;
+
+	atomic_inc(&bmi->bmi_wait);
+	generic_make_request(jbio);
+}
+
+/* Must a direct write to the journaled leg (e.g. a discard) wait? The replayer
+ * applies everything that is in the journal first... */
+static int dms_journal_busy(struct mirror_sync_set *ms)
+{
+	return ms->jr_leg && READ_ONCE(ms->jr_nr) && mirror_is_alive(ms->jr_leg);
+}
+
+/* Wait for the journal to be applied (suspend, read retries)... */
+static void dms_journal_drain(struct mirror_sync_set *ms)
+{
+	wait_event(ms->jr_wait, !dms_journal_busy(ms));
+}
+
+/*----------------------------------------------------------------- */
+
+struct dms_journal_replay {
+	atomic_t pending;
+	struct completion done;
+	int error;
+};
+
+static void journal_replay_callback(unsigned long error, void *context)
+{
+	struct dms_journal_replay *r = context;
+
+	if (error)
+		r->error = 1;
+	if (atomic_dec_and_test(&r->pending))
+		complete(&r->done);
+}
+
+/* Apply a batch of entries, read back into jr_buf, to the journaled leg: the data
+ * of adjacent entries is moved together & merged into one write, all in parallel. */
+static int dms_journal_apply(struct mirror_sync_set *ms, struct dms_jentry **batch, unsigned int n)
+{
+	struct mirror *m = ms->jr_leg;
+	struct dms_journal_replay r;
+	struct dm_io_region where;
+	struct dm_io_request io_req = {
+		.bi_op = REQ_OP_WRITE,
+		.bi_op_flags = 0,
+		.mem.type = DM_IO_VMA,
+		.notify.fn = journal_replay_callback,
+		.notify.context = &r,
+		.client = ms->io_client,
+	};
+	char *data = NULL, *run = NULL;
+	sector_t run_sector = 0, run_nr = 0;
+	unsigned int i;
+
+	init_completion(&r.done);
+	atomic_set(&r.pending, 1);
+	r.error = 0;
+
+	for (i = 0; i <= n; i++) {
+
+		if (i < n) {
+			struct dms_jentry *e = batch[i];
+
+			if (!e->nr)
+				continue; /* flush only */
+
+			data = (char *) ms->jr_buf + to_bytes(e->pos - batch[0]->pos + DMS_JOURNAL_HDR_SECTORS);
+			if ( run && e->sector == run_sector + run_nr ) {
+				memmove(run + to_bytes(run_nr), data, to_bytes(e->nr));
+				run_nr += e->nr;
+				continue;
+			}
+		}
+
+		if (run) {
+			where.bdev = m->dev->bdev;
+			where.sector = m->offset + run_sector;
+			where.count = run_nr;
+			io_req.mem.ptr.vma = run;
+			atomic_inc(&r.pending);
+			if ( dm_io(&io_req, 1, &where, NULL) ) {
+				r.error = 1;
+				atomic_dec(&r.pending);
+			}
+		}
+
+		if (i < n) {
+			run = data;
+			run_sector = batch[i]->sector;
+			run_nr = batch[i]->nr;
+		}
+	}
+
+	if (!atomic_dec_and_test(&r.pending))
+		wait_for_completion(&r.done);
+
+	return r.error ? -EIO : 0;
+}
+
+/* Collect the next batch to replay: acknowledged entries, contiguous in the journal,
+ * not overlapping each other (they're written in parallel). The batch ends before
+ * a flush and after a FUA write, so the leg sees them in the same order. */
+static unsigned int dms_journal_batch(struct mirror_sync_set *ms, struct dms_jentry **batch,
+									  sector_t *span)
+{
+	struct dms_jentry *e;
+	unsigned long flags;
+	unsigned int j, n = 0;
+
+	*span = 0;
+	spin_lock_irqsave(&ms->jr_lock, flags);
+	list_for_each_entry(e, &ms->jr_entries, list) {
+
+		if ( e->state != DMS_JE_ACKED || n == DMS_JOURNAL_BATCH_ENTRIES )
+			break;
+
+		if (n) {
+			if ( (e->flags & REQ_PREFLUSH) ||
+				 e->pos != batch[n - 1]->pos + DMS_JOURNAL_HDR_SECTORS + batch[n - 1]->nr ||
+				 *span + DMS_JOURNAL_HDR_SECTORS + e->nr > DMS_JOURNAL_BATCH )
+				break;
+
+			for (j = 0; j < n; j++)
+				if ( e->nr && batch[j]->nr && e->sector < batch[j]->sector + batch[j]->nr &&
+					 batch[j]->sector < e->sector + e->nr )
+					break;
+			if (j < n)
+				break;
+		}
+
+		batch[n++] = e;
+		*span += DMS_JOURNAL_HDR_SECTORS + e->nr;
+		if (e->flags & REQ_FUA)
+			break;
+	}
+	spin_unlock_irqrestore(&ms->jr_lock, flags);
+
+	return n;
+}
+
+/* Replayer: applies the journal to the journaled leg in order, a batch at a time,
+ * flushing the leg before the journal tail moves past a batch. If the leg is failed
+ * the entries are dropped, and their regions marked stale (the resync catches them up). */
+static void do_journal_replay(struct work_struct *work)
+{
+	struct mirror_sync_set *ms = container_of(work, struct mirror_sync_set, jr_work);
+	struct mirror *m = ms->jr_leg;
+	struct dms_jentry *batch[DMS_JOURNAL_BATCH_ENTRIES], *last;
+	unsigned long flags, wstart = jiffies;
+	unsigned long long wbytes = 0;
+	unsigned int i, n, elapsed;
+	sector_t span;
+	int error;
+
+	DMSDEBUG_CALL("do_journal_replay() ENTERING...\n");
+
+	while ( !atomic_read(&ms->jr_stop) && (n = dms_journal_batch(ms, batch, &span)) ) {
+
+		error = -EIO;
+		if ( mirror_is_alive(m) ) {
+			error = 0;
+			if (batch[0]->flags & REQ_PREFLUSH)
+				error = dms_journal_io(ms, m->dev->bdev, REQ_OP_WRITE, REQ_PREFLUSH | REQ_SYNC,
+									   0, 0, DM_IO_KMEM, NULL);
+			if (!error)
+				error = dms_journal_io(ms, ms->jr_dev->bdev, REQ_OP_READ, 0, batch[0]->pos,
+									   span, DM_IO_VMA, ms->jr_buf);
+			if (!error)
+				error = dms_journal_apply(ms, batch, n);
+			if (!error)
+				error = dms_journal_io(ms, m->dev->bdev, REQ_OP_WRITE, REQ_PREFLUSH | REQ_SYNC,
+									   0, 0, DM_IO_KMEM, NULL);
+			if (error)
+				fail_mirror(m, DM_RAID1_WRITE_ERROR);
+		}
+
+		last = batch[n - 1];
+		spin_lock_irqsave(&ms->jr_lock, flags);
+		for (i = 0; i < n; i++) {
+			list_del(&batch[i]->list);
+			ms->jr_used -= batch[i]->len;
+			ms->jr_nr--;
+		}
+		ms->jr_tail = last->pos + DMS_JOURNAL_HDR_SECTORS + last->nr;
+		ms->jr_tail_seq = last->seq + 1;
+		spin_unlock_irqrestore(&ms->jr_lock, flags);
+
+		for (i = 0; i < n; i++) {
+			if (error)
+				dms_mark_stale_range(m, batch[i]->sector, batch[i]->nr);
+			else
+				wbytes += to_bytes(batch[i]->nr);
+			kfree(batch[i]);
+		}
+		atomic_add(n, &ms->jr_replayed);
+
+		if ( dms_journal_write_sb(ms) )
+			DMERR_LIMIT("[%s] Cannot update the write journal superblock", ms->name);
+		wake_up_all(&ms->jr_wait);
+		dms_defer_kick(ms); /* writes waiting for ring space or a drained journal */
+
+		elapsed = jiffies_to_msecs(jiffies - wstart);
+		if (elapsed >= DMS_RESYNC_RATE_WINDOW) {
+			atomic_set(&ms->jr_kbps, div_u64(wbytes * MSEC_PER_SEC, elapsed * 1024ULL));
+			wstart = jiffies;
+			wbytes = 0;
+		}
+		cond_resched();
+	}
+
+	if ( list_empty(&ms->jr_entries) )
+		atomic_set(&ms->jr_kbps, 0);
+}
+
+/* Check the journal entry at pos (header & data, read into jr_buf)... */
+static int dms_journal_entry_ok(struct mirror_sync_set *ms, sector_t pos, u64 seq)
+{
+	struct dms_journal_hdr *hdr = ms->jr_buf;
+	sector_t end = DMS_JOURNAL_RING_START + ms->jr_ring_sectors;
+	unsigned int nr;
+
+	if ( pos + DMS_JOURNAL_HDR_SECTORS > end ||
+		 dms_journal_io(ms, ms->jr_dev->bdev, REQ_OP_READ, 0, pos, DMS_JOURNAL_HDR_SECTORS,
+						DM_IO_VMA, ms->jr_buf) )
+		return 0;
+
+	nr = le32_to_cpu(hdr->nr_sectors);
+	if ( le32_to_cpu(hdr->magic) != DMS_JOURNAL_MAGIC || le64_to_cpu(hdr->seq) != seq ||
+		 DMS_JOURNAL_HDR_SECTORS + nr > DMS_JOURNAL_BATCH ||
+		 pos + DMS_JOURNAL_HDR_SECTORS + nr > end ||
+		 le64_to_cpu(hdr->sector) + nr > ms->ti->len )
+		return 0;
+
+	if ( nr && dms_journal_io(ms, ms->jr_dev->bdev, REQ_OP_READ, 0, pos + DMS_JOURNAL_HDR_SECTORS,
+							  nr, DM_IO_VMA, (char *) ms->jr_buf + to_bytes(DMS_JOURNAL_HDR_SECTORS)) )
+		return 0;
+
+	return crc32c(0, (char *) ms->jr_buf + to_bytes(DMS_JOURNAL_HDR_SECTORS), to_bytes(nr)) ==
+			le32_to_cpu(hdr->crc);
+}
+
+/* Read the journal at table load: entries left over by the previous table (e.g.
+ * after a crash) are replayed on resume, up to the first hole: all acknowledged
+ * entries are before it (see dms_journal_ack()). Starts a new journal if there's
+ * none on the device. */
+static int dms_journal_load(struct mirror_sync_set *ms)
+{
+	struct dms_journal_sb *sb = ms->jr_sb;
+	struct dms_journal_hdr *hdr = ms->jr_buf;
+	sector_t pos, gap, end = DMS_JOURNAL_RING_START + ms->jr_ring_sectors;
+	struct dms_jentry *e;
+	u64 seq;
+
+	ms->jr_head = ms->jr_tail = DMS_JOURNAL_RING_START;
+	ms->jr_head_seq = ms->jr_tail_seq = 1;
+
+	if ( dms_journal_io(ms, ms->jr_dev->bdev, REQ_OP_READ, 0, 0, 1, DM_IO_KMEM, sb) )
+		return -EIO;
+
+	pos = le64_to_cpu(sb->tail_pos);
+	seq = le64_to_cpu(sb->tail_seq);
+	if ( le32_to_cpu(sb->magic) != DMS_JOURNAL_MAGIC ||
+		 le32_to_cpu(sb->version) != DMS_JOURNAL_VERSION ||
+		 le64_to_cpu(sb->ring_sectors) != ms->jr_ring_sectors ||
+		 pos < DMS_JOURNAL_RING_START || pos > end ) {
+
+		DMINFO("[%s] Starting a new write journal on %s", ms->name, ms->jr_dev->name);
+		return dms_journal_write_sb(ms);
+	}
+
+	ms->jr_tail = pos;
+	ms->jr_tail_seq = seq;
+
+	for (;;) {
+		gap = 0;
+		if ( !dms_journal_entry_ok(ms, pos, seq) ) {
+			/* the entry may have wrapped to the start of the ring */
+			if ( pos == DMS_JOURNAL_RING_START ||
+				 !dms_journal_entry_ok(ms, DMS_JOURNAL_RING_START, seq) )
+				break;
+			gap = end - pos;
+			pos = DMS_JOURNAL_RING_START;
+		}
+
+		e = kzalloc(sizeof(*e), GFP_KERNEL);
+		if (!e)
+			return -ENOMEM;
+
+		e->ms = ms;
+		e->seq = seq;
+		e->pos = pos;
+		e->sector = le64_to_cpu(hdr->sector);
+		e->nr = le32_to_cpu(hdr->nr_sectors);
+		e->flags = le32_to_cpu(hdr->flags);
+		e->len = gap + DMS_JOURNAL_HDR_SECTORS + e->nr;
+		e->issued = jiffies;
+		e->state = DMS_JE_ACKED;
+
+		if (ms->jr_used + e->len > ms->jr_ring_sectors) {
+			kfree(e);
+			break;
+		}
+		list_add_tail(&e->list, &ms->jr_entries);
+		ms->jr_used += e->len;
+		ms->jr_nr++;
+
+		pos += DMS_JOURNAL_HDR_SECTORS + e->nr;
+		seq++;
+	}
+
+	ms->jr_head = pos;
+	ms->jr_head_seq = seq;
+
+	if (ms->jr_nr)
+		DMINFO("[%s] Write journal on %s: %u entries (%llu KiB) to replay", ms->name,
+				ms->jr_dev->name, ms->jr_nr, (unsigned long long) ms->jr_used / 2);
+	return 0;
+}
+
+/* Free the entries left at dtr (the leg catches them up at the next load)... */
+static void dms_journal_free(struct mirror_sync_set *ms)
+{
+	struct dms_jentry *e, *tmp;
+
+	list_for_each_entry_safe(e, tmp, &ms->jr_entries, list) {
+		list_del(&e->list);
+		kfree(e);
+	}
+}
+
+/*-----------------------------------------------------------------
+ *  I/O handler functions (reads/writes/etc.)
+ *---------------------------------------------------------------*/
+
+/*----------------------------------------------------------------- */
+#ifdef DEBUG_WRITE_TO_SINGLE_MIRROR
+// supports only a SINGLE write case... debug leftover...
+static void dispatch_bio( struct dms_bio_map_info *bmi, struct bio *bio, int rw )
+{
+	if (rw == WRITE) {
+		DMSDEBUG("dispatch_bio() WRITE enter...\n");
+		// FIXME: this goes to the default mirror for now...
+		map_bio( bmi->bmi_m, bio);
+		generic_make_request(bio);
+		//DMSDEBUG("dispatch_bio() WRITE exit...\n");
+		return;
+	}
+
+	/* All about the reads now */
+	DMSDEBUG("dispatch_bio() READ enter...\n");
+	read_async_bio( bmi, bio);
+	DMSDEBUG("dispatch_bio() READ exit...\n");
+}
+#endif
+
+/* ----------------------------------------------------------------
+ * Queue bio function -> queues failed bios for retry on this CPU, no lock:
+ * the work of the CPU is kicked by the first one in its queue...
+ */
+
+static void queue_bio(struct mirror_sync_set *ms, struct bio *bio, int rw)
+{
+	struct dms_bio_map_info *bmi = bio_get_m(bio);
+	struct dms_retry_cpu *rq;
+	int cpu = get_cpu();
+
+	rq = per_cpu_ptr(ms->retry, cpu);
+	if ( llist_add(&bmi->retry_node, &rq->list) )
+		queue_work_on(cpu, dms_wq, &rq->work);
+	put_cpu();
+}
+
+/*-----------------------------------------------------------------
+ *  Flush sequencing
+ *---------------------------------------------------------------*/
+
+/* Can the flush of leg m be skipped in the current round? (no write completed
+ * on it since its last good flush, and none written behind still in flight)
+ * CAUTION: a write behind (async or quorum leg) completes on the leg after its
+ * bio, maybe after the round started, so it's checked against the live wr_gen,
+ * pairs with the barrier in behind_endio()... */
+static inline int dms_flush_clean(struct mirror *m)
+{
+	if ( atomic_read(&m->behind_ios) )
+		return 0;
+	smp_rmb();
+	return m->flush_snap == READ_ONCE(m->flush_gen) &&
+		   m->flush_snap == atomic_read(&m->wr_gen);
+}
+
+/* Account a completed write on the legs that got it (dm_io error bitmap): data
+ * writes dirty them, the flush of a round cleans them, as of the round start... */
+static void dms_flush_account(struct dms_bio_map_info *bmi, struct bio *bio, unsigned long error)
+{
+	struct mirror_sync_set *ms = bmi->bmi_ms;
+	struct mirror *m;
+	unsigned int i;
+
+	for (i = 0; i < bmi->nr_live; i++) {
+		if ( test_bit(i, &error) )
+			continue;
+		m = dms_bmi_leg(bmi, i);
+		if ( bio_sectors(bio) )
+			atomic_inc(&m->wr_gen);
+		else if ( bio == READ_ONCE(ms->flush_leader) )
+			WRITE_ONCE(m->flush_gen, m->flush_snap);
+	}
+}
+
+/* The flush leading a round is done: complete the ones merged into it (same
+ * result), and start the next round if flushes came in meanwhile... */
+static void dms_flush_end(struct mirror_sync_set *ms, struct bio *leader)
+{
+	struct bio_list round;
+	struct bio *bio;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ms->flush_lock, flags);
+	WRITE_ONCE(ms->flush_leader, NULL);
+	round = ms->flush_round;
+	bio_list_init(&ms->flush_round);
+	if ( bio_list_empty(&ms->flush_pending) )
+		ms->flush_busy = 0;
+	else
+		queue_work(dms_wq, &ms->flush_work); /* may be in irq here */
+	spin_unlock_irqrestore(&ms->flush_lock, flags);
+
+	while ( (bio = bio_list_pop(&round)) ) {
+		bio->bi_error = leader->bi_error;
+		atomic_inc(&ms->flush_merged);
+		bio_endio(bio);
+	}
+}
+
+/*-----------------------------------------------------------------
+ *  WRITE_SAME / WRITE_ZEROES offload
+ *---------------------------------------------------------------*/
+
+/* Is the bio a WRITE_SAME (or WRITE_ZEROES) over a range, with no data payload to copy? */
+static inline int dms_bio_offload(struct bio *bio)
+{
+#ifdef DMS_HAVE_WRITE_ZEROES
+	if (bio_op(bio) == REQ_OP_WRITE_ZEROES)
+		return 1;
+#endif
+	return bio_op(bio) == REQ_OP_WRITE_SAME;
+}
+
+/* Can leg m do the offloaded op of the bio itself? */
+static int dms_leg_offload(struct mirror *m, struct bio *bio)
+{
+#ifdef DMS_HAVE_WRITE_ZEROES
+	if (bio_op(bio) == REQ_OP_WRITE_ZEROES)
+		return bdev_write_zeroes_sectors(m->dev->bdev) != 0;
+#endif
+	return bdev_write_same(m->dev->bdev) != 0;
+}
+
+/* Written out WRITE_SAME/WRITE_ZEROES on a leg without the offload:
+ * a page filled with the block pattern, added over the whole range... */
+struct dms_wsame_io {
+	struct bio *bio;			/* the original write */
+	struct mirror *m;
+	struct page *page;
+	atomic_t pending;
+	int error;
+};
+
+static void dms_wsame_put(struct dms_wsame_io *io)
+{
+	struct bio *bio = io->bio;
+	struct mirror *m = io->m;
+
+	if ( !atomic_dec_and_test(&io->pending) )
+		return;
+
+	dms_leg_done(m, bio_sectors(bio));
+	if (unlikely(io->error)) {
+		DMERR_LIMIT("[%s] Mirror device %s: written out WRITE_SAME failed", m->ms->name, m->dev->name);
+		fail_mirror(m, DM_RAID1_WRITE_ERROR);
+		dms_mark_stale(m, bio);
+		if ( !mirror_sync_available(m->ms) )
+			bio->bi_error = -EIO;
+	} else
+		atomic_inc(&m->wr_gen);
+
+	__free_page(io->page);
+	kfree(io);
+	dms_write_done(bio);
+}
+
+static void wsame_endio(struct bio *wbio)
+{
+	struct dms_wsame_io *io = wbio->bi_private;
+
+	if (unlikely(wbio->bi_error))
+		io->error = 1;
+	bio_put(wbio);
+	dms_wsame_put(io);
+}
+
+/* Write out the range of a WRITE_SAME/WRITE_ZEROES bio on leg m, in bios of up to
+ * BIO_MAX_PAGES pages (all the same one). The bio completes after them (bmi_wait). */
+static void dms_wsame_fallback(struct dms_bio_map_info *bmi, struct bio *bio, struct mirror *m)
+{
+	struct dms_wsame_io *io;
+	struct bio *wbio;
+	sector_t sector = map_sector(m, bio), left = bio_sectors(bio);
+	unsigned int len, off;
+	char *src, *dst;
+
+	io = kmalloc(sizeof(*io), GFP_NOIO);
+	if (io)
+		io->page = alloc_pages_node(m->nid, GFP_NOIO, 0);
+	if ( !io || !io->page ) {
+		kfree(io);
+		DMERR_LIMIT("[%s] No memory to write out WRITE_SAME on %s", m->ms->name, m->dev->name);
+		fail_mirror(m, DM_RAID1_WRITE_ERROR);
+		dms_mark_stale(m, bio);
+		return;
+	}
+
+	/* NOTE: the WRITE_SAME payload is one logical block, WRITE_ZEROES has none */
+	dst = kmap_atomic(io->page);
+	if ( bio_op(bio) == REQ_OP_WRITE_SAME ) {
+		src = kmap_atomic(bio_page(bio));
+		len = bio_iovec(bio).bv_len;
+		for (off = 0; off + len <= PAGE_SIZE; off += len)
+			memcpy(dst + off, src + bio_offset(bio), len);
+		kunmap_atomic(src);
+	} else
+		memset(dst, 0, PAGE_SIZE);
+	kunmap_atomic(dst);
+
+	io->bio = bio;
+	io->m = m;
+	io->error = 0;
+	atomic_set(&io->pending, 1);
+	atomic_inc(&bmi->bmi_wait);
+	atomic_inc(&m->ms->wsame_fallback);
+	dms_leg_issue(m, bio_sectors(bio));
+
+	while (left) {
+		wbio = bio_alloc(GFP_NOIO, min_t(sector_t, BIO_MAX_PAGES, DIV_ROUND_UP(left, PAGE_SIZE >> 9)));
+		wbio->bi_bdev = m->dev->bdev;
+		wbio->bi_iter.bi_sector = sector;
+		bio_set_op_attrs(wbio, REQ_OP_WRITE, bio->bi_opf & REQ_FUA);
+		wbio->bi_end_io = wsame_endio;
+		wbio->bi_private = io;
+
+		while (left) {
+			len = min_t(sector_t, left, PAGE_SIZE >> 9);
+			if ( !bio_add_page(wbio, io->page, to_bytes(len), 0) )
+				break;
+			sector += len;
+			left -= len;
+		}
+
+		atomic_inc(&io->pending);
+		generic_make_request(wbio);
+	}
+
+	dms_wsame_put(io);
+}
+
+/*----------------------------------------------------------------- */
+
+/* Turn zero detection on/off for leg m (e.g. a thin or remote one)... */
+static void dms_set_zero_detect(struct mirror *m, int on)
+{
+	struct mirror_sync_set *ms = m->ms;
+	unsigned int i, nr = 0;
+
+	WRITE_ONCE(m->zero_detect, on);
+	for (i = 0; i < ms->nr_mirrors; i++)
+		nr += ms->mirror[i].zero_detect;
+	atomic_set(&ms->zero_legs, nr);
+}
+
+/* Is all the data of a write zero? memchr_inv() compares a word at a time
+ * and stops at the first non-zero one, so non-zero data costs little... */
+static int dms_bio_is_zero(struct bio *bio)
+{
+	struct bio_vec bv;
+	struct bvec_iter iter;
+	void *p, *nz;
+
+	bio_for_each_segment(bv, bio, iter) {
+		p = kmap_atomic(bv.bv_page);
+		nz = memchr_inv(p + bv.bv_offset, 0, bv.bv_len);
+		kunmap_atomic(p);
+		if (nz)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* The op an all-zero write is sent to a zero detecting leg as, 0 if none...
+ * NOTE: not discards, they don't zero the partial blocks of their granularity */
+static int dms_leg_zero_op(struct mirror *m)
+{
+#ifdef DMS_HAVE_WRITE_ZEROES
+	if ( bdev_write_zeroes_sectors(m->dev->bdev) )
+		return REQ_OP_WRITE_ZEROES;
+#endif
+	if ( bdev_write_same(m->dev->bdev) )
+		return REQ_OP_WRITE_SAME;
+
+	return 0;
+}
+
+struct dms_zero_io {
+	struct bio *bio;			/* the original write */
+	struct mirror *m;
+};
+
+static void zero_callback(unsigned long error, void *context)
+{
+	struct dms_zero_io *io = context;
+	struct mirror *m = io->m;
+	struct bio *bio = io->bio;
+
+	dms_leg_done(m, bio_sectors(bio));
+	if (unlikely(error)) {
+		DMERR_LIMIT("[%s] Mirror device %s: zeroing write failed", m->ms->name, m->dev->name);
+		fail_mirror(m, DM_RAID1_WRITE_ERROR);
+		dms_mark_stale(m, bio);
+		if ( !mirror_sync_available(m->ms) )
+			bio->bi_error = -EIO;
+	} else {
+		atomic_inc(&m->wr_gen);
+		atomic_add(bio_sectors(bio) / 2, &m->zero_kb);
+		atomic_inc(&m->zero_ios);
+	}
+
+	kfree(io);
+	dms_write_done(bio);
+}
+
+/* Send an all-zero write to leg m as a zeroing op (the bio completes after it, bmi_wait).
+ * Falls back to the data write if out of memory... returns 0 then. */
+static int dms_zero_write(struct dms_bio_map_info *bmi, struct bio *bio, struct mirror *m, int op)
+{
+	struct dms_zero_io *io = kmalloc(sizeof(*io), GFP_NOIO);
+	struct dm_io_region where;
+	struct dm_io_request io_req = {
+		.bi_op = op,
+		.bi_op_flags = bio->bi_opf & REQ_FUA,
+		.mem.type = DM_IO_KMEM,
+		.mem.ptr.addr = page_address(ZERO_PAGE(0)), /* WRITE_SAME block */
+		.notify.fn = zero_callback,
+		.client = m->ms->io_client,
+	};
+
+	if (!io)
+		return 0;
+
+	io->bio = bio;
+	io->m = m;
+	io_req.notify.context = io;
+	map_region(&where, m, bio);
+
+	atomic_inc(&bmi->bmi_wait);
+	dms_leg_issue(m, bio_sectors(bio));
+	BUG_ON(dm_io(&io_req, 1, &where, NULL));
+	return 1;
+}
+
+/*-----------------------------------------------------------------
+ * CAUTION: AFTER ALL async I/O we MUST call unplug! Else the I/O will not
  *          proceed at the speed of the timeout (3ms) per call...
  *          -> WARNING: unplug code changed in kernel v.3.7-3.8 onwards... */
 
@@ -448,6 +3018,7 @@ static void write_callback(unsigned long error, void *context)
 	struct bio *bio = (struct bio *) context;
 	struct dms_bio_map_info *bmi = NULL;
 	struct mirror_sync_set *ms;
+	unsigned int i;
 	int ret = 0;
 
 	DMSDEBUG("write_callback() enter...\n");
@@ -456,19 +3027,38 @@ static void write_callback(unsigned long error, void *context)
 	assert( bmi ); /* bug trap... */
 	ms = bmi->bmi_ms;
 
+	for (i = 0; i < bmi->nr_live; i++)
+		dms_leg_done(dms_bmi_leg(bmi, i), bio_sectors(bio));
+
 	if (unlikely(error)) {
 
-		unsigned int i, nr_live, nr_failed = 0;
+		unsigned int nr_live, nr_failed = 0, nr_unsupported = 0;
+		unsigned long failed = error;
+		struct mirror *m;
 
 		/*
-		 * If the bio is discard, return an error, but do not
-		 * degrade the array.
+		 * If a leg does not support discards (any more), do not degrade the
+		 * array: the data is still there, just stop sending it discards.
+		 * CAUTION: dm_io only tells us which legs failed, not why: a leg whose
+		 * queue still supports discards had a real error, like a write...
 		 */
 		if (bio_op(bio) == REQ_OP_DISCARD) {
-			bio_set_m(bio, NULL);
-			bio->bi_error = -EOPNOTSUPP;
-			bio_endio(bio);
-			return;
+			for (i = 0; i < bmi->nr_live; i++) {
+				m = dms_bmi_leg(bmi, i);
+				if ( test_bit(i, &failed) && !blk_queue_discard(bdev_get_queue(m->dev->bdev)) ) {
+					WRITE_ONCE(m->discards, 0);
+					__clear_bit(i, &failed);
+					nr_unsupported++;
+				}
+			}
+
+			/* no leg discarded it, and none failed */
+			if ( nr_unsupported >= bmi->nr_live ) {
+				bio->bi_error = -EOPNOTSUPP;
+				dms_flush_account(bmi, bio, error);
+				dms_write_done(bio);
+				return;
+			}
 		}
 
 		/* NOTE: there can be one or more errors, and they are returned in the "error" bitmap!
@@ -480,16 +3070,17 @@ static void write_callback(unsigned long error, void *context)
 		assert( nr_live > 0 && nr_live <= ms->nr_mirrors );
 
 		for (i = 0; i < nr_live; i++)
-			if ( test_bit(i, &error)) {
+			if ( test_bit(i, &failed)) {
 				/* ATTENTION: on error, the event to user-space for the failure
 				 * will be triggered by fail_mirror()! */
 				DMSDEBUG("write_callback() MIRROR %d of %d LIVE FAILED...\n", i, nr_live );
-				fail_mirror( bmi->bmi_wm[i], DM_RAID1_WRITE_ERROR);
+				fail_mirror( dms_bmi_leg(bmi, i), DM_RAID1_WRITE_ERROR);
+				dms_mark_stale( dms_bmi_leg(bmi, i), bio );
 				nr_failed++;
 			}
 
 		/* did anyone survive? */
-		ret = (nr_live - nr_failed) ? 0 : -EIO;
+		ret = (nr_live - nr_failed - nr_unsupported) ? 0 : -EIO;
 
 		if ( ret != 0 && atomic_read( &ms->supress_err_messages ) < MAX_ERR_MESSAGES ) {
 			DMERR("[%s] All mirror devices dead, failing I/O write", ms->name);
@@ -498,8 +3089,8 @@ static void write_callback(unsigned long error, void *context)
 		bio->bi_error = ret;
 	}
 
-	bio_set_m(bio, NULL);
-	bio_endio(bio);
+	dms_flush_account(bmi, bio, error);
+	dms_write_done(bio);
 	DMSDEBUG("write_callback() after endbio()... exiting\n");
 }
 
@@ -508,12 +3099,258 @@ static void write_callback(unsigned long error, void *context)
 /* Low-level write issuer to ALL live mirrors... Does not deal with error handling
  * here, the caller should have set the proper dm_per_bio_data for retries & faults ... */
 
+/*-----------------------------------------------------------------
+ * Fair share of the shared disks: with mirror_sync_share_depth set,
+ * at most that many I/Os from the legs on a disk that other legs
+ * share are in flight; the rest wait in the queue of their leg (the
+ * flow of its instance on the disk) and are dispatched by deficit
+ * round-robin over the flows, by bytes. So one noisy instance cannot
+ * fill the queue of the disk for the others, and the cost of its
+ * writes is counted on every disk they fan out to.
+ *---------------------------------------------------------------*/
+static unsigned int dms_share_depth = 0;
+module_param_named(mirror_sync_share_depth, dms_share_depth, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(mirror_sync_share_depth, "Max I/Os in flight on a disk shared by legs, dispatched by fair share (0 == off)");
+
+static inline int dms_share_on(struct mirror *m)
+{
+	return READ_ONCE(dms_share_depth) && READ_ONCE(m->disk->users) > 1;
+}
+
+/* Take the next I/Os of the flows by DRR, up to the depth [share_lock held] */
+static void dms_share_pick(struct dms_disk *d, struct list_head *go)
+{
+	unsigned int depth = READ_ONCE(dms_share_depth);
+	struct dms_share_io *io;
+	struct mirror *f;
+
+	while ( (!depth || d->share_inflight < depth) && !list_empty(&d->share_active) ) {
+		f = list_first_entry(&d->share_active, struct mirror, share_active);
+		io = list_first_entry(&f->share_queue, struct dms_share_io, list);
+
+		/* out of credit: its turn is over, with a quantum more for the next one */
+		if (io->cost > f->share_deficit) {
+			f->share_deficit += atomic_read(&f->ms->share_weight) * DMS_SHARE_QUANTUM;
+			list_move_tail(&f->share_active, &d->share_active);
+			continue;
+		}
+
+		f->share_deficit -= io->cost;
+		list_move_tail(&io->list, go);
+		d->share_inflight++;
+		if (!--f->share_queued) {
+			f->share_deficit = 0; /* no credit is kept while idle */
+			list_del_init(&f->share_active);
+		}
+	}
+}
+
+static void dms_share_issue(struct list_head *go)
+{
+	struct dms_share_io *io, *tmp;
+
+	/* NOTE: io may be freed by its callback as soon as it is sent */
+	list_for_each_entry_safe(io, tmp, go, list) {
+		list_del_init(&io->list);
+		BUG_ON(dm_io(&io->req, 1, &io->where, NULL));
+	}
+}
+
+/* Send a leg I/O: through the dispatcher of its disk, if shared (process context) */
+static void dms_share_submit(struct dms_share_io *io)
+{
+	struct mirror *m = io->m;
+	struct dms_disk *d = m->disk;
+	unsigned long flags;
+	LIST_HEAD(go);
+
+	if (!io->shared) {
+		BUG_ON(dm_io(&io->req, 1, &io->where, NULL));
+		return;
+	}
+
+	spin_lock_irqsave(&d->share_lock, flags);
+	list_add_tail(&io->list, &m->share_queue);
+	if (!m->share_queued++)
+		list_add_tail(&m->share_active, &d->share_active);
+	dms_share_pick(d, &go);
+	spin_unlock_irqrestore(&d->share_lock, flags);
+
+	dms_share_issue(&go);
+}
+
+/* A dispatched I/O is done: the next ones are sent from a work, since
+ * the callbacks run in interrupt context and dm_io() may sleep */
+static void dms_share_done(struct dms_share_io *io)
+{
+	struct dms_disk *d = io->m->disk;
+	unsigned long flags;
+	int more;
+
+	if (!io->shared)
+		return;
+
+	spin_lock_irqsave(&d->share_lock, flags);
+	d->share_inflight--;
+	more = !list_empty(&d->share_active);
+	spin_unlock_irqrestore(&d->share_lock, flags);
+
+	if (more)
+		queue_work(dms_share_wq, &d->share_work);
+}
+
+static void do_share_dispatch(struct work_struct *work)
+{
+	struct dms_disk *d = container_of(work, struct dms_disk, share_work);
+	unsigned long flags;
+	LIST_HEAD(go);
+
+	spin_lock_irqsave(&d->share_lock, flags);
+	dms_share_pick(d, &go);
+	spin_unlock_irqrestore(&d->share_lock, flags);
+
+	dms_share_issue(&go);
+}
+
+static void dms_share_init(struct dms_share_io *io, struct mirror *m, struct bio *bio,
+			   struct dm_io_request *req, struct dm_io_region *where, io_notify_fn fn)
+{
+	INIT_LIST_HEAD(&io->list);
+	io->m = m;
+	io->bio = bio;
+	io->cost = max_t(unsigned int, bio->bi_iter.bi_size, DMS_SHARE_MIN_COST);
+	io->shared = dms_share_on(m);
+	io->where = *where;
+	io->req = *req;
+	io->req.notify.fn = fn;
+	io->req.notify.context = io;
+}
+
+/* Drop a part of a write sent leg by leg: the last one completes it */
+static void dms_share_write_put(struct dms_bio_map_info *bmi, struct bio *bio)
+{
+	if ( atomic_dec_and_test(&bmi->share_parts) ) {
+		kfree(bmi->share_ios);
+		write_callback(bmi->share_err, bio);
+	}
+}
+
+static void share_write_callback(unsigned long error, void *context)
+{
+	struct dms_share_io *io = (struct dms_share_io *) context;
+	struct bio *bio = io->bio;
+	struct dms_bio_map_info *bmi = bio_get_m(bio);
+
+	dms_share_done(io);
+	if (unlikely(error))
+		set_bit(io->idx, &bmi->share_err);
+	dms_share_write_put(bmi, bio);
+}
+
+/* Send the legs of a write one dm_io each, the ones on shared disks through
+ * their dispatchers: returns 0 (nothing sent) if none is shared or without
+ * memory, to send the write to all legs at once */
+static int dms_share_write(struct dms_bio_map_info *bmi, struct bio *bio,
+			   struct dm_io_request *req)
+{
+	struct dm_io_region where;
+	unsigned int i, nr = bmi->nr_live;
+	struct dms_share_io *ios;
+
+	for (i = 0; i < nr && !dms_share_on(dms_bmi_leg(bmi, i)); i++)
+		;
+	if (likely(i == nr))
+		return 0;
+
+	ios = kmalloc(nr * sizeof(*ios), GFP_NOIO);
+	if (!ios)
+		return 0;
+
+	bmi->share_ios = ios;
+	bmi->share_err = 0;
+	atomic_set(&bmi->share_parts, nr + 1); /* +1 until all are sent */
+	for (i = 0; i < nr; i++) {
+		map_region(&where, dms_bmi_leg(bmi, i), bio);
+		dms_share_init(ios + i, dms_bmi_leg(bmi, i), bio, req, &where, share_write_callback);
+		ios[i].idx = i;
+	}
+	for (i = 0; i < nr; i++)
+		dms_share_submit(ios + i);
+
+	dms_share_write_put(bmi, bio);
+	return 1;
+}
+
+static void group_write_callback(unsigned long error, void *context)
+{
+	struct dms_io_group *g = (struct dms_io_group *) context;
+	struct bio *bio = g->bio;
+	struct dms_bio_map_info *bmi = bio_get_m(bio);
+	unsigned int i;
+
+	if (unlikely(error))
+		for_each_set_bit(i, &error, DMS_IO_GROUP)
+			set_bit(g->base + i, &bmi->share_err);
+	dms_share_write_put(bmi, bio);
+}
+
+/* Send a write to the legs of bmi_wm[] with one dm_io, or to more legs than
+ * DMS_IO_GROUP with one dm_io per group of them: their errors are merged by
+ * bmi_wm index, as for a write sent leg by leg (see dms_share_write_put()) */
+static void dms_write_legs(struct dms_bio_map_info *bmi, struct bio *bio,
+			   struct dm_io_request *req)
+{
+	struct dm_io_region where[DMS_IO_GROUP];
+	struct dms_io_group *g;
+	unsigned int i, n, base, nr = bmi->nr_live;
+
+	if ( likely(nr <= DMS_IO_GROUP) ) {
+		for (i = 0; i < nr; i++)
+			map_region(where + i, dms_bmi_leg(bmi, i), bio);
+		BUG_ON(dm_io(req, nr, where, NULL));
+		return;
+	}
+
+	bmi->share_ios = NULL;
+	bmi->share_err = 0;
+	atomic_set(&bmi->share_parts, DIV_ROUND_UP(nr, DMS_IO_GROUP) + 1); /* +1 until all are sent */
+	req->notify.fn = group_write_callback;
+	for (base = 0, g = dms_bmi_groups(bmi); base < nr; base += n, g++) {
+		n = min_t(unsigned int, nr - base, DMS_IO_GROUP);
+		for (i = 0; i < n; i++)
+			map_region(where + i, dms_bmi_leg(bmi, base + i), bio);
+		g->bio = bio;
+		g->base = base;
+		req->notify.context = g;
+		BUG_ON(dm_io(req, n, where, NULL));
+	}
+
+	dms_share_write_put(bmi, bio);
+}
+
+static void share_read_callback(unsigned long error, void *context)
+{
+	struct dms_share_io *io = (struct dms_share_io *) context;
+	struct bio *bio = io->bio;
+
+	dms_share_done(io);
+	kfree(io);
+	read_callback(error, bio);
+}
+
+/*----------------------------------------------------------------- */
+
 static int write_async_bios( struct dms_bio_map_info *bmi, struct bio *bio)
 {
-	unsigned int i, nr_live = 0;
-	struct mirror *m;
+	unsigned int i, nr_live = 0, nr_behind = 0, nr_skipped = 0, nr_fallback = 0, nr_zeroed = 0, quorum;
+	unsigned int nr_elided = 0;
+	unsigned long live;
+	struct mirror *m, *jleg = NULL;
+	struct dms_behind_io *io, *prepped = NULL;
+	struct dms_jentry *e = NULL;
+	u8 behind[MAX_MIRRORS], fallback[MAX_MIRRORS], zeroed[MAX_MIRRORS], zero_op[MAX_MIRRORS];
+	int zero = 0;
 	struct mirror_sync_set *ms = bmi->bmi_ms;
-	struct dm_io_region io[ms->nr_mirrors], *dest = io;
 	struct dm_io_request io_req = {
 		.bi_op = REQ_OP_WRITE,
 		.bi_op_flags = bio->bi_opf & WRITE_FLUSH_FUA,
@@ -525,45 +3362,188 @@ static int write_async_bios( struct dms_bio_map_info *bmi, struct bio *bio)
 	};
 
 	assert_bug(bmi);
+	atomic_set(&bmi->bmi_wait, 1); /* dropped by write_callback() */
 	if (bio_op(bio) == REQ_OP_DISCARD) {
 		io_req.bi_op = REQ_OP_DISCARD;
 		io_req.mem.type = DM_IO_KMEM;
 		io_req.mem.ptr.addr = NULL;
+	} else if (bio_op(bio) == REQ_OP_WRITE_SAME) {
+		io_req.bi_op = REQ_OP_WRITE_SAME; /* dm_io takes the block from the bio */
+	}
+#ifdef DMS_HAVE_WRITE_ZEROES
+	else if (bio_op(bio) == REQ_OP_WRITE_ZEROES) {
+		io_req.bi_op = REQ_OP_WRITE_ZEROES;
+		io_req.mem.type = DM_IO_KMEM;
+		io_req.mem.ptr.addr = NULL;
 	}
+#endif
 
 #ifdef ALWAYS_SEND_TO_ALL_MIRRORS // DEBUG ONLY !
 	/* ------------------------------------------
 	 * SENDING TO ALL MIRRORS, EVEN FAULTY ONES! */
-	for (i = 0, m = ms->mirror; i < ms->nr_mirrors; i++, m++) {
-		map_region(dest++, m, bio);
-		bmi->bmi_wm[i] = m;
-	}
+	bmi->resync_epoch = dms_write_epoch_enter(ms);
+	for (i = 0; i < ms->nr_mirrors; i++)
+		bmi->bmi_wm[i] = i;
 	bmi->nr_live = ms->nr_mirrors;
 #else
 	/* ------------------------------------------
 	 * SENDING TO ALL *LIVE* MIRRORS! */
 
+	/* NOTE: nothing that could block (a leg at its caps or lagging too far behind,
+	 * an older write to the same sectors in flight, a full journal...) is waited
+	 * for here: the write is deferred instead, before any of it is issued */
+
+	/* a live leg at its in-flight caps (empty flushes don't load the legs, and
+	 * no caps while suspending: the I/O in flight has to drain) */
+	if ( unlikely(!dms_legs_room(ms)) && bio_sectors(bio) && !atomic_read(&ms->suspend) ) {
+		atomic_inc(&ms->cap_waits);
+		return DMS_WRITE_DEFER;
+	}
+
+	/* all-zero data goes to the zero detecting legs (thin/remote) as a zeroing op */
+	if ( unlikely(atomic_read(&ms->zero_legs)) && bio_op(bio) == REQ_OP_WRITE && bio_sectors(bio) )
+		zero = dms_bio_is_zero(bio);
+
+	/* NOTE: count the write in the current epoch BEFORE looking at leg states */
+	bmi->resync_epoch = dms_write_epoch_enter(ms);
+
+	live = dms_live_legs(ms);
 	for (i = 0, m = ms->mirror; i < ms->nr_mirrors; i++, m++) {
 
 		//sprintf( lvn[i], "%s", bdevname(m->dev->bdev, b) );
 
-		if ( likely(mirror_is_alive(m)) ) {
+		if ( likely(test_bit(i, &live)) ) {
 
 			//lv[i] = 1;
 
-			map_region(dest++, m, bio);
+			/* reinstated legs get writes only for regions already caught up */
+			if ( unlikely(atomic_read(&m->state) == DMS_LEG_RECOVERING) &&
+				 dms_resync_skip_leg(m, bio) )
+				continue;
+
+			/* discards only go to the legs that support them */
+			if ( unlikely(bio_op(bio) == REQ_OP_DISCARD) && !m->discards ) {
+				nr_skipped++;
+				continue;
+			}
+
+			/* legs without the WRITE_SAME/ZEROES offload get the range written out */
+			if ( unlikely(dms_bio_offload(bio)) && !dms_leg_offload(m, bio) ) {
+				if ( dms_behind_busy(m, bio) )
+					goto defer;
+				fallback[nr_fallback++] = i;
+				continue;
+			}
+
+			/* NOTE: not for the journaled leg, its writes must go through the journal */
+			if ( unlikely(zero) && m->zero_detect && m != ms->jr_leg &&
+				 (zero_op[nr_zeroed] = dms_leg_zero_op(m)) ) {
+				if ( dms_behind_busy(m, bio) )
+					goto defer;
+				zeroed[nr_zeroed++] = i;
+				continue;
+			}
+
+			/* async legs are written behind, once we know there's a synchronous one */
+			if ( unlikely(m->async) && dms_behind_ok(ms, bio) ) {
+				behind[nr_behind++] = i;
+				continue;
+			}
+
+			/* writes to the journaled leg go through the journal, the rest
+			 * (discards...) directly, once the journal is applied */
+			if ( unlikely(m == ms->jr_leg) && atomic_read(&m->state) != DMS_LEG_RECOVERING ) {
+				if ( bio_op(bio) == REQ_OP_WRITE ) {
+					jleg = m;
+					continue;
+				}
+				if ( dms_journal_busy(ms) )
+					goto defer;
+			}
+
+			/* no write completed on the leg since its last flush, skip it */
+			if ( unlikely(bio == ms->flush_leader) && dms_flush_clean(m) ) {
+				nr_elided++;
+				nr_skipped++;
+				continue;
+			}
 
-			bmi->bmi_wm[nr_live] = m;
+			if ( dms_behind_busy(m, bio) )
+				goto defer;
+			bmi->bmi_wm[nr_live] = i;
 			nr_live++;
 
+		} else
+			dms_mark_stale(m, bio); /* catch it up if the leg comes back */
+	}
+
+	/* NOTE: if all live legs are async, the first one is written synchronously... */
+	for (i = 0; i < nr_behind; i++) {
+		m = ms->mirror + behind[i];
+		io = nr_live ? dms_behind_prep(m, bio) : NULL;
+		if ( IS_ERR(io) ) {
+			if ( PTR_ERR(io) == -EAGAIN )
+				goto defer_behind;
+			continue; /* the leg died meanwhile */
+		}
+		if (io) {
+			io->next = prepped;
+			prepped = io;
+			continue;
+		}
+
+		if ( dms_behind_busy(m, bio) )
+			goto defer_behind;
+		bmi->bmi_wm[nr_live] = behind[i];
+		nr_live++;
+	}
+
+	/* NOTE: the journal is no use as the only leg... */
+	if ( unlikely(jleg) && !nr_live ) {
+		if ( dms_journal_busy(ms) )
+			goto defer_behind;
+		bmi->bmi_wm[nr_live++] = jleg - ms->mirror;
+		jleg = NULL;
+	}
+
+	/* ...nor for a write it can't take, it goes to the leg once the journal is applied */
+	if ( unlikely(jleg) ) {
+		e = dms_journal_prep(ms, bio);
+		if ( e && !dms_journal_reserve(ms, e) ) {
+			dms_journal_unprep(e); /* full */
+			goto defer_behind;
+		}
+		if ( !e && dms_journal_busy(ms) )
+			goto defer_behind;
+		if (!e) {
+			bmi->bmi_wm[nr_live++] = jleg - ms->mirror;
+			jleg = NULL;
 		}
 	}
 	/*DMSDEBUGX("DMS REQ [2]: WR Addr: %lld Size: %d - LIVE: %d - %d-%d-%d %s-%s-%s\n",
 				(unsigned long long)bio->bi_iter.bi_sector << 9, bio->bi_iter.bi_size, nr_live,
 				lv[0], lv[1], lv[2], lvn[0], lvn[1], lvn[2] ); */
 
-	if ( ! nr_live )
+	/* the write goes now: issue what was set up for it */
+	if ( unlikely(nr_elided) )
+		atomic_add(nr_elided, &ms->flush_elided);
+	for (io = prepped; io; io = prepped) {
+		prepped = io->next;
+		dms_behind_issue(io, bmi->resync_epoch);
+	}
+
+	/* a flush with all live legs clean, or a discard none of them supports, is done */
+	if ( !nr_live && !nr_fallback && !nr_zeroed && nr_skipped ) {
+		bmi->nr_live = 0;
+		bio_set_m(bio, bmi);
+		dms_write_done(bio);
+		return 1;
+	}
+
+	if ( !nr_live && !nr_fallback && !nr_zeroed ) {
+		dms_write_epoch_exit(ms, bmi->resync_epoch);
 		return 0; /* all mirrors dead ! */
+	}
 
 	bmi->nr_live = nr_live;
 #endif
@@ -574,6 +3554,35 @@ static int write_async_bios( struct dms_bio_map_info *bmi, struct bio *bio)
 	 */
 	bio_set_m(bio, bmi);
 
+#ifndef ALWAYS_SEND_TO_ALL_MIRRORS
+	if ( unlikely(jleg) )
+		dms_journal_issue(e, bmi);
+
+	if ( unlikely(dms_bio_offload(bio)) ) {
+		for (i = 0; i < nr_fallback; i++)
+			dms_wsame_fallback(bmi, bio, ms->mirror + fallback[i]);
+		atomic_add(nr_live, &ms->wsame_offloaded);
+	}
+
+	for (i = 0; i < nr_zeroed; i++)
+		if ( !dms_zero_write(bmi, bio, ms->mirror + zeroed[i], zero_op[i]) ) {
+			bmi->bmi_wm[nr_live++] = zeroed[i]; /* no memory, write the data */
+			bmi->nr_live = nr_live;
+		}
+
+	if ( unlikely(!nr_live) ) {
+		dms_write_done(bio); /* when the written out/zeroing writes are done */
+		return 1;
+	}
+
+	/* K-of-N quorum: complete as soon as K legs acked (flush/FUA writes wait for all) */
+	quorum = atomic_read(&ms->write_quorum);
+	if ( quorum && quorum < nr_live && bio_op(bio) == REQ_OP_WRITE &&
+		 !(bio->bi_opf & (REQ_PREFLUSH | REQ_FUA)) &&
+		 dms_quorum_write(bmi, bio, nr_live, quorum) )
+		return 1;
+#endif
+
 #ifndef DISABLE_UNPLUGS // Linux-3.8 specific
 	{
 	struct blk_plug plug;
@@ -581,10 +3590,15 @@ static int write_async_bios( struct dms_bio_map_info *bmi, struct bio *bio)
 	blk_start_plug(&plug);
 #endif
 
+	for (i = 0; i < bmi->nr_live; i++)
+		dms_leg_issue(dms_bmi_leg(bmi, i), bio_sectors(bio));
+
 #ifdef ALWAYS_SEND_TO_ALL_MIRRORS // DEBUG ONLY !
-	BUG_ON(dm_io(&io_req, ms->nr_mirrors, io, NULL));
+	dms_write_legs(bmi, bio, &io_req);
 #else
-	BUG_ON(dm_io(&io_req, nr_live, io, NULL));
+	/* legs on shared disks get their share of them (see dms_share_write()) */
+	if ( likely(!dms_share_write(bmi, bio, &io_req)) )
+		dms_write_legs(bmi, bio, &io_req);
 #endif
 
 #ifndef DISABLE_UNPLUGS // Linux-3.8 specific
@@ -595,6 +3609,103 @@ static int write_async_bios( struct dms_bio_map_info *bmi, struct bio *bio)
 	DMSDEBUG("write_async_bios (2) call...\n");
 
 	return 1;
+
+#ifndef ALWAYS_SEND_TO_ALL_MIRRORS
+defer_behind:
+	for (io = prepped; io; io = prepped) {
+		prepped = io->next;
+		dms_behind_unprep(io);
+	}
+defer:
+	dms_write_epoch_exit(ms, bmi->resync_epoch);
+	return DMS_WRITE_DEFER;
+#endif
+}
+
+/*----------------------------------------------------------------- */
+
+/* Start a flush round, led by the oldest waiting flush: the ones that came in
+ * while the previous round ran complete with it, as in blk-flush. The legs with
+ * no write completed since their last flush are skipped by write_async_bios()... */
+static void dms_flush_issue(struct mirror_sync_set *ms, struct bio *bio, int can_wait);
+
+static void dms_flush_start(struct mirror_sync_set *ms, int can_wait)
+{
+	struct bio *bio;
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&ms->flush_lock, flags);
+	bio = bio_list_pop(&ms->flush_pending);
+	bio_list_merge(&ms->flush_round, &ms->flush_pending);
+	bio_list_init(&ms->flush_pending);
+	WRITE_ONCE(ms->flush_leader, bio);
+	spin_unlock_irqrestore(&ms->flush_lock, flags);
+
+	assert_return( bio, );
+
+	/* the writes the round covers: all completed before its flushes came in */
+	for (i = 0; i < ms->nr_mirrors; i++)
+		ms->mirror[i].flush_snap = atomic_read(&ms->mirror[i].wr_gen);
+	atomic_inc(&ms->flush_rounds);
+
+	dms_flush_issue(ms, bio, can_wait);
+}
+
+/* Issue the flush leading the round. If a leg can't take it yet (behind writes in
+ * flight to it...), flush_work waits for it, or gets the round handed (map context) */
+static void dms_flush_issue(struct mirror_sync_set *ms, struct bio *bio, int can_wait)
+{
+	int r, gen;
+
+	for (;;) {
+		gen = atomic_read(&ms->defer_gen);
+		r = write_async_bios(dms_bio_bmi(ms, bio), bio);
+		if (r != DMS_WRITE_DEFER)
+			break;
+
+		if (!can_wait) {
+			queue_work(dms_wq, &ms->flush_work);
+			return;
+		}
+		wait_event(ms->defer_wait, atomic_read(&ms->defer_gen) != gen);
+	}
+
+	if (!r) {
+		bio->bi_error = -EIO;
+		dms_flush_end(ms, bio);
+		bio_endio(bio);
+	}
+}
+
+/* Queue an empty flush: it starts a round, or waits for the next one... */
+static void dms_flush_queue(struct mirror_sync_set *ms, struct bio *bio)
+{
+	unsigned long flags;
+	int start;
+
+	spin_lock_irqsave(&ms->flush_lock, flags);
+	bio_list_add(&ms->flush_pending, bio);
+	start = !ms->flush_busy;
+	ms->flush_busy = 1;
+	spin_unlock_irqrestore(&ms->flush_lock, flags);
+
+	if (start)
+		dms_flush_start(ms, 0);
+}
+
+static void do_flush_round(struct work_struct *work)
+{
+	struct mirror_sync_set *ms = container_of(work, struct mirror_sync_set, flush_work);
+	int idx = srcu_read_lock(&dms_legs_srcu);
+	struct bio *leader = READ_ONCE(ms->flush_leader);
+
+	/* the next round, or the leader dms_flush_queue() couldn't issue */
+	if (leader)
+		dms_flush_issue(ms, leader, 1);
+	else
+		dms_flush_start(ms, 1);
+	srcu_read_unlock(&dms_legs_srcu, idx);
 }
 
 /*----------------------------------------------------------------- */
@@ -610,6 +3721,9 @@ static void read_callback(unsigned long error, void *context)
 	bmi = bio_get_m(bio);
 	assert( bmi ); /* bug trap... */
 	m = bmi->bmi_m;
+	dms_leg_done(m, bio_sectors(bio));
+	if (likely(!error))
+		dms_disk_latency(m, bmi);
 
 	DMSDEBUG("read_callback() enter (Dev: %s)...\n", m->dev->name);
 
@@ -652,9 +3766,8 @@ static void read_callback(unsigned long error, void *context)
 			dm_bio_restore(bd, bio);
 
 			/* ATTENTION: we MUST keep the pointer live in bio, but we CANNOT use bio_set_m(bio, NULL); !
-			 *            -> so call the special bio_push_m_priv(bio, bmi); to push/pop the bi_private */
-			bio_push_m_priv(bio, bmi);
-			
+			 *            -> the bmi (bi_next) is queued, by its retry_node */
+
 			DMSDEBUG("read_callback (Dev: %s): queueing read IO on thread!\n", m->dev->name );
 			queue_bio(m->ms, bio, bio_data_dir(bio));
 			return;
@@ -699,6 +3812,18 @@ static void read_async_bio(struct dms_bio_map_info *bmi, struct bio *bio)
 	assert_bug(bmi);
 	map_region(&io, m, bio);
 	bio_set_m(bio, bmi);
+	dms_leg_issue(m, bio_sectors(bio));
+
+	/* a leg on a shared disk gets its share of the reads */
+	if ( unlikely(dms_share_on(m)) ) {
+		struct dms_share_io *sio = kmalloc(sizeof(*sio), GFP_NOIO);
+
+		if (sio) {
+			dms_share_init(sio, m, bio, &io_req, &io, share_read_callback);
+			dms_share_submit(sio);
+			return;
+		}
+	}
 
 #ifdef DISABLE_UNPLUGS // Linux-3.8 specific
 	BUG_ON(dm_io(&io_req, 1, &io, NULL));
@@ -713,33 +3838,487 @@ static void read_async_bio(struct dms_bio_map_info *bmi, struct bio *bio)
 #endif
 }
 
+/*-----------------------------------------------------------------
+ *  Deferred writes: a write that can't go without blocking (a leg at
+ *  its in-flight caps or lagging too far behind, an older write to the
+ *  same sectors in flight to an async leg, a full journal...) is queued
+ *  per set, in arrival order, and mapped by defer_work as the I/O in
+ *  its way completes, so the submitter never sleeps in map.
+ *---------------------------------------------------------------*/
+static int dms_map_bio(struct mirror_sync_set *ms, struct bio *bio);
+
+/* Queue a write that couldn't be mapped (see DMS_WRITE_DEFER) */
+static void dms_defer_add(struct mirror_sync_set *ms, struct bio *bio)
+{
+	unsigned long flags;
+
+	/* not mapped (yet): mirror_sync_end_io() has nothing to account */
+	dms_bio_bmi(ms, bio)->bmi_ms = NULL;
+
+	spin_lock_irqsave(&ms->defer_lock, flags);
+	bio_list_add(&ms->defer_queue, bio);
+	WRITE_ONCE(ms->defer_queued, ms->defer_queued + 1);
+	spin_unlock_irqrestore(&ms->defer_lock, flags);
+
+	/* CAUTION: what it waits for may have completed before it saw us queued
+	 * (dms_defer_kick() only queues the work for writes already queued) */
+	queue_work(dms_wq, &ms->defer_work);
+}
+
+/* Map a bio, or defer a write that can't go now, or that others wait before:
+ * 0 once submitted (or deferred), or the error to fail it with */
+static int dms_map_defer(struct mirror_sync_set *ms, struct bio *bio)
+{
+	int r;
+
+	/* NOTE: empty flushes don't load the legs, and cover only completed writes */
+	if ( unlikely(READ_ONCE(ms->defer_queued)) && bio_data_dir(bio) == WRITE &&
+		 !((bio->bi_opf & REQ_PREFLUSH) && !bio_sectors(bio)) ) {
+		dms_defer_add(ms, bio);
+		return 0;
+	}
+
+	r = dms_map_bio(ms, bio);
+	if ( unlikely(r == DMS_WRITE_DEFER) ) {
+		dms_defer_add(ms, bio);
+		r = 0;
+	}
+	return r;
+}
+
+/* Map the deferred writes in order, until one still can't go (a kick brings us
+ * back for it: it is still counted in defer_queued while we try it) */
+static void do_defer_dispatch(struct work_struct *work)
+{
+	struct mirror_sync_set *ms = container_of(work, struct mirror_sync_set, defer_work);
+	struct bio *bio;
+	unsigned long flags;
+	int r, idx;
+
+	idx = srcu_read_lock(&dms_legs_srcu);
+	for (;;) {
+		spin_lock_irqsave(&ms->defer_lock, flags);
+		bio = bio_list_pop(&ms->defer_queue);
+		spin_unlock_irqrestore(&ms->defer_lock, flags);
+		if (!bio)
+			break;
+
+		/* CAUTION: mapped, the bio may be completed & gone right away */
+		r = dms_map_bio(ms, bio);
+		spin_lock_irqsave(&ms->defer_lock, flags);
+		if (r == DMS_WRITE_DEFER)
+			bio_list_add_head(&ms->defer_queue, bio);
+		else
+			WRITE_ONCE(ms->defer_queued, ms->defer_queued - 1);
+		spin_unlock_irqrestore(&ms->defer_lock, flags);
+		if (r == DMS_WRITE_DEFER)
+			break;
+
+		if (r) {
+			dms_bio_bmi(ms, bio)->bmi_ms = NULL;
+			bio->bi_error = r;
+			bio_endio(bio);
+		}
+	}
+	srcu_read_unlock(&dms_legs_srcu, idx);
+
+	/* a flush suspend waits for the queue to drain (see mirror_sync_presuspend()) */
+	if ( !READ_ONCE(ms->defer_queued) )
+		wake_up_all(&ms->defer_wait);
+}
+
 /* ----------------------------------------------------------------
  * Mirror mapping function -> All the I/O action goes through here!
  */
-static int mirror_sync_map(struct dm_target *ti, struct bio *bio)
+/*-----------------------------------------------------------------
+ * QoS limits: token buckets for the IOPS & KiB/s of reads and writes
+ *
+ * Bios over the limits are queued per direction, in arrival order,
+ * and dispatched by qos_work as the buckets refill, so the submitter
+ * never sleeps on them. A bio may put a bucket into debt, so bios
+ * bigger than the burst still pass (and the next ones wait longer).
+ *---------------------------------------------------------------*/
+static int dms_map_bio(struct mirror_sync_set *ms, struct bio *bio);
+
+static inline int dms_qos_on(struct dms_qos *q)
+{
+	return READ_ONCE(q->iops.rate) || READ_ONCE(q->bw.rate);
+}
+
+/* nsecs until the bucket takes another bio, 0 == now */
+static inline u64 dms_bucket_wait(struct dms_bucket *b, u64 now)
+{
+	u64 limit = now + DMS_QOS_BURST_MS * NSEC_PER_MSEC;
+
+	return (b->rate && b->tat > limit) ? b->tat - limit : 0;
+}
+
+static inline void dms_bucket_take(struct dms_bucket *b, u64 now, u64 cost)
+{
+	if (b->rate)
+		b->tat = max(b->tat, now) + div64_u64(cost * NSEC_PER_SEC, b->rate);
+}
+
+/* Charge the bio to the buckets of its direction: with leg cost,
+ * a write counts once for each live leg it fans out to */
+static void dms_qos_take(struct mirror_sync_set *ms, struct dms_qos *q, struct bio *bio, u64 now)
+{
+	u64 bytes = 0;
+	unsigned int i, legs = 1;
+
+	if (bio_op(bio) == REQ_OP_READ || bio_op(bio) == REQ_OP_WRITE)
+		bytes = bio->bi_iter.bi_size;
+
+	if (bio_data_dir(bio) == WRITE && ms->qos_leg_cost) {
+		for (legs = 0, i = 0; i < ms->nr_mirrors; i++)
+			if ( mirror_is_alive(ms->mirror + i) )
+				legs++;
+		legs = max(legs, 1U);
+	}
+
+	dms_bucket_take(&q->iops, now, legs);
+	dms_bucket_take(&q->bw, now, bytes * legs);
+}
+
+/* jiffies until the first deferred bio may go, -1 == none deferred [qos_lock held] */
+static long dms_qos_next(struct mirror_sync_set *ms, u64 now)
+{
+	long next = -1, j;
+	int rw;
+
+	for (rw = READ; rw <= WRITE; rw++) {
+		struct dms_qos *q = ms->qos + rw;
+
+		if (!q->queued)
+			continue;
+		j = usecs_to_jiffies( div_u64( max(dms_bucket_wait(&q->iops, now),
+						dms_bucket_wait(&q->bw, now)), NSEC_PER_USEC ) );
+		if (next < 0 || j < next)
+			next = j;
+	}
+
+	return next;
+}
+
+/* Defer the bio if it is over the limits or others of its direction wait
+ * before it: returns 1 if deferred, 0 to map it now */
+static int dms_qos_defer(struct mirror_sync_set *ms, struct bio *bio)
+{
+	struct dms_qos *q = ms->qos + bio_data_dir(bio);
+	u64 now = ktime_get_ns();
+	unsigned long flags;
+	int defer = 0;
+
+	/* no limits while suspending: the I/O in flight has to drain */
+	if ( !dms_qos_on(q) || atomic_read(&ms->suspend) )
+		return 0;
+
+	spin_lock_irqsave(&ms->qos_lock, flags);
+	if (q->queued || dms_bucket_wait(&q->iops, now) || dms_bucket_wait(&q->bw, now)) {
+		/* not mapped (yet): mirror_sync_end_io() has nothing to account */
+		dms_bio_bmi(ms, bio)->bmi_ms = NULL;
+		bio_list_add(&q->queue, bio);
+		if (!q->queued++)
+			mod_delayed_work(dms_wq, &ms->qos_work, dms_qos_next(ms, now));
+		defer = 1;
+	} else
+		dms_qos_take(ms, q, bio, now);
+	spin_unlock_irqrestore(&ms->qos_lock, flags);
+
+	if (defer)
+		atomic_inc( &q->deferred );
+
+	return defer;
+}
+
+/* Dispatch the deferred bios the buckets have room for, and come back for the rest */
+static void do_qos_dispatch(struct work_struct *work)
+{
+	struct mirror_sync_set *ms = container_of(to_delayed_work(work), struct mirror_sync_set, qos_work);
+	struct bio_list go;
+	struct bio *bio;
+	u64 now = ktime_get_ns();
+	unsigned long flags;
+	long next;
+	int rw, r, idx;
+
+	bio_list_init(&go);
+
+	spin_lock_irqsave(&ms->qos_lock, flags);
+	for (rw = READ; rw <= WRITE; rw++) {
+		struct dms_qos *q = ms->qos + rw;
+
+		while ( (bio = bio_list_peek(&q->queue)) ) {
+			if ( !atomic_read(&ms->suspend) &&
+				 (dms_bucket_wait(&q->iops, now) || dms_bucket_wait(&q->bw, now)) )
+				break;
+			dms_qos_take(ms, q, bio, now);
+			bio_list_add(&go, bio_list_pop(&q->queue));
+			q->queued--;
+		}
+	}
+	next = dms_qos_next(ms, now);
+	if (next >= 0)
+		queue_delayed_work(dms_wq, &ms->qos_work, next);
+	spin_unlock_irqrestore(&ms->qos_lock, flags);
+
+	idx = srcu_read_lock(&dms_legs_srcu);
+	while ( (bio = bio_list_pop(&go)) ) {
+		r = dms_map_defer(ms, bio);
+		if (r) {
+			dms_bio_bmi(ms, bio)->bmi_ms = NULL;
+			bio->bi_error = r;
+			bio_endio(bio);
+		}
+	}
+	srcu_read_unlock(&dms_legs_srcu, idx);
+}
+
+/*-----------------------------------------------------------------
+ *  Noflush suspend: instead of waiting for the queued retries & deferred
+ *  bios to finish on the (maybe slow) legs, push them back to dm core,
+ *  which resubmits them to the table resumed next.
+ *---------------------------------------------------------------*/
+
+static inline int dms_noflush(struct mirror_sync_set *ms)
+{
+	return atomic_read(&ms->suspend) && dm_noflush_suspending(ms->ti);
+}
+
+/* Complete a bio already accepted by mirror_sync_map() with a requeue: flagged
+ * here, mirror_sync_end_io() hands DM_ENDIO_REQUEUE to dm core for it (the
+ * error is only what the bio ends with if dm core doesn't take it back) */
+static void dms_requeue_bio(struct mirror_sync_set *ms, struct bio *bio)
+{
+	atomic_inc( &ms->requeued );
+	dms_bio_bmi(ms, bio)->bmi_requeue = 1;
+	bio->bi_error = -EIO;
+	bio_endio(bio);
+}
+
+/* Requeue the bios deferred by the QoS limits, without mapping them */
+static void dms_qos_requeue(struct mirror_sync_set *ms)
+{
+	struct bio_list back;
+	struct bio *bio;
+	unsigned long flags;
+	int rw;
+
+	cancel_delayed_work_sync(&ms->qos_work);
+
+	bio_list_init(&back);
+	spin_lock_irqsave(&ms->qos_lock, flags);
+	for (rw = READ; rw <= WRITE; rw++) {
+		bio_list_merge(&back, &ms->qos[rw].queue);
+		bio_list_init(&ms->qos[rw].queue);
+		ms->qos[rw].queued = 0;
+	}
+	spin_unlock_irqrestore(&ms->qos_lock, flags);
+
+	while ( (bio = bio_list_pop(&back)) )
+		dms_requeue_bio(ms, bio);
+}
+
+/* Requeue the deferred writes, without mapping them */
+static void dms_defer_requeue(struct mirror_sync_set *ms)
+{
+	struct bio_list back;
+	struct bio *bio;
+	unsigned long flags;
+
+	cancel_work_sync(&ms->defer_work);
+
+	spin_lock_irqsave(&ms->defer_lock, flags);
+	back = ms->defer_queue;
+	bio_list_init(&ms->defer_queue);
+	WRITE_ONCE(ms->defer_queued, 0);
+	spin_unlock_irqrestore(&ms->defer_lock, flags);
+
+	while ( (bio = bio_list_pop(&back)) )
+		dms_requeue_bio(ms, bio);
+}
+
+/*-----------------------------------------------------------------
+ *  Two legs: most sets are a pair, the writes and the reads of a pair
+ *  in the plain state take a short path with the legs at fixed places
+ *  (no loops, no index lists). Anything else goes the generic way.
+ *---------------------------------------------------------------*/
+
+/* Both legs alive & in sync, synchronous, no journal, no behind writes
+ * in flight and no in-flight caps... */
+static inline int dms_pair_plain(struct mirror_sync_set *ms)
+{
+	struct mirror *m = ms->mirror;
+
+	return dms_live_legs(ms) == 3 && !ms->jr_leg &&
+		   atomic_read(&m[0].state) == DMS_LEG_INSYNC &&
+		   atomic_read(&m[1].state) == DMS_LEG_INSYNC &&
+		   !(m[0].async | m[1].async) &&
+		   !(atomic_read(&m[0].behind_ios) | atomic_read(&m[1].behind_ios)) &&
+		   !(atomic_read(&ms->cap_kb) | atomic_read(&ms->cap_ios));
+}
+
+static void write_pair_callback(unsigned long error, void *context)
+{
+	struct bio *bio = (struct bio *) context;
+	struct dms_bio_map_info *bmi = bio_get_m(bio);
+	struct mirror *m = bmi->bmi_ms->mirror;
+
+	if ( unlikely(error) ) {
+		write_callback(error, bio);
+		return;
+	}
+
+	dms_leg_done(m, bio_sectors(bio));
+	dms_leg_done(m + 1, bio_sectors(bio));
+	atomic_inc(&m[0].wr_gen);
+	atomic_inc(&m[1].wr_gen);
+	dms_write_done(bio);
+}
+
+static int dms_write_pair(struct dms_bio_map_info *bmi, struct bio *bio)
+{
+	struct mirror_sync_set *ms = bmi->bmi_ms;
+	struct mirror *m = ms->mirror;
+	struct dm_io_region where[2];
+	struct dm_io_request io_req = {
+		.bi_op = REQ_OP_WRITE,
+		.bi_op_flags = bio->bi_opf & WRITE_FLUSH_FUA,
+		.mem.type = DM_IO_BIO,
+		.mem.ptr.bio = bio,
+		.notify.fn = write_pair_callback,
+		.notify.context = bio,
+		.client = ms->io_client,
+	};
+
+	/* only data writes, no zero detection, no quorum (1 of 2) or fair share */
+	if ( unlikely(bio_op(bio) != REQ_OP_WRITE || !bio_sectors(bio) ||
+				  atomic_read(&ms->zero_legs) || atomic_read(&ms->write_quorum) == 1 ||
+				  dms_share_on(m) || dms_share_on(m + 1)) )
+		return write_async_bios(bmi, bio);
+
+	/* NOTE: count the write in the current epoch BEFORE looking at leg states */
+	bmi->resync_epoch = dms_write_epoch_enter(ms);
+	if ( unlikely(!dms_pair_plain(ms)) ) {
+		dms_write_epoch_exit(ms, bmi->resync_epoch);
+		return write_async_bios(bmi, bio);
+	}
+
+	atomic_set(&bmi->bmi_wait, 1); /* dropped by write_callback() */
+	bmi->bmi_wm[0] = 0;
+	bmi->bmi_wm[1] = 1;
+	bmi->nr_live = 2;
+	bio_set_m(bio, bmi);
+
+	map_region(where, m, bio);
+	map_region(where + 1, m + 1, bio);
+	dms_leg_issue(m, bio_sectors(bio));
+	dms_leg_issue(m + 1, bio_sectors(bio));
+
+#ifndef DISABLE_UNPLUGS // Linux-3.8 specific
+	{
+	struct blk_plug plug;
+
+	blk_start_plug(&plug);
+#endif
+	BUG_ON(dm_io(&io_req, 2, where, NULL));
+#ifndef DISABLE_UNPLUGS // Linux-3.8 specific
+	blk_finish_plug(&plug);
+	}
+#endif
+
+	return 1;
+}
+
+/* Round robin over a pair: rr_ios_set reads on a leg, then on the other one,
+ * without the choose_lock (other policies & states: choose_read_mirror()) */
+static struct mirror *dms_read_pair(struct mirror_sync_set *ms, struct bio *bio)
 {
-	int rw = bio_data_dir(bio);
 	struct mirror *m;
+	unsigned int n;
+
+	if ( unlikely(atomic_read(&ms->rdpolicy) != DMS_ROUND_ROBIN || atomic_read(&ms->numa_reads) ||
+				  !dms_pair_plain(ms)) )
+		return choose_read_mirror(ms, bio);
+
+	n = (unsigned int) atomic_inc_return(&ms->pair_reads) / atomic_read(&ms->rr_ios_set);
+	m = ms->mirror + (n & 1);
+
+	/* CAUTION: the leg may have failed & be catching up by now, with these
+	 * regions stale: same region check as the generic path then... */
+	if ( unlikely(!mirror_read_ok(m, bio)) )
+		return choose_read_mirror(ms, bio);
+
+	return m;
+}
+
+static bool dms_pair_path = true;
+module_param_named(mirror_sync_pair_path, dms_pair_path, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(mirror_sync_pair_path, "Sets of two legs loaded from now on take the two-leg I/O path");
+
+static const struct dms_io_ops dms_pair_ops = {
+	.write = dms_write_pair,
+	.read = dms_read_pair,
+};
+
+static const struct dms_io_ops dms_any_ops = {
+	.write = write_async_bios,
+	.read = choose_read_mirror,
+};
+
+/*----------------------------------------------------------------- */
+
+static int mirror_sync_map(struct dm_target *ti, struct bio *bio)
+{
 	struct mirror_sync_set *ms = ti->private;
-	struct dms_bio_map_info *bmi = dm_per_bio_data(bio, sizeof(struct dms_bio_map_info));
+	int idx, r;
+
+	if (bio->bi_opf & REQ_RAHEAD) // read-ahead...
+		return -EWOULDBLOCK;
+
+	dms_bio_bmi(ms, bio)->bmi_requeue = 0;
+
+	/* a noflush suspend is on: dm core passes the bio to the next table */
+	if ( unlikely(dms_noflush(ms)) ) {
+		atomic_inc( &ms->requeued );
+		return DM_MAPIO_REQUEUE;
+	}
+
+	/* over the QoS limits: queued, mapped later by do_qos_dispatch() */
+	if ( dms_qos_defer(ms, bio) )
+		return DM_MAPIO_SUBMITTED;
+
+	/* NOTE: a write that can't go now is queued, mapped later by do_defer_dispatch() */
+	idx = srcu_read_lock(&dms_legs_srcu);
+	r = dms_map_defer(ms, bio);
+	srcu_read_unlock(&dms_legs_srcu, idx);
+
+	return r;
+}
+
+/* Map a bio to the legs: 0 once submitted, the error to fail it with, or
+ * DMS_WRITE_DEFER for a write that can't go without blocking */
+static int dms_map_bio(struct mirror_sync_set *ms, struct bio *bio)
+{
+	int rw = bio_data_dir(bio), r;
+	struct mirror *m;
+	struct dms_bio_map_info *bmi = dms_bio_bmi(ms, bio);
 	struct dm_bio_details *bd = NULL;
 #ifdef DEBUGMSG
 	struct mapped_device *md;
 
 	/* NOTE: this is only for debugging... */
-	md = dm_table_get_md(ti->table);
+	md = dm_table_get_md(ms->ti->table);
 	DMSDEBUG("mirror_sync_map() enter (Dev: %s)...\n", dm_device_name(md));
 #endif
-	if (bio->bi_opf & REQ_RAHEAD) // read-ahead...
-		return -EWOULDBLOCK;
-
 	if (likely(bmi)) {
 		/* without this, an I/O operation is not recoverable by sending to a different mirror */
 		bd = &bmi->bmi_bd;
 		bd->bi_bdev = NULL;
 		dm_bio_record(bd, bio);
-		bmi->bmi_m = ms->default_mirror; /* use default by default ;) */
+		bmi->bmi_m = READ_ONCE(ms->default_mirror); /* use default by default ;) */
 		bmi->bmi_ms = ms;
+		bmi->start_ns = ktime_get_ns();
 	} else {
 		/* Cannot happen, since dms_bio_map_info_pool_alloc() waits until memory is available... */
 		DMSDEBUG("BUG!! mirror_sync_map could NOT allocate bmi!!\n");
@@ -748,14 +4327,13 @@ static int mirror_sync_map(struct dm_target *ti, struct bio *bio)
 
 	/* Handling writes... fwd them and get a callback at mirror_sync_end_io() */
 	if (rw == WRITE) {
+		dms_heat_bio(ms, bio);
 #ifdef DEBUGMSG
 		//DMSDEBUG("mirror_sync_map WRITE call...\n");
 		DMSDEBUG("[%s] DMS REQ: WRITE Addr: %lld Size: %d\n", dm_device_name(md),
 		   				(unsigned long long)bio->bi_iter.bi_sector << 9, bio->bi_iter.bi_size);
 #endif
 
-		atomic_inc( &ms->write_ios_total );
-
 #ifdef DEBUG_WRITE_TO_SINGLE_MIRROR
 		/* INFO: the dispatch_bio writes to ONE mirror only... [DEBUG ONLY] */
 		m = ms->default_mirror;
@@ -763,11 +4341,21 @@ static int mirror_sync_map(struct dm_target *ti, struct bio *bio)
 		bmi->bmi_m = ms->default_mirror;
 		dispatch_bio( bmi, bio, rw);
 #else
+		/* NOTE: concurrent empty flushes are merged (see dms_flush_start()) */
+		if ( (bio->bi_opf & REQ_PREFLUSH) && !bio_sectors(bio) )
+			dms_flush_queue(ms, bio);
+
 		/* NOTE: we use write_async_bios() to send write to ALL MIRRORS! */
-		if ( ! write_async_bios(bmi, bio) )
-			goto write_all_dead;
+		else {
+			r = ms->ops->write(bmi, bio);
+			if ( unlikely(r == DMS_WRITE_DEFER) )
+				return r; /* nothing issued */
+			if (!r)
+				goto write_all_dead;
+		}
 #endif
 
+		atomic_inc( &ms->write_ios_total );
 	   	atomic_inc( &ms->write_ios_pending );
 
 		return 0;
@@ -780,6 +4368,7 @@ static int mirror_sync_map(struct dm_target *ti, struct bio *bio)
 				(unsigned long long)bio->bi_iter.bi_sector << 9, bio->bi_iter.bi_size);
 #endif
 	atomic_inc( &ms->read_ios_total );
+	dms_heat_bio(ms, bio);
 
 	/*
 	 * Load-balance reads by the chosen policy to improve performance...
@@ -788,7 +4377,15 @@ static int mirror_sync_map(struct dm_target *ti, struct bio *bio)
 	 * in the mirror_sync_end_io() function.
 	 */
    	atomic_inc( &ms->read_ios_pending );
-	m = choose_read_mirror(ms, bio->bi_iter.bi_sector);
+	m = ms->ops->read(ms, bio);
+
+	/* the journaled leg may be the last one left: retried by do_read_failures()
+	 * once it caught up (not waited for here) */
+	if ( unlikely(!m) && ms->jr_leg && mirror_is_alive(ms->jr_leg) ) {
+		bio_set_m(bio, bmi);
+		queue_bio(ms, bio, READ);
+		return 0;
+	}
 
 	/* A live mirror was found... */
 	if (likely(m)) {
@@ -832,6 +4429,7 @@ write_all_dead:
 static int mirror_sync_end_io(struct dm_target *ti, struct bio *bio, int error)
 {
 	struct mirror_sync_set *ms = (struct mirror_sync_set *) ti->private;
+	struct dms_bio_map_info *bmi = dms_bio_bmi(ms, bio);
 
 	DMSDEBUG_CALL("mirror_sync_end_io called...\n");
 
@@ -839,6 +4437,18 @@ static int mirror_sync_end_io(struct dm_target *ti, struct bio *bio, int error)
 	 * CAUTION: do NOT touch the bio->bi_private! the dm code uses it for clone_bio() !
 	 */
 
+	/* pushed back to dm core by a noflush suspend (see dms_requeue_bio()) */
+	if ( unlikely(bmi->bmi_requeue) )
+		error = DM_ENDIO_REQUEUE;
+
+	/* ended before dms_map_bio() took it (QoS/caps deferred & requeued or failed) */
+	if ( unlikely(!bmi->bmi_ms) )
+		return error;
+
+	/* feeds the adaptive resync rate... */
+	if ( likely(error != DM_ENDIO_REQUEUE) )
+		dms_account_latency(ms, bmi);
+
 	/* Update our pending I/O counters... */
 	if ( bio_data_dir(bio) == WRITE)
 	   	atomic_dec( &ms->write_ios_pending );
@@ -859,57 +4469,79 @@ static void mirror_sync_presuspend(struct dm_target *ti)
 	struct mirror_sync_set *ms = (struct mirror_sync_set *) ti->private;
 
 	DMSDEBUG_CALL("mirror_sync_presuspend called...\n");
+	atomic_set(&ms->requeued, 0);
 	atomic_set(&ms->suspend, 1);
 
-	assert_bug( ms->reconfig_idx < curr_ms_instances );
+	assert_bug( !hlist_unhashed(&ms->reg_node) );
+
+	/* stop probing failed legs & copying regions (restarted on resume)... */
+	dms_stop_probe(ms);
+
+	/*
+	 * Noflush: the deferred bios, the queued read retries & any new bios are
+	 * pushed back to dm core (see dms_noflush()). dm core still waits for the
+	 * bios in flight on the legs, but we do not block here for the retries.
+	 */
+	if ( dms_noflush(ms) ) {
+		dms_qos_requeue(ms);
+		dms_defer_requeue(ms);
+		wake(ms);
+		return;
+	}
+
+	/* let the bios deferred by the QoS limits & caps go (none while suspended),
+	 * and the writes deferred for behind writes or the journal, as they complete... */
+	mod_delayed_work(dms_wq, &ms->qos_work, 0);
+	flush_delayed_work(&ms->qos_work);
+	dms_defer_kick(ms);
+	wait_event(ms->defer_wait, !READ_ONCE(ms->defer_queued));
 
 	/*
 	 * We don't need to finish any recovery work, because that process
 	 * is handled offline for us... just need to flush any read retries...
 	 */
-	flush_workqueue(ms->kmirror_syncd_wq);
+	dms_retry_flush(ms);
+	flush_work(&ms->flush_work);
 }
 
 /*----------------------------------------------------------------- */
 
-static void do_read_failures(struct mirror_sync_set *ms, struct bio_list *read_failures)
+static void do_read_failures(struct mirror_sync_set *ms, struct llist_node *read_failures)
 {
-	int rw;
+	int rw, idx;
 	struct bio *bio;
 	struct mirror *m;
-	struct dms_bio_map_info *bmi = NULL;
-	struct dm_bio_details *bd = NULL;
+	struct dms_bio_map_info *bmi, *next;
 
 	DMSDEBUG_CALL("do_read_failures() ENTERING...\n");
 
-	while ((bio = bio_list_pop(read_failures))) {
+	idx = srcu_read_lock(&dms_legs_srcu);
+	/* CAUTION: _safe, a redispatched read may fail & get queued again meanwhile */
+	llist_for_each_entry_safe(bmi, next, read_failures, retry_node) {
 
+		/* NOTE: we re-use the already allocated bmi, the per-bio data of the bio... */
+		bio = dm_bio_from_per_bio_data(bmi, ms->ti->per_io_data_size);
 		DMSDEBUG("do_read_failures() GOT BIO...\n");
 		rw = bio_data_dir(bio);
+		assert( bmi->bmi_ms == ms );
 
-		/* NOTE: we re-use the already allocated bmi, that was saved in the bio struct... */
-		bmi = bio_pop_m_priv(bio);
-		assert( bmi ); /* bug trap... */
+		DMSDEBUG("do_read_failures() READ call...\n");
+		assert_bug( rw == READ ); // BUG TRAP: ONLY QUEUEING READS FOR NOW...
 
-		if (likely(bmi)) {
-			/* without this, an I/O operation is not recoverable by sending to a different mirror */
-			bd = &bmi->bmi_bd;
-			assert( bmi->bmi_ms == ms );
-		} else {
-			/* BUG ALERT: NULL bmi pointer! cannot continue, failing I/O */
-			DMERR("[%s] do_read_failures(): NULL bmi pointer, failing I/O read", ms->name);
-			bio->bi_error = -EFAULT;
-			bio_endio(bio);
+		/* noflush suspend: retried by dm core on the next table */
+		if ( dms_noflush(ms) ) {
+			dms_requeue_bio(ms, bio);
 			continue;
 		}
 
-		DMSDEBUG("do_read_failures() READ call...\n");
-		assert_bug( rw == READ ); // BUG TRAP: ONLY QUEUEING READS FOR NOW...
-
 		/*
 		 * We can ALWAYS retry the read on another device because they are always in sync.
 		 */
-		m = choose_read_mirror(ms, bio->bi_iter.bi_sector);
+		m = choose_read_mirror(ms, bio);
+		if ( unlikely(!m) && ms->jr_leg && mirror_is_alive(ms->jr_leg) ) {
+			dms_journal_drain(ms);
+			m = choose_read_mirror(ms, bio);
+		}
 
 		/* CAUTION: shortcuts do not always work... */
 		//if (unlikely(m && !mirror_is_alive(m)))
@@ -944,6 +4576,7 @@ static void do_read_failures(struct mirror_sync_set *ms, struct bio_list *read_f
 			DMSDEBUG("do_read_failures(): bio_endio(bio) DONE\n");
 		}
 	}
+	srcu_read_unlock(&dms_legs_srcu, idx);
 }
 
 /*-----------------------------------------------------------------
@@ -953,17 +4586,10 @@ static void do_read_failures(struct mirror_sync_set *ms, struct bio_list *read_f
  *---------------------------------------------------------------*/
 static void main_mirror_syncd(struct work_struct *work)
 {
-	struct mirror_sync_set *ms =  container_of(work, struct mirror_sync_set, kmirror_syncd_work);
-	struct bio_list read_failures;
-	unsigned long flags;
+	struct dms_retry_cpu *rq = container_of(work, struct dms_retry_cpu, work);
 
-	/* atomically get the currently pending list... and then reset the global list... */
-	spin_lock_irqsave(&ms->lock, flags);
-	read_failures = ms->read_failures;
-	bio_list_init(&ms->read_failures);
-	spin_unlock_irqrestore(&ms->lock, flags);
-
-	do_read_failures(ms, &read_failures);
+	/* take the whole queue of this CPU at once, oldest first... */
+	do_read_failures(rq->ms, llist_reverse_order(llist_del_all(&rq->list)));
 
 	/* No need to unplug here, do_read_failures() has already done it... */
 }
@@ -977,7 +4603,14 @@ static void mirror_sync_postsuspend(struct dm_target *ti)
 	DMSDEBUG_CALL("mirror_sync_postsuspend called...\n");
 	assert( atomic_read(&ms->suspend) == 1); // should already be suspended...
 
-	assert_bug( ms->reconfig_idx < curr_ms_instances );
+	assert_bug( !hlist_unhashed(&ms->reg_node) );
+
+	if ( atomic_read(&ms->requeued) )
+		DMINFO("[%s] noflush suspend: %d I/Os requeued to dm core", ms->name, atomic_read(&ms->requeued));
+
+	/* no I/O comes in anymore, let the async legs catch up... */
+	dms_behind_drain(ms);
+	dms_journal_drain(ms);
 }
 
 
@@ -989,10 +4622,19 @@ static void mirror_sync_resume(struct dm_target *ti)
 	assert( atomic_read(&ms->suspend) == 1);
 	 */
 
-	assert_bug( ms->reconfig_idx < curr_ms_instances );
+	assert_bug( !hlist_unhashed(&ms->reg_node) );
+
+	/* a reloaded table takes over the state of the legs of the previous one */
+	dms_carry_legs(ms);
 
 	atomic_set(&ms->suspend, 0); /* lower suspend flag... */
 
+	dms_start_probe(ms);
+
+	/* replay the journal entries left by the previous table... */
+	if (ms->jr_leg && READ_ONCE(ms->jr_nr))
+		queue_work(dms_jr_wq, &ms->jr_work);
+
 	DMSDEBUG_CALL("mirror_sync_resume called...\n");
 }
 
@@ -1059,7 +4701,7 @@ alloc_check_io_buffers(struct mirror_sync_set *ms, mirror_check_t *mc, int bsize
 	/* Allocate page buffers for reading data from live mirrors */
 	for (j = 0, m = ms->mirror; j < ms->nr_mirrors; j++, m++) {
 
-		if ( mirror_is_alive(m) ) {
+		if ( mirror_is_readable(m) ) {
 
 			mc[j].live = 1;
 			mc[j].nr_pages = bsize / PAGE_SIZE;
@@ -1143,20 +4785,14 @@ int
 compare_check_all_io_buffers(struct mirror_sync_set *ms, mirror_check_t *mc)
 {
 	unsigned int i, j, nr_live = 0;
-	mirror_check_t livemc[ms->nr_mirrors];
-
-	memset( (char *)livemc, 0, ms->nr_mirrors * sizeof(mirror_check_t) );
+	mirror_check_t *livemc[MAX_MIRRORS];
 
 	/* Get only live mirrors */
 	for (j = 0; j < ms->nr_mirrors; j++) {
 
-		if ( mirror_is_alive(mc[j].m) && mc[j].live && mc[j].pagebufs ) {
+		if ( mirror_is_readable(mc[j].m) && mc[j].live && mc[j].pagebufs ) {
 
-			livemc[nr_live].live = 1;
-			livemc[nr_live].m = mc[j].m;
-			livemc[nr_live].nr_pages = mc[j].nr_pages;
-			livemc[nr_live].pagebufs = mc[j].pagebufs;
-			nr_live++;
+			livemc[nr_live++] = mc + j;
 		}
 	}
 
@@ -1169,12 +4805,12 @@ compare_check_all_io_buffers(struct mirror_sync_set *ms, mirror_check_t *mc)
 	/* Compare page buffers filled with data from live mirrors */
 	for (j = 0; j < nr_live-1; j++) {
 
-		assert_bug( livemc[j].nr_pages == livemc[j+1].nr_pages );
+		assert_bug( livemc[j]->nr_pages == livemc[j+1]->nr_pages );
 
-		for (i = 0; i < livemc[j].nr_pages; i++) {
+		for (i = 0; i < livemc[j]->nr_pages; i++) {
 
-			char *pg1 = page_address(livemc[j].pagebufs[i]);
-			char *pg2 = page_address(livemc[j+1].pagebufs[i]);
+			char *pg1 = page_address(livemc[j]->pagebufs[i]);
+			char *pg2 = page_address(livemc[j+1]->pagebufs[i]);
 
 			//DMSDEBUG_CALL("Comparing page bufs: %d, pg1: %p pg2: %p !\n", i, pg1, pg2);
 
@@ -1182,8 +4818,8 @@ compare_check_all_io_buffers(struct mirror_sync_set *ms, mirror_check_t *mc)
 				char b1[BDEVNAME_SIZE],b2[BDEVNAME_SIZE];
 
 				DMERR("[%s] Different page buffer %d between mirrors %s (%s) and %s (%s) !",
-						ms->name, i, livemc[j].m->dev->name, bdevname(livemc[j].m->dev->bdev, b1),
-						livemc[j+1].m->dev->name, bdevname(livemc[j+1].m->dev->bdev, b2));
+						ms->name, i, livemc[j]->m->dev->name, bdevname(livemc[j]->m->dev->bdev, b1),
+						livemc[j+1]->m->dev->name, bdevname(livemc[j+1]->m->dev->bdev, b2));
 				return 0;
 			}
 		}
@@ -1203,7 +4839,7 @@ check_all_mirror_data( struct mirror_sync_set *ms, unsigned long long maxlen,
 	unsigned int i, nr_live = 0, bsize_secs;
 	struct mirror *m;
 	unsigned long long baddr_bytes, baddr_secs;
-	mirror_check_t mc[ms->nr_mirrors];
+	mirror_check_t *mc;
 #ifdef DEBUGMSG
 	char b[BDEVNAME_SIZE];
 #endif
@@ -1233,8 +4869,13 @@ check_all_mirror_data( struct mirror_sync_set *ms, unsigned long long maxlen,
 	}
 
 	/* Allocate page buffers for reading data from live mirrors */
-	if ( !alloc_check_io_buffers(ms, mc, bsize) )
+	mc = kcalloc(ms->nr_mirrors, sizeof(*mc), GFP_KERNEL);
+	if ( !mc )
+		return 0;
+	if ( !alloc_check_io_buffers(ms, mc, bsize) ) {
+		kfree(mc);
 		return 0;
+	}
 
 	// FIXME: scanning just first 131072 sectors for now...
 	maxlen = maxlen > 131072 ? 131072 : maxlen;
@@ -1245,7 +4886,7 @@ check_all_mirror_data( struct mirror_sync_set *ms, unsigned long long maxlen,
 
 		for (i = 0, m = ms->mirror; i < ms->nr_mirrors; i++, m++) {
 
-			if ( mirror_is_alive(m) && mc[i].live ) {
+			if ( mirror_is_readable(m) && mc[i].live ) {
 
 				DMSDEBUG_CALL("Reading block %lld from mirror device %s (%s)!\n",
 					baddr_secs, m->dev->name, bdevname(m->dev->bdev, b));
@@ -1282,13 +4923,17 @@ check_all_mirror_data( struct mirror_sync_set *ms, unsigned long long maxlen,
 			schedule();
 	}
 
-	if ( !free_check_io_buffers(ms, mc) )
+	if ( !free_check_io_buffers(ms, mc) ) {
+		kfree(mc);
 		return 0;
+	}
 
+	kfree(mc);
 	return 1; /*OK*/
 
 check_data_error:
 	free_check_io_buffers(ms, mc);
+	kfree(mc);
 	return 0;
 }
 
@@ -1303,7 +4948,7 @@ check_mirror_data_block( struct mirror_sync_set *ms, unsigned long long maxlen,
 	unsigned int i, nr_live = 0, bsize_secs;
 	struct mirror *m;
 	unsigned long long baddr_bytes = baddr_secs * 512;
-	mirror_check_t mc[ms->nr_mirrors];
+	mirror_check_t *mc;
 #ifdef DEBUGMSG
 	char b[BDEVNAME_SIZE];
 #endif
@@ -1342,12 +4987,17 @@ check_mirror_data_block( struct mirror_sync_set *ms, unsigned long long maxlen,
 	}
 
 	/* Allocate page buffers for reading data from live mirrors */
-	if ( !alloc_check_io_buffers(ms, mc, bsize) )
+	mc = kcalloc(ms->nr_mirrors, sizeof(*mc), GFP_KERNEL);
+	if ( !mc )
 		return 0;
+	if ( !alloc_check_io_buffers(ms, mc, bsize) ) {
+		kfree(mc);
+		return 0;
+	}
 		
 	for (i = 0, m = ms->mirror; i < ms->nr_mirrors; i++, m++) {
 
-		if ( mirror_is_alive(m) && mc[i].live ) {
+		if ( mirror_is_readable(m) && mc[i].live ) {
 
 			DMSDEBUG_CALL("Reading block at sec: %lld from mirror dev %s (%s)!\n",
 							baddr_secs, m->dev->name, bdevname(m->dev->bdev, b));
@@ -1374,19 +5024,156 @@ check_mirror_data_block( struct mirror_sync_set *ms, unsigned long long maxlen,
 		goto check_data_error;
 	}
 
-	if ( !free_check_io_buffers(ms, mc) )
+	if ( !free_check_io_buffers(ms, mc) ) {
+		kfree(mc);
 		return 0;
+	}
 
+	kfree(mc);
 	return 1; /*OK*/
 
 check_data_error:
 	free_check_io_buffers(ms, mc);
+	kfree(mc);
 	return 0;
 }
 #endif
 
 /*----------------------------------------------------------------- */
 
+/*-----------------------------------------------------------------
+ *  Leg maintenance by message, while the I/O goes on (no table reload):
+ *  a leg is taken out of the set (detach_leg) as if it failed, but it is
+ *  not probed, and put back (attach_leg/rebuild_leg) on its device,
+ *  catching up the regions it missed or all of them. Replacing its device
+ *  takes a table reload (the table line has only the attached legs).
+ *---------------------------------------------------------------*/
+
+static int dms_leg_detach(struct mirror_sync_set *ms, struct mirror *m)
+{
+	struct dms_leg_set *legs;
+	struct mirror *other;
+	int r = -EINVAL;
+
+	mutex_lock(&ms->legs_lock);
+	legs = rcu_dereference_protected(ms->legs, lockdep_is_held(&ms->legs_lock));
+
+	if ( dms_leg_detached(m) ) {
+		DMERR("[%s] Leg %u is already detached", ms->name, (unsigned int) (m - ms->mirror));
+		goto out;
+	}
+	if ( m == ms->jr_leg ) {
+		DMERR("[%s] Leg %u has the write journal, cannot detach it", ms->name, (unsigned int) (m - ms->mirror));
+		goto out;
+	}
+	for (other = ms->mirror; other < ms->mirror + ms->nr_mirrors; other++)
+		if ( other != m && mirror_is_readable(other) )
+			break;
+	if ( other == ms->mirror + ms->nr_mirrors ) {
+		DMERR("[%s] Leg %u is the last readable one, cannot detach it", ms->name, (unsigned int) (m - ms->mirror));
+		goto out;
+	}
+
+	/* the resync may be copying to or from it */
+	dms_stop_probe(ms);
+
+	/* no new I/O for it from now on, the writes it misses go to its stale_map */
+	set_bit(DMS_LEG_DETACHED, &m->error_type);
+	fail_mirror(m, DM_RAID1_WRITE_ERROR);
+
+	r = dms_legs_publish(ms, legs->attached & ~(1UL << (m - ms->mirror)));
+	if (r)
+		clear_bit(DMS_LEG_DETACHED, &m->error_type); /* just failed, the prober takes it */
+	else
+		wait_event(ms->cap_wait, !atomic_read(&m->inflight_ios));
+
+	if ( !atomic_read(&ms->suspend) )
+		dms_start_probe(ms);
+out:
+	mutex_unlock(&ms->legs_lock);
+	return r;
+}
+
+/* Attach a detached leg again, on the device at path ("-" for its own): it
+ * catches up the regions it missed, or all of them if full */
+static int dms_leg_attach(struct mirror *m, const char *path, int full)
+{
+	struct mirror_sync_set *ms = m->ms;
+	struct dms_leg_set *legs;
+	int r = -EINVAL;
+
+	mutex_lock(&ms->legs_lock);
+	legs = rcu_dereference_protected(ms->legs, lockdep_is_held(&ms->legs_lock));
+
+	if ( !dms_leg_detached(m) ) {
+		DMERR("[%s] Leg %u is not detached", ms->name, (unsigned int) (m - ms->mirror));
+		goto out;
+	}
+
+	/* CAUTION: only its own device, another one needs a table reload: the devices
+	 * of a live table can't change (dm core walks them), nor its queue limits */
+	if ( strcmp(path, "-") && dm_get_dev_t(path) != m->dev->bdev->bd_dev ) {
+		DMERR("[%s] Device %s is not the device of leg %u, reload the table to replace it",
+				ms->name, path, (unsigned int) (m - ms->mirror));
+		goto out;
+	}
+
+	if (full)
+		bitmap_fill(m->stale_map, ms->nr_regions);
+
+	r = dms_legs_publish(ms, legs->attached | (1UL << (m - ms->mirror)));
+	if (r)
+		goto out;
+
+	/* back as a reinstated leg: it gets the writes, the resync catches it up */
+	dms_stop_probe(ms);
+	clear_bit(DMS_LEG_DETACHED, &m->error_type);
+	reinstate_mirror(m);
+	if ( !atomic_read(&ms->suspend) )
+		dms_start_probe(ms);
+out:
+	mutex_unlock(&ms->legs_lock);
+	return r;
+}
+
+/* Move a detached leg to another offset on its device (attach it afterwards):
+ * the data there isn't the leg's, it catches up all regions then */
+static int dms_leg_set_offset(struct mirror *m, sector_t offset)
+{
+	struct mirror_sync_set *ms = m->ms;
+	struct queue_limits *l = &bdev_get_queue(m->dev->bdev)->limits;
+	sector_t shift;
+	int r = -EINVAL;
+
+	mutex_lock(&ms->legs_lock);
+	if ( !dms_leg_detached(m) )
+		DMERR("[%s] Leg %u is not detached", ms->name, (unsigned int) (m - ms->mirror));
+	else if ( offset + ms->ti->len > i_size_read(m->dev->bdev->bd_inode) >> SECTOR_SHIFT )
+		DMERR("[%s] Offset %llu of leg %u is beyond its device", ms->name,
+				(unsigned long long) offset, (unsigned int) (m - ms->mirror));
+	else {
+		if (offset != m->offset) {
+			bitmap_fill(m->stale_map, ms->nr_regions);
+
+			/* CAUTION: the discard alignment of the table is from the offsets at
+			 * load time (see mirror_sync_io_hints()), and can't change live */
+			shift = (offset > m->offset ? offset - m->offset : m->offset - offset) << SECTOR_SHIFT;
+			if ( m->discards && l->discard_granularity && sector_div(shift, l->discard_granularity) ) {
+				DMWARN("[%s] Offset %llu of leg %u is off the discard alignment, no discards to it until the table is reloaded",
+						ms->name, (unsigned long long) offset, (unsigned int) (m - ms->mirror));
+				WRITE_ONCE(m->discards, 0);
+			}
+		}
+		m->offset = offset;
+		r = 0;
+	}
+	mutex_unlock(&ms->legs_lock);
+
+	return r;
+}
+
+/*----------------------------------------------------------------- */
+
 /* Set read policy & parameters via the message interface. */
 static int mirror_sync_message(struct dm_target *ti, unsigned argc, char **argv)
 {
@@ -1406,10 +5193,28 @@ static int mirror_sync_message(struct dm_target *ti, unsigned argc, char **argv)
 	 *    1. set_weight <dev number in array> <weight for device>
 	 *    2. check_data_mirror_all <data unit> <block size (bytes)>
 	 *    3. check_data_mirror_block <block address (sectors)> <block size (bytes)>
+	 *    4. set_probe <probe interval (msecs), 0 == off> <good probes to reinstate a leg>
+	 *    5. set_resync_rate <max copy rate (KiB/s), 0 == unlimited> 0
+	 *    6. set_async <dev number in array> <1 == write-behind, 0 == synchronous>
+	 *    7. set_async_limits <max outstanding KiB per async leg> <max lag (msecs)>
+	 *    8. set_async_flush <local|all> 0
+	 *    9. set_write_quorum <legs to ack a write, 0 == all> 0
+	 *   10. set_zero_detect <dev number in array> <1 == zero writes as WRITE_SAME, 0 == off>
+	 *   11. set_max_io_len <max bio size (sectors), 0 == no split> 0
+	 *   12. set_leg_caps <max in-flight KiB per leg> <max in-flight I/Os per leg> (0 == no cap)
+	 *   13. set_qos_read <max IOPS> <max KiB/s> (0 == no limit)
+	 *   14. set_qos_write <max IOPS> <max KiB/s> (0 == no limit)
+	 *   15. set_qos_cost <bio|legs> 0
+	 *   16. set_share_weight <fair share weight on shared disks, 1 - 1000> 0
+	 *   17. detach_leg <dev number in array> 0
+	 *   18. attach_leg <dev number in array> <"-" or its own device> (catches up what it missed)
+	 *   19. rebuild_leg <dev number in array> <"-" or its own device> (copies all regions)
+	 *   20. set_leg_offset <dev number in array> <offset (sectors), detached legs only>
+	 *   21. set_numa_reads <1 == legs on the node of the submitting CPU first, 0 == off> <busy margin (%)>
 	 *
-	 * Valid <policy_name> values: round_robin, logical_part, weighted
+	 * Valid <policy_name> values: round_robin, logical_part, weighted, least_load
 	 *
-	 * Valid policy_param_name values: ios, io_chunk,
+	 * Valid policy_param_name values: ios, io_chunk, dev_weight, hyst
 	 */
 	if (argc != 4 || 
 	    ( strncmp(argv[0], "io_balance", strlen(argv[0])) &&
@@ -1454,18 +5259,18 @@ static int mirror_sync_message(struct dm_target *ti, unsigned argc, char **argv)
 			DMINFO("[%s] Setting weight of device %d in \"%s\" to %u",
 					ms->name, devno, dm_device_name(md), value);
 
-			atomic_set( &ms->mirror_weights[devno], value );
+			atomic_set( &ms->mirror[devno].weight, value );
 
 			/* check if we must re-evaluate the maximum... */
 			mirr = ms->mirror + devno;
 			maxi = atomic_read(&ms->mirror_weight_max_live);
 			assert_bug( maxi >= 0 && maxi < MAX_MIRRORS && maxi < ms->nr_mirrors );
-			max = atomic_read( &ms->mirror_weights[ maxi ] );
+			max = atomic_read( &ms->mirror[maxi].weight );
 
 			for (i = 0; i < ms->nr_mirrors; i++) {
 
 				mirr = ms->mirror + i;
-				value = atomic_read( &ms->mirror_weights[i] );
+				value = atomic_read( &ms->mirror[i].weight );
 
 				if ( mirror_is_alive(mirr) && value > max ) { /* alive? */
 					maxi = i;
@@ -1475,6 +5280,330 @@ static int mirror_sync_message(struct dm_target *ti, unsigned argc, char **argv)
 			assert_bug( maxi >= 0 && maxi < MAX_MIRRORS && maxi < ms->nr_mirrors );
 			atomic_set(&ms->mirror_weight_max_live, maxi );
 
+			/* -------------------------------------------------------- */
+		} else if ( !strncmp(argv[1], "set_probe", strlen(argv[1])) ) {
+			/* ---------------------------------------------------- */
+			unsigned threshold;
+
+			DMSDEBUG("HANDLE io_cmd set_probe message...\n");
+
+			if (sscanf(argv[2], "%u%c", &value, &dummy) != 1 || (value && value < 100) ||
+						value > 3600*1000) {
+				DMERR("[%s] Invalid probe interval: must be 0 (off) or 100 - 3600000 msecs", ms->name);
+				return -EINVAL;
+			}
+			if (sscanf(argv[3], "%u%c", &threshold, &dummy) != 1 || threshold < 1 || threshold > 1000 ) {
+				DMERR("[%s] Invalid probe threshold: must be between 1 - 1000", ms->name);
+				return -EINVAL;
+			}
+
+			md = dm_table_get_md(ti->table);
+			DMINFO("[%s] Setting health probe of \"%s\" to interval %u msecs, threshold %u",
+					ms->name, dm_device_name(md), value, threshold);
+
+			atomic_set( &ms->probe_threshold, threshold );
+			atomic_set( &ms->probe_interval, value );
+			if ( !atomic_read(&ms->resync_stop) ) {
+				if (value)
+					mod_delayed_work(system_long_wq, &ms->probe_work, msecs_to_jiffies(value));
+				else
+					cancel_delayed_work(&ms->probe_work);
+			}
+
+			/* -------------------------------------------------------- */
+		} else if ( !strncmp(argv[1], "set_resync_rate", strlen(argv[1])) ) {
+			/* ---------------------------------------------------- */
+			DMSDEBUG("HANDLE io_cmd set_resync_rate message...\n");
+
+			if (sscanf(argv[2], "%u%c", &value, &dummy) != 1 || value > 16*1024*1024) {
+				DMERR("[%s] Invalid resync rate: must be 0 (unlimited) up to 16GiB/s (in KiB/s)", ms->name);
+				return -EINVAL;
+			}
+
+			md = dm_table_get_md(ti->table);
+			DMINFO("[%s] Setting resync rate of \"%s\" to %u KiB/s", ms->name, dm_device_name(md), value);
+			atomic_set( &ms->resync_rate, value );
+
+			/* -------------------------------------------------------- */
+		} else if ( !strcmp(argv[1], "set_async") ) {
+			/* ---------------------------------------------------- */
+			/* NOTE: exact match, it's a prefix of the set_async_* commands */
+			unsigned devno;
+
+			DMSDEBUG("HANDLE io_cmd set_async message...\n");
+
+			if (sscanf(argv[2], "%u%c", &devno, &dummy) != 1 || devno >= ms->nr_mirrors) {
+				DMERR("[%s] Invalid device number (arg 3): has to between 0 - %d",
+						ms->name, ms->nr_mirrors - 1 );
+				return -EINVAL;
+			}
+			if (sscanf(argv[3], "%u%c", &value, &dummy) != 1 || value > 1) {
+				DMERR("[%s] Invalid async flag: must be 0 (synchronous) or 1 (write-behind)", ms->name);
+				return -EINVAL;
+			}
+			if (value && ms->mirror + devno == ms->jr_leg) {
+				DMERR("[%s] Device %d is journaled, cannot be async", ms->name, devno);
+				return -EINVAL;
+			}
+
+			md = dm_table_get_md(ti->table);
+			DMINFO("[%s] Setting device %d in \"%s\" to %s", ms->name, devno, dm_device_name(md),
+					value ? "write-behind (async)" : "synchronous");
+			/* NOTE: writes already in flight behind are waited for by the next overlapping ones */
+			WRITE_ONCE(ms->mirror[devno].async, value);
+
+			/* -------------------------------------------------------- */
+		} else if ( !strncmp(argv[1], "set_async_limits", strlen(argv[1])) ) {
+			/* ---------------------------------------------------- */
+			unsigned lag;
+
+			DMSDEBUG("HANDLE io_cmd set_async_limits message...\n");
+
+			if (sscanf(argv[2], "%u%c", &value, &dummy) != 1 || value < 64 || value > 4*1024*1024) {
+				DMERR("[%s] Invalid async leg outstanding limit: must be between 64KiB - 4GiB (in KiB)", ms->name);
+				return -EINVAL;
+			}
+			if (sscanf(argv[3], "%u%c", &lag, &dummy) != 1 || lag < 10 || lag > 3600*1000) {
+				DMERR("[%s] Invalid async leg max lag: must be between 10 - 3600000 msecs", ms->name);
+				return -EINVAL;
+			}
+
+			md = dm_table_get_md(ti->table);
+			DMINFO("[%s] Setting async leg limits of \"%s\" to %u KiB outstanding, %u msecs lag",
+					ms->name, dm_device_name(md), value, lag);
+			atomic_set( &ms->behind_max_kb, value );
+			atomic_set( &ms->behind_max_lag, lag );
+			dms_defer_kick(ms);
+
+			/* -------------------------------------------------------- */
+		} else if ( !strncmp(argv[1], "set_async_flush", strlen(argv[1])) ) {
+			/* ---------------------------------------------------- */
+			DMSDEBUG("HANDLE io_cmd set_async_flush message...\n");
+
+			if ( !strcmp(argv[2], "local") )
+				value = DMS_BEHIND_FLUSH_LOCAL;
+			else if ( !strcmp(argv[2], "all") )
+				value = DMS_BEHIND_FLUSH_ALL;
+			else {
+				DMERR("[%s] Invalid async flush level: must be \"local\" or \"all\"", ms->name);
+				return -EINVAL;
+			}
+
+			md = dm_table_get_md(ti->table);
+			DMINFO("[%s] Setting async flush level of \"%s\" to %s", ms->name, dm_device_name(md), argv[2]);
+			atomic_set( &ms->behind_flush, value );
+
+			/* -------------------------------------------------------- */
+		} else if ( !strncmp(argv[1], "set_write_quorum", strlen(argv[1])) ) {
+			/* ---------------------------------------------------- */
+			DMSDEBUG("HANDLE io_cmd set_write_quorum message...\n");
+
+			if (sscanf(argv[2], "%u%c", &value, &dummy) != 1 ||
+				(value && (ms->nr_mirrors < 3 || value >= ms->nr_mirrors)) ) {
+				DMERR("[%s] Invalid write quorum: must be 0 (all legs) or 1 - %d, with 3 or more legs",
+						ms->name, ms->nr_mirrors - 1);
+				return -EINVAL;
+			}
+
+			md = dm_table_get_md(ti->table);
+			DMINFO("[%s] Setting write quorum of \"%s\" to %u of %d legs", ms->name,
+					dm_device_name(md), value ? value : ms->nr_mirrors, ms->nr_mirrors);
+			atomic_set( &ms->write_quorum, value );
+
+			/* -------------------------------------------------------- */
+		} else if ( !strncmp(argv[1], "set_zero_detect", strlen(argv[1])) ) {
+			/* ---------------------------------------------------- */
+			unsigned devno;
+
+			DMSDEBUG("HANDLE io_cmd set_zero_detect message...\n");
+
+			if (sscanf(argv[2], "%u%c", &devno, &dummy) != 1 || devno >= ms->nr_mirrors) {
+				DMERR("[%s] Invalid device number (arg 3): has to between 0 - %d",
+						ms->name, ms->nr_mirrors - 1 );
+				return -EINVAL;
+			}
+			if (sscanf(argv[3], "%u%c", &value, &dummy) != 1 || value > 1) {
+				DMERR("[%s] Invalid zero detection flag: must be 0 (off) or 1 (on)", ms->name);
+				return -EINVAL;
+			}
+
+			md = dm_table_get_md(ti->table);
+			DMINFO("[%s] Setting zero detection for device %d in \"%s\" %s", ms->name, devno,
+					dm_device_name(md), value ? "on" : "off");
+			dms_set_zero_detect(ms->mirror + devno, value);
+
+			/* -------------------------------------------------------- */
+		} else if ( !strncmp(argv[1], "set_max_io_len", strlen(argv[1])) ) {
+			/* ---------------------------------------------------- */
+			DMSDEBUG("HANDLE io_cmd set_max_io_len message...\n");
+
+			if (sscanf(argv[2], "%u%c", &value, &dummy) != 1 ||
+				(value && value < DMS_MIN_MAX_IO_LEN) ) {
+				DMERR("[%s] Invalid max I/O length: must be 0 (no split) or >= %d sectors",
+						ms->name, DMS_MIN_MAX_IO_LEN);
+				return -EINVAL;
+			}
+
+			md = dm_table_get_md(ti->table);
+			DMINFO("[%s] Setting max I/O length of \"%s\" to %u sectors%s", ms->name,
+					dm_device_name(md), value, value ? "" : " (no split)");
+			/* NOTE: dm reads it for each new bio, the ones in flight are already split */
+			atomic_set( &ms->max_io_len, value );
+			WRITE_ONCE(ti->max_io_len, value);
+
+			/* -------------------------------------------------------- */
+		} else if ( !strncmp(argv[1], "set_leg_caps", strlen(argv[1])) ) {
+			/* ---------------------------------------------------- */
+			unsigned ios;
+
+			DMSDEBUG("HANDLE io_cmd set_leg_caps message...\n");
+
+			if (sscanf(argv[2], "%u%c", &value, &dummy) != 1 || (value && value < 64) ||
+				value > (1 << 22)) {
+				DMERR("[%s] Invalid in-flight KiB cap: must be 0 (no cap) or 64 - %d",
+						ms->name, 1 << 22);
+				return -EINVAL;
+			}
+			if (sscanf(argv[3], "%u%c", &ios, &dummy) != 1 || ios > 65536) {
+				DMERR("[%s] Invalid in-flight I/O cap: must be 0 (no cap) - 65536", ms->name);
+				return -EINVAL;
+			}
+
+			md = dm_table_get_md(ti->table);
+			DMINFO("[%s] Setting in-flight caps per leg of \"%s\" to %u KiB / %u I/Os", ms->name,
+					dm_device_name(md), value, ios);
+			atomic_set( &ms->cap_kb, value );
+			atomic_set( &ms->cap_ios, ios );
+			wake_up_all(&ms->cap_wait);
+			dms_defer_kick(ms);
+
+			/* -------------------------------------------------------- */
+		} else if ( !strncmp(argv[1], "set_qos_read", strlen(argv[1])) ||
+					!strncmp(argv[1], "set_qos_write", strlen(argv[1])) ) {
+			/* ---------------------------------------------------- */
+			int rw = !strncmp(argv[1], "set_qos_read", strlen(argv[1])) ? READ : WRITE;
+			struct dms_qos *q = ms->qos + rw;
+			unsigned kbps;
+			unsigned long flags;
+
+			DMSDEBUG("HANDLE io_cmd set_qos_read/write message...\n");
+
+			if (sscanf(argv[2], "%u%c", &value, &dummy) != 1 || value > DMS_QOS_MAX_IOPS) {
+				DMERR("[%s] Invalid QoS IOPS limit: must be 0 (no limit) - %d",
+						ms->name, DMS_QOS_MAX_IOPS);
+				return -EINVAL;
+			}
+			if (sscanf(argv[3], "%u%c", &kbps, &dummy) != 1 || kbps > DMS_QOS_MAX_KBPS) {
+				DMERR("[%s] Invalid QoS KiB/s limit: must be 0 (no limit) - %d",
+						ms->name, DMS_QOS_MAX_KBPS);
+				return -EINVAL;
+			}
+
+			md = dm_table_get_md(ti->table);
+			DMINFO("[%s] Setting %s QoS limits of \"%s\" to %u IOPS / %u KiB/s", ms->name,
+					rw == READ ? "read" : "write", dm_device_name(md), value, kbps);
+
+			/* new limits start with a full burst; the deferred bios are rechecked */
+			spin_lock_irqsave(&ms->qos_lock, flags);
+			q->iops.rate = value;
+			q->iops.tat = 0;
+			q->bw.rate = (u64) kbps << 10;
+			q->bw.tat = 0;
+			spin_unlock_irqrestore(&ms->qos_lock, flags);
+			mod_delayed_work(dms_wq, &ms->qos_work, 0);
+
+			/* -------------------------------------------------------- */
+		} else if ( !strncmp(argv[1], "set_qos_cost", strlen(argv[1])) ) {
+			/* ---------------------------------------------------- */
+
+			DMSDEBUG("HANDLE io_cmd set_qos_cost message...\n");
+
+			if ( !strcmp(argv[2], "bio") )
+				value = 0;
+			else if ( !strcmp(argv[2], "legs") )
+				value = 1;
+			else {
+				DMERR("[%s] Invalid QoS cost: must be \"bio\" or \"legs\"", ms->name);
+				return -EINVAL;
+			}
+
+			md = dm_table_get_md(ti->table);
+			DMINFO("[%s] Setting QoS cost of \"%s\" writes to %s", ms->name,
+					dm_device_name(md), value ? "one per live leg" : "one per bio");
+			WRITE_ONCE(ms->qos_leg_cost, value);
+
+			/* -------------------------------------------------------- */
+		} else if ( !strncmp(argv[1], "set_share_weight", strlen(argv[1])) ) {
+			/* ---------------------------------------------------- */
+
+			DMSDEBUG("HANDLE io_cmd set_share_weight message...\n");
+
+			if (sscanf(argv[2], "%u%c", &value, &dummy) != 1 || value < 1 ||
+				value > DMS_MAX_SHARE_WEIGHT) {
+				DMERR("[%s] Invalid fair share weight: must be 1 - %d", ms->name,
+						DMS_MAX_SHARE_WEIGHT);
+				return -EINVAL;
+			}
+
+			md = dm_table_get_md(ti->table);
+			DMINFO("[%s] Setting fair share weight of \"%s\" to %u", ms->name,
+					dm_device_name(md), value);
+			atomic_set( &ms->share_weight, value );
+
+			/* -------------------------------------------------------- */
+		} else if ( !strncmp(argv[1], "set_numa_reads", strlen(argv[1])) ) {
+			/* ---------------------------------------------------- */
+			unsigned margin;
+
+			DMSDEBUG("HANDLE io_cmd set_numa_reads message...\n");
+
+			if (sscanf(argv[2], "%u%c", &value, &dummy) != 1 || value > 1) {
+				DMERR("[%s] Invalid NUMA reads flag: must be 0 or 1", ms->name);
+				return -EINVAL;
+			}
+			if (sscanf(argv[3], "%u%c", &margin, &dummy) != 1 || margin > 1000) {
+				DMERR("[%s] Invalid NUMA reads margin: must be 0 - 1000 (%%)", ms->name);
+				return -EINVAL;
+			}
+
+			md = dm_table_get_md(ti->table);
+			DMINFO("[%s] Setting NUMA local reads of \"%s\" %s (margin %u%%)", ms->name,
+					dm_device_name(md), value ? "on" : "off", margin);
+			atomic_set( &ms->numa_margin, margin );
+			atomic_set( &ms->numa_reads, value );
+
+			/* -------------------------------------------------------- */
+		} else if ( !strncmp(argv[1], "detach_leg", strlen(argv[1])) ||
+					!strncmp(argv[1], "attach_leg", strlen(argv[1])) ||
+					!strncmp(argv[1], "rebuild_leg", strlen(argv[1])) ||
+					!strncmp(argv[1], "set_leg_offset", strlen(argv[1])) ) {
+			/* ---------------------------------------------------- */
+			int devno = -1;
+
+			DMSDEBUG("HANDLE io_cmd %s message...\n", argv[1]);
+
+			if (sscanf(argv[2], "%u%c", &devno, &dummy) != 1 || devno < 0 ||
+						devno >= ms->nr_mirrors) {
+				DMERR("[%s] Invalid device number (arg 3): has to between 0 - %d",
+						ms->name, ms->nr_mirrors - 1 );
+				return -EINVAL;
+			}
+
+			md = dm_table_get_md(ti->table);
+			DMINFO("[%s] Leg %d of \"%s\": %s %s", ms->name, devno, dm_device_name(md),
+					argv[1], argv[3]);
+
+			if ( argv[1][0] == 'd' )
+				return dms_leg_detach(ms, ms->mirror + devno);
+			if ( argv[1][0] == 'a' || argv[1][0] == 'r' )
+				return dms_leg_attach(ms->mirror + devno, argv[3], argv[1][0] == 'r');
+
+			if (sscanf(argv[3], "%llu%c", &llvalue, &dummy) != 1) {
+				DMERR("[%s] Invalid leg offset (sectors)", ms->name);
+				return -EINVAL;
+			}
+			return dms_leg_set_offset(ms->mirror + devno, llvalue);
+
 			/* -------------------------------------------------------- */
 #ifdef ENABLE_CHECK_MIRROR_CMDS
 		/* Data checking commands:
@@ -1650,7 +5779,7 @@ static int mirror_sync_message(struct dm_target *ti, unsigned argc, char **argv)
 			for (i = 0; i < ms->nr_mirrors; i++) {
 					
 				mirr = ms->mirror + i;
-				atomic_set( &ms->mirror_weights[i], value );
+				atomic_set( &ms->mirror[i].weight, value );
 
 				if ( mirror_is_alive(mirr) ) { /* alive? */
 					maxi = i;
@@ -1665,6 +5794,28 @@ static int mirror_sync_message(struct dm_target *ti, unsigned argc, char **argv)
 			atomic_set(&ms->mirror_weight_max_live, maxi );
 			atomic_set(&ms->rdpolicy, DMS_CUSTOM_WEIGHTED);
 			/* ---------------------------------------------------- */
+		} else if ( !strncmp(argv[1], "least_load", strlen(argv[1])) ) {
+			/* ---------------------------------------------------- */
+			DMSDEBUG("HANDLE io_balance least_load message...\n");
+
+			if ( strncmp(argv[2], "hyst", strlen(argv[2])) )
+				return -EINVAL;
+
+			if (sscanf(argv[3], "%u%c", &value, &dummy) != 1 || value > 1000 ) {
+				DMERR("[%s] Least load hysteresis has to be 0 - 1000 (%%)", ms->name);
+				return -EINVAL;
+			}
+
+			md = dm_table_get_md(ti->table);
+			DMINFO("[%s] Setting least load hysteresis for \"%s\" to %u%%",
+					ms->name, dm_device_name(md), value);
+			if ( atomic_read(&ms->rdpolicy) != DMS_LEAST_LOAD )
+				DMINFO("[%s] Switching read policy for \"%s\" to least load",
+					ms->name, dm_device_name(md) );
+
+			atomic_set(&ms->ll_hyst, value);
+			atomic_set(&ms->rdpolicy, DMS_LEAST_LOAD);
+			/* ---------------------------------------------------- */
 		} else {
 			/* ---------------------------------------------------- */
 			if ( strlen(argv[1]) < 30 )
@@ -1695,13 +5846,26 @@ static int mirror_sync_message(struct dm_target *ti, unsigned argc, char **argv)
  *    D => Dead - A write failure occurred leaving mirror out-of-sync
  *    S => Sync - A sychronization failure occurred, mirror out-of-sync
  *    R => Read - A read failure occurred, mirror data unaffected
+ *    C => Catching up - Reinstated, copying the regions it missed
+ *    W => Warming up - Caught up, gradually returning to read selection
+ *    X => Detached - Taken out of the set (io_cmd detach_leg)
  *
  * Returns: <char>
  */
 static char device_status_char(struct mirror *m)
 {
-	if ( mirror_is_alive(m) )
+	if ( mirror_is_alive(m) ) {
+		switch ( atomic_read(&m->state) ) {
+		case DMS_LEG_RECOVERING:
+			return 'C';
+		case DMS_LEG_WARMING:
+			return 'W';
+		}
 		return 'A';
+	}
+
+	if ( dms_leg_detached(m) )
+		return 'X';
 
 	/* FIXME: modify these states, according to out failure modes???
 	 *        -> also add recovery codes?? */
@@ -1714,44 +5878,45 @@ static char device_status_char(struct mirror *m)
 
 /*----------------------------------------------------------------- */
 
-static char *ms_info(struct mirror_sync_set *ms, char *info, int maxlen)
+/* Emits the read policy info (with the weights of all legs for the custom weighted one) */
+static unsigned int ms_info(struct mirror_sync_set *ms, char *result, unsigned int maxlen)
 {
-	/* output read policy info... */
-	memset( info, 0, maxlen );
+	unsigned int sz = 0;
+	int i;
+
 	switch( atomic_read( &ms->rdpolicy ) ) {
 	case DMS_LOGICAL_PARTITION:
-		sprintf(info,"LP,c=%dkb", (int)atomic_read(&ms->lp_io_chunk) );
+		DMEMIT("LP,c=%dkb", (int)atomic_read(&ms->lp_io_chunk) );
 	break;
 	case DMS_ROUND_ROBIN:
-		sprintf(info,"RR,ios=%d", atomic_read(&ms->rr_ios_set));
+		DMEMIT("RR,ios=%d", atomic_read(&ms->rr_ios_set));
+	break;
+	case DMS_LEAST_LOAD:
+		DMEMIT("LL,hyst=%d%%", atomic_read(&ms->ll_hyst));
 	break;
 	case DMS_CUSTOM_WEIGHTED:
-	{
-		int i, sz = 0;
-
-		sz = sprintf(info,"CW,wml=%d", atomic_read(&ms->mirror_weight_max_live) );
-
+		DMEMIT("CW,wml=%d", atomic_read(&ms->mirror_weight_max_live) );
 		for (i = 0; i < ms->nr_mirrors; i++)
-			sz += sprintf(info+sz,",w[%d]=%d", i, atomic_read( &ms->mirror_weights[i] ) );
-	}
+			DMEMIT(",w[%d]=%d", i, atomic_read( &ms->mirror[i].weight ) );
 	break;
 	}
-	return info;
+	return sz;
 }
 
 /*---------------------------------------------------------------------------------- */
 
 /* Emits status info about mirror_sync_set and all mirrors... */
 
-#define MAX_MIRR_STATUS_LEN	128
-
 void mirror_sync_emit_status(struct mirror_sync_set *ms,
 			 char *result, unsigned int maxlen)
 {
 	unsigned int m, sz = 0, ld = 0;
-	char buffer[MAX_MIRR_STATUS_LEN];
+	int idx = srcu_read_lock(&dms_legs_srcu); /* the leg devices may be replaced */
 
-	DMEMIT("%d %s ", ms->nr_mirrors, ms_info(ms,buffer,MAX_MIRR_STATUS_LEN) );
+	/* NOTE: DMEMIT() never writes past maxlen (the policy info grows with the legs) */
+	DMEMIT("%d ", ms->nr_mirrors);
+	sz += ms_info(ms, result + sz, maxlen - sz);
+	DMEMIT(" ");
 	for (m = 0; m < ms->nr_mirrors; m++) {
 		DMEMIT("%d,%s,%c ", m, ms->mirror[m].dev->name,
 							device_status_char(&(ms->mirror[m])) );
@@ -1762,6 +5927,161 @@ void mirror_sync_emit_status(struct mirror_sync_set *ms,
 	DMEMIT("\n==> Live_Devs: %d, IO_Count: TRD: %d ORD: %d TWR: %d OWR: %d", ld,
 		atomic_read( &ms->read_ios_total ), atomic_read( &ms->read_ios_pending ),
 		atomic_read( &ms->write_ios_total ), atomic_read( &ms->write_ios_pending) );
+
+	/* health prober & resync state: probe successes of failed legs,
+	 * stale regions of recovering legs, read share of warming legs */
+	DMEMIT("\n==> Probe: int=%dms thr=%d Resynced: %d Rate: %d/%dKiB/s",
+		atomic_read( &ms->probe_interval ), atomic_read( &ms->probe_threshold ),
+		atomic_read( &ms->resync_regions_done ), atomic_read( &ms->resync_kbps ),
+		atomic_read( &ms->resync_rate ) );
+	for (m = 0; m < ms->nr_mirrors; m++) {
+		struct mirror *mirr = ms->mirror + m;
+
+		if ( !mirror_is_alive(mirr) )
+			DMEMIT(" %d:probe=%d/%d", m, atomic_read( &mirr->probe_ok ),
+					atomic_read( &ms->probe_threshold ) );
+		else if ( atomic_read(&mirr->state) == DMS_LEG_RECOVERING ) {
+			unsigned long stale = bitmap_weight(mirr->stale_map, ms->nr_regions);
+
+			DMEMIT(" %d:stale=%lu/%lu(%lu%%)", m, stale, ms->nr_regions,
+					100 - (unsigned long) div64_u64( (u64) stale * 100, ms->nr_regions) );
+		}
+		else if ( atomic_read(&mirr->state) == DMS_LEG_WARMING )
+			DMEMIT(" %d:warm=%d/%d", m, atomic_read( &mirr->warm_level ), DMS_WARM_STEPS );
+	}
+
+	/* resync pacing: foreground latency vs. its baseline & the current pause between copy batches */
+	DMEMIT("\n==> Resync: lat=%lu/%luus delay=%ums pass=%s",
+		READ_ONCE( ms->fg_lat_us ), READ_ONCE( ms->fg_lat_base_us ),
+		READ_ONCE( ms->resync_delay_ms ), READ_ONCE( ms->resync_hot_pass ) ? "hot" : "all" );
+
+	/* least load policy: the shared load of the disks of the legs (all instances on them) */
+	if ( atomic_read(&ms->rdpolicy) == DMS_LEAST_LOAD ) {
+		DMEMIT("\n==> Load:");
+		for (m = 0; m < ms->nr_mirrors; m++) {
+			struct dms_disk *d = ms->mirror[m].disk;
+
+			DMEMIT(" %d:%u:%u=%d/%dKiB,lat=%luus,legs=%u", m, MAJOR(d->dev), MINOR(d->dev),
+				atomic_read( &d->inflight_ios ), atomic_read( &d->inflight_sectors ) / 2,
+				READ_ONCE( d->lat_us ), READ_ONCE( d->users ) );
+		}
+	}
+
+	/* fair share on shared disks: weight of the instance & I/Os waiting on each leg */
+	if ( READ_ONCE(dms_share_depth) ) {
+		DMEMIT("\n==> Share: weight=%d depth=%u", atomic_read( &ms->share_weight ),
+			READ_ONCE(dms_share_depth) );
+		for (m = 0; m < ms->nr_mirrors; m++)
+			DMEMIT(" %d:%s,queued=%u", m, dms_share_on(ms->mirror + m) ? "shared" : "own",
+				READ_ONCE( ms->mirror[m].share_queued ) );
+	}
+
+	/* K-of-N write quorum & the writes that completed ahead of their slowest legs */
+	if ( atomic_read(&ms->write_quorum) )
+		DMEMIT("\n==> Quorum: %d/%d Early: %d", atomic_read( &ms->write_quorum ),
+			ms->nr_mirrors, atomic_read( &ms->quorum_early ) );
+
+	/* flush rounds, flushes merged into them & leg flushes skipped */
+	if ( atomic_read(&ms->flush_rounds) )
+		DMEMIT("\n==> Flush: rounds=%d merged=%d elided=%d", atomic_read( &ms->flush_rounds ),
+			atomic_read( &ms->flush_merged ), atomic_read( &ms->flush_elided ) );
+
+	/* QoS limits (IOPS/KiB/s of reads & writes), bios deferred by them & still queued */
+	if ( dms_qos_on(ms->qos + READ) || dms_qos_on(ms->qos + WRITE) ||
+		 atomic_read(&ms->qos[READ].deferred) || atomic_read(&ms->qos[WRITE].deferred) ) {
+		DMEMIT("\n==> QoS: rd=%llu/%lluKiB/s wr=%llu/%lluKiB/s cost=%s",
+			ms->qos[READ].iops.rate, ms->qos[READ].bw.rate >> 10,
+			ms->qos[WRITE].iops.rate, ms->qos[WRITE].bw.rate >> 10,
+			ms->qos_leg_cost ? "legs" : "bio" );
+		DMEMIT(" deferred=%d/%d queued=%u/%u",
+			atomic_read( &ms->qos[READ].deferred ), atomic_read( &ms->qos[WRITE].deferred ),
+			READ_ONCE( ms->qos[READ].queued ), READ_ONCE( ms->qos[WRITE].queued ) );
+	}
+
+	/* in-flight caps per leg & I/O in flight on each leg */
+	if ( atomic_read(&ms->cap_kb) || atomic_read(&ms->cap_ios) ) {
+		DMEMIT("\n==> Caps: %dKiB/%d Waits: %d Queued: %u", atomic_read( &ms->cap_kb ),
+			atomic_read( &ms->cap_ios ), atomic_read( &ms->cap_waits ), READ_ONCE( ms->defer_queued ) );
+		for (m = 0; m < ms->nr_mirrors; m++)
+			DMEMIT(" %d:%dKiB/%d%s", m, atomic_read( &ms->mirror[m].inflight_sectors ) / 2,
+				atomic_read( &ms->mirror[m].inflight_ios ),
+				dms_leg_capped(ms->mirror + m) ? "*" : "" );
+	}
+
+	/* NUMA local reads: margin, reads moved to a local leg & the node of each leg */
+	if ( atomic_read(&ms->numa_reads) ) {
+		DMEMIT("\n==> Numa: margin=%d%% local=%d", atomic_read( &ms->numa_margin ),
+			atomic_read( &ms->numa_local ) );
+		for (m = 0; m < ms->nr_mirrors; m++)
+			DMEMIT(" %d:node%d", m, ms->mirror[m].nid);
+	}
+
+	/* zero detecting legs: data KiB & writes sent as zeroing ops instead */
+	if ( atomic_read(&ms->zero_legs) ) {
+		DMEMIT("\n==> Zero:");
+		for (m = 0; m < ms->nr_mirrors; m++)
+			if ( ms->mirror[m].zero_detect )
+				DMEMIT(" %d:%s elided=%dKiB/%d", m,
+					dms_leg_zero_op(ms->mirror + m) ? "on" : "unsupported",
+					atomic_read( &ms->mirror[m].zero_kb ), atomic_read( &ms->mirror[m].zero_ios ) );
+	}
+
+	/* WRITE_SAME/ZEROES ranges offloaded to legs, and written out on others */
+	if ( atomic_read(&ms->wsame_offloaded) || atomic_read(&ms->wsame_fallback) )
+		DMEMIT("\n==> WriteSame: offloaded=%d written=%d", atomic_read( &ms->wsame_offloaded ),
+			atomic_read( &ms->wsame_fallback ) );
+
+	/* write-behind legs: outstanding KiB/writes, age of the oldest one & regions they lag in */
+	for (m = 0; m < ms->nr_mirrors; m++)
+		if ( ms->mirror[m].async || atomic_read(&ms->mirror[m].behind_ios) )
+			break;
+	if (m < ms->nr_mirrors) {
+		DMEMIT("\n==> Async: max=%dKiB/%dms flush=%s",
+			atomic_read( &ms->behind_max_kb ), atomic_read( &ms->behind_max_lag ),
+			atomic_read( &ms->behind_flush ) == DMS_BEHIND_FLUSH_ALL ? "all" : "local" );
+		for (m = 0; m < ms->nr_mirrors; m++) {
+			struct mirror *mirr = ms->mirror + m;
+			unsigned long flags, lag = 0;
+
+			if ( !mirr->async && !atomic_read(&mirr->behind_ios) )
+				continue;
+
+			spin_lock_irqsave(&mirr->behind_lock, flags);
+			if ( !list_empty(&mirr->behind_list) )
+				lag = jiffies_to_msecs(jiffies -
+						list_first_entry(&mirr->behind_list, struct dms_behind_io, list)->issued);
+			spin_unlock_irqrestore(&mirr->behind_lock, flags);
+
+			DMEMIT(" %d:out=%dKiB/%d lag=%lums dirty=%d", m,
+					atomic_read( &mirr->behind_sectors ) / 2, atomic_read( &mirr->behind_ios ),
+					lag, bitmap_weight(mirr->behind_map, ms->nr_regions) );
+		}
+	}
+
+	/* write journal: fill, entries not replayed yet & age of the oldest one */
+	if (ms->jr_leg) {
+		struct dms_jentry *e = NULL;
+		unsigned long flags, lag = 0;
+		unsigned long long used;
+		unsigned int nr;
+
+		spin_lock_irqsave(&ms->jr_lock, flags);
+		if ( !list_empty(&ms->jr_entries) )
+			e = list_first_entry(&ms->jr_entries, struct dms_jentry, list);
+		else if ( !list_empty(&ms->jr_inflight) )
+			e = list_first_entry(&ms->jr_inflight, struct dms_jentry, list);
+		if (e)
+			lag = jiffies_to_msecs(jiffies - e->issued);
+		used = ms->jr_used;
+		nr = ms->jr_nr;
+		spin_unlock_irqrestore(&ms->jr_lock, flags);
+
+		DMEMIT("\n==> Journal: leg=%u fill=%lluKiB(%llu%%) entries=%u replay=%dKiB/s lag=%lums replayed=%d",
+			(unsigned int) (ms->jr_leg - ms->mirror), used / 2,
+			div64_u64(used * 100, ms->jr_ring_sectors), nr,
+			atomic_read( &ms->jr_kbps ), lag, atomic_read( &ms->jr_replayed ) );
+	}
+	srcu_read_unlock(&dms_legs_srcu, idx);
 }
 
 /*----------------------------------------------------------------- */
@@ -1771,8 +6091,10 @@ void mirror_sync_emit_status(struct mirror_sync_set *ms,
 static void mirror_sync_status(struct dm_target *ti, status_type_t type,
 			 unsigned status_flags, char *result, unsigned int maxlen)
 {
-	unsigned int m, sz = 0;
+	unsigned int m, sz = 0, nr_feat;
 	struct mirror_sync_set *ms = (struct mirror_sync_set *) ti->private;
+	struct dms_leg_set *legs;
+	int idx;
 
 	DMSDEBUG("mirror_sync_status called...\n");
 
@@ -1785,10 +6107,47 @@ static void mirror_sync_status(struct dm_target *ti, status_type_t type,
 
 	case STATUSTYPE_TABLE:
 		DMSDEBUG("mirror_sync_status STATUSTYPE_TABLE...\n");
-		DMEMIT("%d", ms->nr_mirrors);
-		for (m = 0; m < ms->nr_mirrors; m++)
-			DMEMIT(" %s %llu", ms->mirror[m].dev->name,
-				(unsigned long long)ms->mirror[m].offset);
+		/* only the attached legs: the leg indices below are their positions */
+		idx = srcu_read_lock(&dms_legs_srcu);
+		legs = srcu_dereference(ms->legs, &dms_legs_srcu);
+		DMEMIT("%u", legs->nr);
+		for (m = 0; m < legs->nr; m++)
+			DMEMIT(" %s %llu", legs->leg[m]->dev->name,
+				(unsigned long long)legs->leg[m]->offset);
+
+		/* legs still being populated must be rebuilt if the table is reloaded */
+		for (m = 0, nr_feat = 0; m < legs->nr; m++) {
+			if ( atomic_read(&legs->leg[m]->state) == DMS_LEG_RECOVERING )
+				nr_feat += 2;
+			if ( legs->leg[m]->async )
+				nr_feat += 2;
+			if ( legs->leg[m]->zero_detect )
+				nr_feat += 2;
+		}
+		if ( atomic_read(&ms->write_quorum) )
+			nr_feat += 2;
+		if (ms->jr_leg)
+			nr_feat += 3;
+		if ( atomic_read(&ms->max_io_len) != DMS_DEFAULT_MAX_IO_LEN )
+			nr_feat += 2;
+		if (nr_feat) {
+			DMEMIT(" %u", nr_feat);
+			for (m = 0; m < legs->nr; m++) {
+				if ( atomic_read(&legs->leg[m]->state) == DMS_LEG_RECOVERING )
+					DMEMIT(" rebuild %u", m);
+				if ( legs->leg[m]->async )
+					DMEMIT(" async %u", m);
+				if ( legs->leg[m]->zero_detect )
+					DMEMIT(" zero_detect %u", m);
+			}
+			if ( atomic_read(&ms->write_quorum) )
+				DMEMIT(" write_quorum %d", atomic_read(&ms->write_quorum));
+			if (ms->jr_leg) /* never detached */
+				DMEMIT(" journal %u %s", dms_leg_pos(legs, ms->jr_leg), ms->jr_dev->name);
+			if ( atomic_read(&ms->max_io_len) != DMS_DEFAULT_MAX_IO_LEN )
+				DMEMIT(" max_io_len %d", atomic_read(&ms->max_io_len));
+		}
+		srcu_read_unlock(&dms_legs_srcu, idx);
 		break;
 	}
 }
@@ -1815,23 +6174,136 @@ static struct mirror_sync_set *alloc_mirror_sync_set(unsigned int nr_mirrors,
 	}
 
 	memset(ms, 0, len);
-	spin_lock_init(&ms->lock);
+	INIT_HLIST_NODE(&ms->reg_node);
 
 	ms->ti = ti;
 	ms->nr_mirrors = nr_mirrors;
+	ms->ops = nr_mirrors == 2 && READ_ONCE(dms_pair_path) ? &dms_pair_ops : &dms_any_ops;
 	atomic_set(&ms->suspend, 0); /* init suspend flag to 0 */
+	atomic_set(&ms->requeued, 0);
 
 	spin_lock_init(&ms->choose_lock);
 	ms->read_mirror = &ms->mirror[DEFAULT_MIRROR];
 	ms->default_mirror = &ms->mirror[DEFAULT_MIRROR];
 
-	ms->io_client = dm_io_client_create();
-	if (IS_ERR(ms->io_client)) {
+	if ( dms_io_client_get(ms) ) {
 		ti->error = "Error creating dm_io client";
 		kfree(ms);
  		return NULL;
 	}
 
+	/* stale region maps of the legs [for catching up reinstated legs]... */
+	ms->nr_regions = (ti->len + (1 << DMS_REGION_SHIFT) - 1) >> DMS_REGION_SHIFT;
+	for (i = 0; i < nr_mirrors; i++) {
+		/* NOTE: the region maps are allocated by get_mirror(), on the node of the leg */
+
+		/* write-behind state (legs are synchronous unless set "async") */
+		spin_lock_init(&ms->mirror[i].behind_lock);
+		ms->mirror[i].behind_tree = RB_ROOT;
+		INIT_LIST_HEAD(&ms->mirror[i].behind_list);
+		atomic_set(&ms->mirror[i].behind_ios, 0);
+		atomic_set(&ms->mirror[i].behind_sectors, 0);
+	}
+
+	/* one byte of heat & one of decay round per region */
+	ms->heat = vzalloc(2 * ms->nr_regions);
+	if (!ms->heat) {
+		ti->error = "Cannot allocate region heat map";
+		goto bad_alloc;
+	}
+	ms->heat_gen = ms->heat + ms->nr_regions;
+
+	/* read retries, queued & redispatched on the CPU they failed on */
+	ms->retry = alloc_percpu(struct dms_retry_cpu);
+	if (!ms->retry) {
+		ti->error = "Cannot allocate read retry queues";
+		goto bad_alloc;
+	}
+	for_each_possible_cpu(i) {
+		struct dms_retry_cpu *rq = per_cpu_ptr(ms->retry, i);
+
+		init_llist_head(&rq->list);
+		INIT_WORK(&rq->work, main_mirror_syncd);
+		rq->ms = ms;
+	}
+
+	/* all legs of the table are attached */
+	mutex_init(&ms->legs_lock);
+	RCU_INIT_POINTER(ms->legs, dms_legs_alloc(ms, ~0UL >> (BITS_PER_LONG - nr_mirrors)));
+	if (!rcu_access_pointer(ms->legs)) {
+		ti->error = "Cannot allocate leg set";
+		goto bad_alloc;
+	}
+
+	/* health prober & resync of failed legs */
+	INIT_DELAYED_WORK(&ms->probe_work, do_probe);
+	INIT_DELAYED_WORK(&ms->tick_work, do_tick);
+	INIT_WORK(&ms->resync_work, do_resync);
+	atomic_set( &ms->probe_interval, DMS_DEFAULT_PROBE_INTERVAL );
+	atomic_set( &ms->probe_threshold, DMS_DEFAULT_PROBE_THRESHOLD );
+	atomic_set( &ms->resync_stop, 1 ); /* started on resume */
+	atomic_set( &ms->resync_nr, 0 );
+	ms->resync_mirror = NULL;
+	ms->resync_hot_pass = 1;
+	ms->resync_epoch = 0;
+	atomic_set( &ms->resync_inflight[0], 0 );
+	atomic_set( &ms->resync_inflight[1], 0 );
+	init_waitqueue_head(&ms->resync_wait);
+	atomic_set( &ms->resync_regions_done, 0 );
+	atomic_set( &ms->resync_rate, 0 );
+	atomic_set( &ms->resync_kbps, 0 );
+
+	atomic_set( &ms->behind_max_kb, DMS_DEFAULT_BEHIND_MAX_KB );
+	atomic_set( &ms->behind_max_lag, DMS_DEFAULT_BEHIND_MAX_LAG );
+	atomic_set( &ms->behind_flush, DMS_BEHIND_FLUSH_ALL );
+	atomic_set( &ms->write_quorum, 0 );
+	atomic_set( &ms->max_io_len, DMS_DEFAULT_MAX_IO_LEN );
+	atomic_set( &ms->cap_kb, 0 );
+	atomic_set( &ms->cap_ios, 0 );
+	atomic_set( &ms->cap_waits, 0 );
+	init_waitqueue_head(&ms->cap_wait);
+	atomic_set( &ms->quorum_early, 0 );
+	init_waitqueue_head(&ms->behind_wait);
+	spin_lock_init(&ms->defer_lock);
+	bio_list_init(&ms->defer_queue);
+	ms->defer_queued = 0;
+	INIT_WORK(&ms->defer_work, do_defer_dispatch);
+	atomic_set( &ms->defer_gen, 0 );
+	init_waitqueue_head(&ms->defer_wait);
+	atomic_set( &ms->share_weight, DMS_DEFAULT_SHARE_WEIGHT );
+
+	/* QoS limits (none until set with io_cmd set_qos_read/write) */
+	spin_lock_init(&ms->qos_lock);
+	memset(ms->qos, 0, sizeof(ms->qos));
+	bio_list_init(&ms->qos[READ].queue);
+	bio_list_init(&ms->qos[WRITE].queue);
+	ms->qos_leg_cost = 0;
+	INIT_DELAYED_WORK(&ms->qos_work, do_qos_dispatch);
+
+	/* write journal (none unless set with the "journal" feature arg) */
+	spin_lock_init(&ms->jr_lock);
+	INIT_LIST_HEAD(&ms->jr_inflight);
+	INIT_LIST_HEAD(&ms->jr_entries);
+	init_waitqueue_head(&ms->jr_wait);
+	INIT_WORK(&ms->jr_work, do_journal_replay);
+
+	/* flush sequencing: the first flush of each leg is never skipped */
+	spin_lock_init(&ms->flush_lock);
+	bio_list_init(&ms->flush_round);
+	bio_list_init(&ms->flush_pending);
+	INIT_WORK(&ms->flush_work, do_flush_round);
+	atomic_set( &ms->flush_rounds, 0 );
+	atomic_set( &ms->flush_merged, 0 );
+	atomic_set( &ms->flush_elided, 0 );
+	atomic_set( &ms->zero_legs, 0 );
+	atomic_set( &ms->wsame_offloaded, 0 );
+	atomic_set( &ms->wsame_fallback, 0 );
+	for (i = 0; i < nr_mirrors; i++)
+		ms->mirror[i].flush_gen = atomic_read(&ms->mirror[i].wr_gen) - 1;
+	atomic_set( &ms->jr_stop, 0 );
+	atomic_set( &ms->jr_replayed, 0 );
+	atomic_set( &ms->jr_kbps, 0 );
+
 	/* Default policy & params set at init time, can be reconfigured later via message cmd... */
 	atomic_set( &ms->rdpolicy, DMS_ROUND_ROBIN ); /* default read policy */
 	//atomic_set( &ms->rdpolicy, DMS_LOGICAL_PARTITION ); /* default read policy */
@@ -1839,11 +6311,12 @@ static struct mirror_sync_set *alloc_mirror_sync_set(unsigned int nr_mirrors,
 	atomic_set( &ms->lp_io_chunk, 1024 );	/* 1024 KiB default stripe */
 	atomic_set( &ms->rr_ios_set, MIN_READS);
 	atomic_set( &ms->rr_ios, MIN_READS);
+	atomic_set( &ms->ll_hyst, DMS_DEFAULT_LL_HYST );
 
 	/* initialize mirror weights [for custom weighted balancing scheme]. */
 	assert_bug( ms->nr_mirrors <= MAX_MIRRORS );
-	for (i = 0; i < MAX_MIRRORS; i++)
-		atomic_set( &ms->mirror_weights[i], 0 ); /* init to 0 == uninitialized */
+	for (i = 0; i < ms->nr_mirrors; i++)
+		atomic_set( &ms->mirror[i].weight, 0 ); /* init to 0 == uninitialized */
 	/* points to the mirror with the current max weight => changes on failure/reconfig*/
 
 	atomic_set( &ms->mirror_weight_max_live, 0 );
@@ -1857,21 +6330,122 @@ static struct mirror_sync_set *alloc_mirror_sync_set(unsigned int nr_mirrors,
 	atomic_set( &ms->write_ios_total, 0 );
 	atomic_set( &ms->write_ios_pending, 0 );
 
-	/* this is the list of bios for retrying read failures... */
-	bio_list_init(&ms->read_failures);
+	return ms;
+
+bad_alloc:
+	for (i = 0; i < nr_mirrors; i++) {
+		vfree(ms->mirror[i].stale_map);
+		vfree(ms->mirror[i].behind_map);
+	}
+	vfree(ms->heat);
+	free_percpu(ms->retry);
+	kfree(rcu_dereference_protected(ms->legs, 1));
+	dms_io_client_put(ms);
+	kfree(ms);
+	return NULL;
+}
+
+/*-----------------------------------------------------------------
+ * Instance registry, by dm device name
+ *---------------------------------------------------------------*/
+static inline struct hlist_head *dms_reg_bucket(struct hlist_head *hash, unsigned int bits,
+												const char *name)
+{
+	return hash + hash_32(full_name_hash(NULL, name, strlen(name)), bits);
+}
+
+static struct hlist_head *dms_reg_alloc(unsigned int bits)
+{
+	size_t len = sizeof(struct hlist_head) << bits;
+
+	/* NOTE: zeroed heads are empty lists */
+	return (len > PAGE_SIZE) ? vzalloc(len) : kzalloc(len, GFP_KERNEL);
+}
+
+/* Double the buckets: on failure we keep going with longer chains [dms_reg_lock held] */
+static void dms_reg_grow(void)
+{
+	unsigned int i, bits = dms_reg_bits + 1;
+	struct hlist_head *hash;
+	struct hlist_node *tmp;
+	struct mirror_sync_set *ms;
+
+	if (bits > DMS_REG_MAX_BITS || !(hash = dms_reg_alloc(bits)))
+		return;
+
+	for (i = 0; i < (1U << dms_reg_bits); i++)
+		hlist_for_each_entry_safe(ms, tmp, dms_reg_hash + i, reg_node) {
+			hlist_del(&ms->reg_node);
+			hlist_add_head(&ms->reg_node, dms_reg_bucket(hash, bits, ms->name));
+		}
+
+	kvfree(dms_reg_hash);
+	dms_reg_hash = hash;
+	dms_reg_bits = bits;
+}
+
+/* Add the new instance & return the live one of the same device, if a
+ * reload is in progress [dms_reg_lock held] */
+static struct mirror_sync_set *dms_reg_add(struct mirror_sync_set *newms)
+{
+	struct mirror_sync_set *ms;
+	struct hlist_head *head;
+
+	if (dms_reg_count >= (1U << dms_reg_bits))
+		dms_reg_grow();
+
+	head = dms_reg_bucket(dms_reg_hash, dms_reg_bits, newms->name);
+	hlist_for_each_entry(ms, head, reg_node)
+		if ( !strcmp(ms->name, newms->name) )
+			break;
+
+	hlist_add_head(&newms->reg_node, head);
+	dms_reg_count++;
 
 	return ms;
 }
 
+static void dms_reg_del(struct mirror_sync_set *ms)
+{
+	if ( hlist_unhashed(&ms->reg_node) )
+		return;
+
+	mutex_lock(&dms_reg_lock);
+	hlist_del_init(&ms->reg_node);
+	dms_reg_count--;
+	mutex_unlock(&dms_reg_lock);
+}
+
 /*----------------------------------------------------------------- */
 
 static void free_context(struct mirror_sync_set *ms, struct dm_target *ti,
 			 unsigned int m)
 {
-	while (m--)
+	unsigned int i;
+
+	dms_reg_del(ms); /* if it got into the registry (failed ctr) */
+
+	while (m--) {
+		dms_disk_put(ms->mirror + m);
 		dm_put_device(ti, ms->mirror[m].dev);
+	}
+
+	for (i = 0; i < ms->nr_mirrors; i++) {
+		dms_probe_drop(ms->mirror + i); /* NOTE: may still be in flight, on its own then */
+		vfree(ms->mirror[i].stale_map);
+		vfree(ms->mirror[i].behind_map);
+	}
+	vfree(ms->heat);
+	free_percpu(ms->retry);
+	kfree(rcu_dereference_protected(ms->legs, 1));
 
-	dm_io_client_destroy(ms->io_client);
+	if (ms->jr_dev)
+		dm_put_device(ti, ms->jr_dev);
+	dms_journal_free(ms);
+	vfree(ms->jr_buf);
+	kfree(ms->jr_sb);
+
+	dms_io_client_put(ms);
 	kfree(ms);
 }
 
@@ -1880,6 +6454,7 @@ static void free_context(struct mirror_sync_set *ms, struct dm_target *ti,
 static int get_mirror(struct mirror_sync_set *ms, struct dm_target *ti,
 		      unsigned int mirror, char **argv)
 {
+	struct mirror *m = ms->mirror + mirror;
 	unsigned long long offset;
 	char dummy;
 
@@ -1895,11 +6470,27 @@ static int get_mirror(struct mirror_sync_set *ms, struct dm_target *ti,
 		ti->error = "Device lookup failure";
 		return -ENXIO;
 	}
+	if ( dms_disk_get(ms->mirror + mirror) ) {
+		dm_put_device(ti, ms->mirror[mirror].dev);
+		ti->error = "Cannot allocate disk load entry";
+		return -ENOMEM;
+	}
+
+	/* region maps of the leg, on the node of its disk (the leg's I/O path sets them) */
+	m->stale_map = vzalloc_node(BITS_TO_LONGS(ms->nr_regions) * sizeof(unsigned long), m->nid);
+	m->behind_map = vzalloc_node(BITS_TO_LONGS(ms->nr_regions) * sizeof(unsigned long), m->nid);
+	if (!m->stale_map || !m->behind_map) {
+		dms_disk_put(m);
+		dm_put_device(ti, m->dev);
+		ti->error = "Cannot allocate stale region maps";
+		return -ENOMEM;
+	}
 
 	ms->mirror[mirror].offset = offset;
 	atomic_set(&(ms->mirror[mirror].error_count), 0);
 	ms->mirror[mirror].error_type = 0;
 	ms->mirror[mirror].ms = ms;
+	set_bit(mirror, &ms->live_mask);
 
 	return 0;
 }
@@ -1988,6 +6579,26 @@ static int process_input_args(struct dm_target *ti,
 
 		*args_used = 2 + param_count;
 
+	} else if ( strlen(argv[0]) == strlen("least_load") &&
+				!strncmp(argv[0], "least_load", strlen(argv[0])) ) {
+
+		if ( param_count != 1 ) {
+			ti->error = "Invalid mirror_sync least_load argument (need 1 arg for hysteresis %)";
+			return 0;
+		}
+		DMINFO("Least load policy param: hysteresis %s%%", argv[2] );
+		if (sscanf(argv[2], "%u%c", &value, &dummy) != 1 || value > 1000 ) {
+			ti->error = "Invalid least load hysteresis (has to be 0 - 1000 %)";
+			return 0;
+		}
+
+		/* return the selected policy + parameters... */
+		rp->oldparams = 0;
+		rp->policy = DMS_LEAST_LOAD;
+		rp->rparg[0] = value;
+
+		*args_used = 2 + param_count;
+
 	} else if ( strlen(argv[0]) == strlen("weighted") &&
 				!strncmp(argv[0], "weighted", strlen(argv[0])) ) {
 
@@ -2037,6 +6648,148 @@ static int process_input_args(struct dm_target *ti,
 
 /*----------------------------------------------------------------- */
 
+/* Optional feature args after the mirror devices:
+ *   <#feature args> [rebuild <dev idx>]... [async <dev idx>]... [write_quorum <K>]
+ *                   [journal <dev idx> <journal dev>] [zero_detect <dev idx>]...
+ *                   [max_io_len <sectors>]
+ *
+ * "rebuild" marks a leg (e.g. a newly added one) as completely out of sync: it gets
+ * all new writes at once, while the resync work populates it in the background...
+ * "async" makes a leg (e.g. a remote one) write-behind: writes complete without
+ * waiting for it, within the io_cmd set_async_limits lag limits.
+ * "write_quorum" completes writes once K of the (3 or more) legs acked them.
+ * "journal" stages the writes to a leg (e.g. a remote one) in an ordered journal on
+ * a local device: they complete once there, and get applied to the leg in order.
+ * "zero_detect" sends the all-zero writes to a leg (e.g. thin or remote one) as
+ * WRITE_SAME (or WRITE_ZEROES) instead of the data, if it supports it.
+ * "max_io_len" is the size bios are split to (default 4 MB, 0 == no split). */
+static int process_feature_args(struct mirror_sync_set *ms, struct dm_target *ti,
+								unsigned int argc, char **argv)
+{
+	unsigned int nr_feat, i, idx, nr_rebuild = 0;
+	char dummy;
+	int r;
+
+	if (!argc)
+		return 0;
+
+	if (sscanf(argv[0], "%u%c", &nr_feat, &dummy) != 1 || nr_feat != argc - 1) {
+		ti->error = "Invalid number of mirror_sync feature arguments";
+		return -EINVAL;
+	}
+
+	for (i = 1; i < argc; i++) {
+
+		if ( !strcmp(argv[i], "rebuild") && i + 1 < argc ) {
+
+			if (sscanf(argv[++i], "%u%c", &idx, &dummy) != 1 || idx >= ms->nr_mirrors) {
+				ti->error = "Invalid rebuild device index";
+				return -EINVAL;
+			}
+			if ( atomic_read(&ms->mirror[idx].state) != DMS_LEG_RECOVERING )
+				nr_rebuild++;
+			atomic_set(&ms->mirror[idx].state, DMS_LEG_RECOVERING);
+			bitmap_fill(ms->mirror[idx].stale_map, ms->nr_regions);
+
+		} else if ( !strcmp(argv[i], "async") && i + 1 < argc ) {
+
+			if (sscanf(argv[++i], "%u%c", &idx, &dummy) != 1 || idx >= ms->nr_mirrors) {
+				ti->error = "Invalid async device index";
+				return -EINVAL;
+			}
+			ms->mirror[idx].async = 1;
+
+		} else if ( !strcmp(argv[i], "write_quorum") && i + 1 < argc ) {
+
+			if (sscanf(argv[++i], "%u%c", &idx, &dummy) != 1 ||
+				(idx && (ms->nr_mirrors < 3 || idx >= ms->nr_mirrors)) ) {
+				ti->error = "Invalid write quorum";
+				return -EINVAL;
+			}
+			atomic_set(&ms->write_quorum, idx);
+
+		} else if ( !strcmp(argv[i], "journal") && i + 2 < argc && !ms->jr_leg ) {
+
+			if (sscanf(argv[++i], "%u%c", &idx, &dummy) != 1 || idx >= ms->nr_mirrors) {
+				ti->error = "Invalid journal device index";
+				return -EINVAL;
+			}
+			r = dm_get_device(ti, argv[++i], dm_table_get_mode(ti->table), &ms->jr_dev);
+			if (r) {
+				ti->error = "Journal device lookup failure";
+				return r;
+			}
+			ms->jr_leg = ms->mirror + idx;
+
+		} else if ( !strcmp(argv[i], "zero_detect") && i + 1 < argc ) {
+
+			if (sscanf(argv[++i], "%u%c", &idx, &dummy) != 1 || idx >= ms->nr_mirrors) {
+				ti->error = "Invalid zero_detect device index";
+				return -EINVAL;
+			}
+			dms_set_zero_detect(ms->mirror + idx, 1);
+
+		} else if ( !strcmp(argv[i], "max_io_len") && i + 1 < argc ) {
+
+			if (sscanf(argv[++i], "%u%c", &idx, &dummy) != 1 || (idx && idx < DMS_MIN_MAX_IO_LEN)) {
+				ti->error = "Invalid max_io_len";
+				return -EINVAL;
+			}
+			atomic_set(&ms->max_io_len, idx);
+
+		} else {
+			ti->error = "Invalid mirror_sync feature argument";
+			return -EINVAL;
+		}
+	}
+
+	if (nr_rebuild >= ms->nr_mirrors) {
+		ti->error = "Cannot rebuild all mirror devices";
+		return -EINVAL;
+	}
+
+	if (ms->jr_leg) {
+		if (ms->jr_leg->async) {
+			ti->error = "Journaled mirror device cannot be async";
+			return -EINVAL;
+		}
+
+		ms->jr_ring_sectors = (i_size_read(ms->jr_dev->bdev->bd_inode) >> SECTOR_SHIFT);
+		if (ms->jr_ring_sectors < DMS_JOURNAL_RING_START + DMS_JOURNAL_BATCH) {
+			ti->error = "Journal device too small";
+			return -EINVAL;
+		}
+		ms->jr_ring_sectors -= DMS_JOURNAL_RING_START;
+
+		ms->jr_buf = vmalloc(to_bytes(DMS_JOURNAL_BATCH));
+		ms->jr_sb = kzalloc(PAGE_SIZE, GFP_KERNEL);
+		if (!ms->jr_buf || !ms->jr_sb) {
+			ti->error = "Cannot allocate journal buffers";
+			return -ENOMEM;
+		}
+
+		r = dms_journal_load(ms);
+		if (r) {
+			ti->error = "Cannot read the write journal";
+			return r;
+		}
+	}
+
+	/* the default mirror must be in sync... or, if the other legs are all
+	 * rebuilt, the journaled one: it is once its journal is replayed
+	 * (CAUTION: never NULL, the read policies start from it) */
+	ms->default_mirror = get_valid_mirror(ms);
+	if (!ms->default_mirror)
+		ms->default_mirror = ms->jr_leg;
+	assert_bug( ms->default_mirror );
+	ms->read_mirror = ms->default_mirror;
+	get_mirror_weight_max_live( ms ); /* re-calc mirror_weight_max_live */
+
+	return 0;
+}
+
+/*----------------------------------------------------------------- */
+
 char *
 get_all_devs_string( struct mirror_sync_set *ms, int *dslen )
 {
@@ -2065,72 +6818,177 @@ get_all_devs_string( struct mirror_sync_set *ms, int *dslen )
 
 /*
  * Enable/disable discard support on mirror set depending on
- * discard properties of underlying mirror_sync members.
+ * discard properties of underlying mirror_sync members: discards
+ * are supported if any member does, the others are skipped.
  */
 static void configure_discard_support(struct dm_target *ti, struct mirror_sync_set *ms)
 {
-#ifdef SUPPORT_DISCARDS /* TRIM support? */
-	int i;
+	int i, nr = 0;
 	struct mirror *m;
 
-	/* Assume discards not supported until after checks below. */
-	ti->discards_supported = false;
+	for (i = 0, m = ms->mirror; i < ms->nr_mirrors; i++, m++) {
+		struct request_queue *q = m->dev->bdev ? bdev_get_queue(m->dev->bdev) : NULL;
+
+		m->discards = q && blk_queue_discard(q);
+		nr += m->discards;
+	}
+
+	ti->discards_supported = nr > 0;
+
+	/* mirroring requires bio splitting (to max_io_len), dm_io splits
+	 * them further to the max discard size of each member */
+	ti->split_discard_bios = 1;
+	ti->num_discard_bios = nr ? 1 : 0;
+}
+
+/*----------------------------------------------------------------- */
+
+/* Queue limits of the device from the legs: the I/O sizes that suit all of them
+ * (io_min: the largest one, io_opt: a multiple of all), so that filesystems align
+ * to the RAID/stripe geometry under the legs.
+ * Discard limits: the smallest granularity (and its alignment, as seen through
+ * the leg offset) of the members that support discards, so that none of them
+ * misses a discard it could do, and the largest max discard size (dm_io splits
+ * to each member's own limit). Stacking the limits takes the largest granularity
+ * and the smallest size... */
+static void mirror_sync_io_hints(struct dm_target *ti, struct queue_limits *limits)
+{
+	struct mirror_sync_set *ms = (struct mirror_sync_set *) ti->private;
+	unsigned int i, gran = 0, align = 0, max = 0, io_min = 0, io_opt = 0;
+	struct mirror *m;
 
+	DMSDEBUG_CALL("mirror_sync_io_hints called...\n");
 	for (i = 0, m = ms->mirror; i < ms->nr_mirrors; i++, m++) {
-		struct request_queue *q;
+		struct queue_limits *l = &bdev_get_queue(m->dev->bdev)->limits;
+		sector_t off = m->offset << SECTOR_SHIFT;
 
-		if (!m->dev->bdev)
+		io_min = max(io_min, l->io_min);
+		io_opt = lcm_not_zero(io_opt, l->io_opt);
+
+		if (!m->discards)
 			continue;
 
-		q = bdev_get_queue(m->dev->bdev);
-		if (!q || !blk_queue_discard(q))
-			return;
+		max = max(max, l->max_discard_sectors);
+		if ( l->discard_granularity && (!gran || l->discard_granularity < gran) ) {
+			gran = l->discard_granularity;
+			align = (bdev_discard_alignment(m->dev->bdev) + gran - sector_div(off, gran)) % gran;
+		}
 	}
 
-	/* All mirror_sync members properly support discards */
-	ti->discards_supported = true;
+	if (gran) {
+		limits->discard_granularity = gran;
+		limits->discard_alignment = align;
+		limits->discard_misaligned = 0;
+	}
+	if (max)
+		limits->max_discard_sectors = limits->max_hw_discard_sectors = max;
 
-	/* mirroring requires bio splitting, */
-	ti->split_discard_bios = 1;
-	ti->num_discard_bios = 1;
-#else
-	ti->discards_supported = false;
-#endif
+	if (io_min)
+		blk_limits_io_min(limits, io_min);
+	if (io_opt)
+		blk_limits_io_opt(limits, lcm_not_zero(io_opt, limits->io_min));
 }
 
 /*----------------------------------------------------------------- */
 
+/* The leg of ms on the same device (dev_t) as leg m of another table, if any */
+static struct mirror *dms_leg_by_dev(struct mirror_sync_set *ms, struct mirror *m)
+{
+	struct mirror *l;
+
+	for (l = ms->mirror; l < ms->mirror + ms->nr_mirrors; l++)
+		if (l->dev->bdev->bd_dev == m->dev->bdev->bd_dev)
+			return l;
+
+	return NULL;
+}
+
+/* Take over the health & sync state of leg old of the previous table: a failed
+ * leg stays failed, and the regions it (or an async leg) missed stay stale. A
+ * "rebuild" of the new table is kept too (the stale maps are merged)... */
+static void dms_carry_leg(struct mirror *m, struct mirror *old)
+{
+	struct mirror_sync_set *ms = m->ms;
+	unsigned long nr = min(ms->nr_regions, old->ms->nr_regions);
+	int state = atomic_read(&old->state);
+
+	if ( !mirror_is_alive(old) ) {
+		if ( test_bit(DM_RAID1_WRITE_ERROR, &old->error_type) )
+			set_bit(DM_RAID1_WRITE_ERROR, &m->error_type);
+		if ( test_bit(DM_RAID1_SYNC_ERROR, &old->error_type) )
+			set_bit(DM_RAID1_SYNC_ERROR, &m->error_type);
+		if ( test_bit(DM_RAID1_READ_ERROR, &old->error_type) )
+			set_bit(DM_RAID1_READ_ERROR, &m->error_type);
+		atomic_set(&m->error_count, max(atomic_read(&old->error_count), 1));
+		clear_bit(m - ms->mirror, &ms->live_mask);
+		atomic_set(&m->probe_ok, atomic_read(&old->probe_ok));
+		WRITE_ONCE(ms->heat_on, 1);
+		state = DMS_LEG_RECOVERING;
+	}
+
+	if (state != DMS_LEG_INSYNC) {
+		bitmap_or(m->stale_map, m->stale_map, old->stale_map, nr);
+		if ( atomic_read(&m->state) == DMS_LEG_INSYNC ) {
+			atomic_set(&m->state, state);
+			atomic_set(&m->warm_level, atomic_read(&old->warm_level));
+		}
+	}
+	bitmap_or(m->behind_map, m->behind_map, old->behind_map, nr);
+
+	atomic_set(&m->zero_kb, atomic_read(&old->zero_kb));
+	atomic_set(&m->zero_ios, atomic_read(&old->zero_ios));
+}
+
+/* On the first resume of a reloaded table, take over the leg state of the
+ * previous one: it is suspended by now (and destroyed only after this resume),
+ * so nothing changes under us. The legs are matched by dev_t, since the
+ * order of the legs may change... */
+static void dms_carry_legs(struct mirror_sync_set *newms)
+{
+	struct mirror_sync_set *oldms;
+	struct mirror *m, *old;
+
+	if (newms->legs_carried)
+		return;
+	newms->legs_carried = 1;
+
+	mutex_lock(&dms_reg_lock);
+	hlist_for_each_entry(oldms, dms_reg_bucket(dms_reg_hash, dms_reg_bits, newms->name), reg_node)
+		if ( oldms != newms && !strcmp(oldms->name, newms->name) )
+			break;
+
+	if (oldms) {
+		for (m = newms->mirror; m < newms->mirror + newms->nr_mirrors; m++)
+			if ( (old = dms_leg_by_dev(oldms, m)) )
+				dms_carry_leg(m, old);
+
+		if ( !mirror_is_readable(newms->default_mirror) && (m = get_valid_mirror(newms)) )
+			newms->default_mirror = m;
+		get_mirror_weight_max_live( newms );
+	}
+	mutex_unlock(&dms_reg_lock);
+}
+
 /* on reconfig we PRESERVE some data from the PREVIOUS mirror set instance!
  * (e.g. I/O counters, suspend flag, read policy stuff, etc. */
 void
-preserve_ms_params_on_reconfig( int new_ms_idx, char *devname )
+preserve_ms_params_on_reconfig( struct mirror_sync_set *newms )
 {
-	struct mirror_sync_set *newms, *oldms;
-	int i, oidx = -1;
-
-	/* sanity check... */
-	assert_bug( new_ms_idx >= 0 && new_ms_idx < curr_ms_instances );
-	assert_bug( strncmp(reconf_ms[new_ms_idx].devname, devname, strlen(devname)) == 0);
-	newms = reconf_ms[new_ms_idx].current_ms;
+	struct mirror_sync_set *oldms;
+	int i;
 
-	/* search for ANOTHER live ms with the same device name!
+	/* register the new ms & look for ANOTHER live ms with the same device name!
 	 * -> if found: reconfig in progress! */
-	for (i = 0; i < curr_ms_instances; i++)
-		if ( i != new_ms_idx && atomic_read( &reconf_ms[i].in_use ) > 0 &&
-	    	strncmp( devname, reconf_ms[i].devname, strlen(devname) ) == 0 ) {
-				oidx = i;
-				break;
-		}
+	mutex_lock(&dms_reg_lock);
+	oldms = dms_reg_add(newms);
 
-	DMSDEBUG("preserve_ms_params_on_reconfig=> new_idx:%d old_idx:%d !!\n",
-				new_ms_idx, oidx );
+	DMSDEBUG("preserve_ms_params_on_reconfig=> new:%p old:%p !!\n", newms, oldms );
 
-	if ( oidx >= 0 ) { /* found something... */
+	if ( oldms ) { /* found something... */
 		char *ods, *nds;
 		int odslen, ndslen;
 
 		DMSDEBUG("preserve_ms_params_on_reconfig=> RECONFIG DETECTED !!\n");
-		oldms = reconf_ms[oidx].current_ms;
 
 		/* reconfig detected, need to PRESERVE some data from the PREVIOUS mirror set! */
 		assert_bug( oldms && newms );
@@ -2150,21 +7008,50 @@ preserve_ms_params_on_reconfig( int new_ms_idx, char *devname )
 		kfree( nds );
 
 		/* ATTENTION: Device ordering on reconfig is NOT identical!
-		 *            Read policy values are not copied over on reconfig! */
+		 *            Per-leg values are matched by dev_t. The read policy given
+		 *            in the new table (if not "core") is set after this... */
 		atomic_set( &newms->suspend, atomic_read(&oldms->suspend) );
+		atomic_set( &newms->rdpolicy, atomic_read(&oldms->rdpolicy) );
 		atomic_set( &newms->rr_ios_set, atomic_read(&oldms->rr_ios_set));
-
-		{ /* Check if the error counters and bits have been reset! */
-			struct mirror *m;
-			
-			for (i = 0, m = newms->mirror; i < newms->nr_mirrors; i++, m++) {
-				assert( m->error_type == 0 );
-				assert( atomic_read(&m->error_count) == 0 );
-			}
+		atomic_set( &newms->rr_ios, atomic_read(&oldms->rr_ios_set));
+		atomic_set( &newms->lp_io_chunk, atomic_read(&oldms->lp_io_chunk));
+		atomic_set( &newms->ll_hyst, atomic_read(&oldms->ll_hyst));
+
+		{ /* weights by dev_t: the health & sync state of the legs is taken over
+		   * on the first resume (see dms_carry_legs()) */
+			struct mirror *m, *old;
+
+			for (i = 0, m = newms->mirror; i < newms->nr_mirrors; i++, m++)
+				if ( (old = dms_leg_by_dev(oldms, m)) )
+					atomic_set( &newms->mirror[i].weight,
+						atomic_read( &old->weight ) );
 		}
 
 		get_mirror_weight_max_live( newms ); /* re-calc mirror_weight_max_live */
 
+		/* tunables set with messages (the ones of the feature args are in the new table) */
+		atomic_set( &newms->probe_interval, atomic_read(&oldms->probe_interval));
+		atomic_set( &newms->probe_threshold, atomic_read(&oldms->probe_threshold));
+		atomic_set( &newms->resync_rate, atomic_read(&oldms->resync_rate));
+		atomic_set( &newms->behind_max_kb, atomic_read(&oldms->behind_max_kb));
+		atomic_set( &newms->behind_max_lag, atomic_read(&oldms->behind_max_lag));
+		atomic_set( &newms->behind_flush, atomic_read(&oldms->behind_flush));
+		atomic_set( &newms->cap_kb, atomic_read(&oldms->cap_kb));
+		atomic_set( &newms->numa_reads, atomic_read(&oldms->numa_reads));
+		atomic_set( &newms->numa_margin, atomic_read(&oldms->numa_margin));
+		atomic_set( &newms->cap_ios, atomic_read(&oldms->cap_ios));
+		atomic_set( &newms->share_weight, atomic_read(&oldms->share_weight));
+		newms->qos_leg_cost = READ_ONCE(oldms->qos_leg_cost);
+		for (i = READ; i <= WRITE; i++) {
+			newms->qos[i].iops.rate = READ_ONCE(oldms->qos[i].iops.rate);
+			newms->qos[i].bw.rate = READ_ONCE(oldms->qos[i].bw.rate);
+		}
+
+		/* learned foreground latency (the disk latencies are kept in the disk registry) */
+		newms->fg_lat_us = READ_ONCE(oldms->fg_lat_us);
+		newms->fg_lat_base_us = READ_ONCE(oldms->fg_lat_base_us);
+		atomic_set( &newms->resync_regions_done, atomic_read(&oldms->resync_regions_done));
+
 		atomic_set( &newms->supress_err_messages, 0 ); /* clear error messages on reconfig... */
 
 		/* preserve IO counters... */
@@ -2173,13 +7060,14 @@ preserve_ms_params_on_reconfig( int new_ms_idx, char *devname )
 		atomic_set( &newms->write_ios_total, atomic_read(&oldms->write_ios_total));
 		atomic_set( &newms->write_ios_pending, atomic_read(&oldms->write_ios_pending));
 	}
+	mutex_unlock(&dms_reg_lock);
 }
 
 /*----------------------------------------------------------------- */
 
 /*
  * Construct a mirror sync mapping:
- * #mirrors [mirror_sync_path offset]{2,}
+ * #mirrors [mirror_sync_path offset]{2,} [#feature_args [feature_arg]*]
  *
  * Michail: we do not have a log, BUT to preserve backwards compatibility
  *          with dm-mirror we pretend that we really use the log arguments ...
@@ -2190,7 +7078,7 @@ preserve_ms_params_on_reconfig( int new_ms_idx, char *devname )
  */
 static int mirror_sync_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 {
-	int i, r;
+	int r;
 	unsigned int nr_mirrors, m, args_used;
 	struct mirror_sync_set *ms;
 	struct mapped_device *md;
@@ -2209,15 +7097,14 @@ static int mirror_sync_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	argc -= args_used;
 
 	if (!argc || sscanf(argv[0], "%u%c", &nr_mirrors, &dummy) != 1 ||
-	    nr_mirrors < 2 || nr_mirrors > DM_KCOPYD_MAX_REGIONS + 1 ||
-		nr_mirrors > MAX_MIRRORS ) {
+	    nr_mirrors < 2 || nr_mirrors > MAX_MIRRORS ) {
 		ti->error = "Invalid number of mirrors";
 		return -EINVAL;
 	}
 
 	argv++, argc--;
 
-	if (argc != nr_mirrors * 2) {
+	if (argc < nr_mirrors * 2) {
 		ti->error = "Wrong number of mirror arguments";
 		return -EINVAL;
 	}
@@ -2237,14 +7124,26 @@ static int mirror_sync_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		argc -= 2;
 	}
 
+	/* any optional feature args left? */
+	r = process_feature_args(ms, ti, argc, argv);
+	if (r) {
+		free_context(ms, ti, ms->nr_mirrors);
+		return r;
+	}
+
 	ti->private = ms;
-	r = dm_set_target_max_io_len(ti, 1 << 13); /* sectors == 4 MB... used to be dm_rh_get_region_size(ms->rh); */
+	/* sectors == 4 MB by default... used to be dm_rh_get_region_size(ms->rh); */
+	r = dm_set_target_max_io_len(ti, atomic_read(&ms->max_io_len));
 	if (r)
 		return -EINVAL;
 	ti->num_flush_bios = 1;
 	ti->num_discard_bios = 1;
+	ti->num_write_same_bios = 1;
+#ifdef DMS_HAVE_WRITE_ZEROES
+	ti->num_write_zeroes_bios = 1;
+#endif
 	/* CAUTION: need the following for dm_per_bio_data()! */
-	ti->per_io_data_size = sizeof(struct dms_bio_map_info);
+	ti->per_io_data_size = dms_bmi_size(nr_mirrors);
 
 	ti->discard_zeroes_data_unsupported = true;
 
@@ -2264,46 +7163,14 @@ static int mirror_sync_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	memset( ms->name, 0, DEVNAME_MAXLEN );
 	memcpy( ms->name, mdname, strlen( mdname ) );
 
-	/* find an unused reconfig space & store its index in ms... */
-	ms->reconfig_idx = curr_ms_instances + 1;
-	for (i = 0; i < curr_ms_instances; i++) {
-
-		if ( atomic_read( &reconf_ms[i].in_use ) > 0 )
-			continue;
-		if ( atomic_inc_return( &reconf_ms[i].in_use ) == 1 ) {
-			assert( reconf_ms[i].current_ms == NULL );
-			ms->reconfig_idx = i;
-			break;
-		} else /* someone beat us into this spot... */
-			atomic_dec( &reconf_ms[i].in_use );
-	}
-	/* handle the case where all slots are full! */
-	if (i >= curr_ms_instances) {
-		ti->error = "Too many mirror_sync instances loaded!";
-		// FIXME : grow the array of instances!
-		return -EINVAL;
-	}
-
-	/* store the latest mirror set contructed, we need this for passing reconfig params */
-	assert_bug( ms->reconfig_idx < curr_ms_instances );
-	assert_bug( atomic_read( &reconf_ms[ ms->reconfig_idx ].in_use ) > 0 );
-	reconf_ms[ ms->reconfig_idx ].current_ms = ms;
-	memset( reconf_ms[ ms->reconfig_idx ].devname, 0, DEVNAME_MAXLEN );
-
 	DMWARN("[%s] DMS Device INIT: Number of mirrors: %d", mdname, nr_mirrors );
-	memcpy( reconf_ms[ ms->reconfig_idx ].devname, mdname, strlen( mdname ) );
 
-	/* on reconfig we PRESERVE some data from the PREVIOUS mirror set instance!
-	 * (e.g. I/O counters, suspend flag, read policy stuff, etc. */
-	preserve_ms_params_on_reconfig( ms->reconfig_idx, reconf_ms[ ms->reconfig_idx ].devname );
+	/* store the latest mirror set contructed in the registry (we need this for
+	 * passing reconfig params) & PRESERVE some data from the PREVIOUS mirror set
+	 * instance on reconfig! (e.g. I/O counters, suspend flag, read policy stuff, etc. */
+	preserve_ms_params_on_reconfig( ms );
 
-	ms->kmirror_syncd_wq = create_singlethread_workqueue("kmirror_syncd");
-	if (!ms->kmirror_syncd_wq) {
-		DMERR("[%s] Error: Couldn't start kmirror_syncd", ms->name);
-		free_context(ms, ti, ms->nr_mirrors);
-		return -ENOMEM;
-	}
-	INIT_WORK(&ms->kmirror_syncd_work, main_mirror_syncd);
+	/* NOTE: the works run on the shared dms_wq (the read retries: see alloc_mirror_sync_set()) */
 	//init_timer(&ms->timer);
 	ms->timer_pending = 0;
 	INIT_WORK(&ms->trigger_event, trigger_event);
@@ -2340,6 +7207,16 @@ static int mirror_sync_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 			atomic_set(&ms->lp_io_chunk, rp.rparg[0]);
 			atomic_set(&ms->rdpolicy, DMS_LOGICAL_PARTITION);
 
+		break;
+		case DMS_LEAST_LOAD:
+
+			md = dm_table_get_md(ti->table);
+			DMINFO("[%s] Setting read policy for \"%s\" to least load with hysteresis= %u%%",
+					ms->name, dm_device_name(md), rp.rparg[0] );
+
+			atomic_set(&ms->ll_hyst, rp.rparg[0]);
+			atomic_set(&ms->rdpolicy, DMS_LEAST_LOAD);
+
 		break;
 		case DMS_CUSTOM_WEIGHTED:
 
@@ -2350,26 +7227,26 @@ static int mirror_sync_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 			for (i = 0; i < ms->nr_mirrors; i++) {
 
 				mirr = ms->mirror + i;
-				atomic_set( &ms->mirror_weights[i], rp.rparg[0] );
+				atomic_set( &ms->mirror[i].weight, rp.rparg[0] );
 
 				if ( mirror_is_alive(mirr) ) { /* alive? */
 					maxi = i;
-					max = atomic_read( &ms->mirror_weights[i] );
+					max = atomic_read( &ms->mirror[i].weight );
 				}
 			}
 
 			/* set the weight value X for device specified... */
 			if (rp.rparg[1] >= 0 && rp.rparg[1] < ms->nr_mirrors)
-				atomic_set( &ms->mirror_weights[ rp.rparg[1] ], rp.rparg[2] );
+				atomic_set( &ms->mirror[rp.rparg[1]].weight, rp.rparg[2] );
 
 			/* ok, now calculate the wml device... */
 			for (i = 0; i < ms->nr_mirrors; i++) {
 
 				mirr = ms->mirror + i;
 				if ( mirror_is_alive(mirr) &&
-					max < atomic_read( &ms->mirror_weights[i]) ) { /* alive? */
+					max < atomic_read( &ms->mirror[i].weight) ) { /* alive? */
 					maxi = i;
-					max = atomic_read( &ms->mirror_weights[i]);
+					max = atomic_read( &ms->mirror[i].weight);
 				}
 			}
 			assert( maxi >= 0 && maxi < MAX_MIRRORS && maxi < ms->nr_mirrors );
@@ -2389,19 +7266,21 @@ static void mirror_sync_dtr(struct dm_target *ti)
 	struct mirror_sync_set *ms = (struct mirror_sync_set *) ti->private;
 
 	DMSDEBUG_CALL("mirror_sync_dtr called...\n");
-	DMWARN("[%s] DMS Device EXIT.",
-			reconf_ms[ ms->reconfig_idx ].devname);
+	DMWARN("[%s] DMS Device EXIT.", ms->name);
 
-	/* free the old reconfig slot... */
-	assert_bug( ms->reconfig_idx < curr_ms_instances );
-	reconf_ms[ ms->reconfig_idx ].current_ms = NULL;
-	memset( reconf_ms[ ms->reconfig_idx ].devname, 0, DEVNAME_MAXLEN );
-	atomic_set( &reconf_ms[ ms->reconfig_idx ].in_use, 0 );
+	/* out of the registry... */
+	dms_reg_del(ms);
 
 	//del_timer_sync(&ms->timer);
-	flush_workqueue(ms->kmirror_syncd_wq);
-	flush_scheduled_work();
-	destroy_workqueue(ms->kmirror_syncd_wq);
+	dms_behind_drain(ms);
+	atomic_set(&ms->jr_stop, 1);
+	cancel_work_sync(&ms->jr_work);
+	cancel_delayed_work_sync(&ms->qos_work);
+	cancel_work_sync(&ms->defer_work);
+	dms_stop_probe(ms);
+	dms_retry_flush(ms);
+	flush_work(&ms->flush_work);
+	flush_work(&ms->trigger_event);
 
 	free_context(ms, ti, ms->nr_mirrors);
 }
@@ -2476,29 +7355,49 @@ static struct target_type mirror_sync_target = {
 	.message = mirror_sync_message,	/* Message function */
 	.status	 = mirror_sync_status,	/* Status function */
 	.iterate_devices = mirror_sync_iterate_devices,
+	.io_hints = mirror_sync_io_hints,
 	// FIXME: NEED these functions in mirror_sync ?? now used only on striping...
-	//.io_hints = mirror_sync_io_hints,
 	//.merge  = destripe_merge,
 };
 
 static int __init dm_mirror_sync_init(void)
 {
-	int i, r = -ENOMEM;
+	int r = -ENOMEM;
 
 	assert_bug( MAX_MIRRORS > 1 );
 
-	/* initialize the reconfig space */
-	curr_ms_instances = MAX_DMS_INSTANCES;
-	reconf_ms = kzalloc( curr_ms_instances * sizeof(struct reconfig_ms_set), GFP_KERNEL);
-	if ( !reconf_ms ) {
-		DMERR("[%s] Failed to allocate memory for reconf_ms", mirror_sync_target.name);
+	/* the workqueue of all instances (WQ_MEM_RECLAIM: read retries are on the I/O path) */
+	dms_wq = alloc_workqueue("kmirror_syncd", WQ_MEM_RECLAIM, 0);
+	if ( !dms_wq ) {
+		DMERR("[%s] Failed to create the kmirror_syncd workqueue", mirror_sync_target.name);
+		return r;
+	}
+	/* ...and the fair share one: queued leg writes are only issued from it */
+	dms_share_wq = alloc_workqueue("kmirror_syncd_share", WQ_MEM_RECLAIM | WQ_HIGHPRI, 0);
+	if ( !dms_share_wq ) {
+		DMERR("[%s] Failed to create the kmirror_syncd_share workqueue", mirror_sync_target.name);
+		destroy_workqueue(dms_wq);
+		return r;
+	}
+	/* ...and the journal replay one: writes to a journaled leg wait for ring space on it */
+	dms_jr_wq = alloc_workqueue("kmirror_syncd_jr", WQ_MEM_RECLAIM | WQ_UNBOUND, 0);
+	if ( !dms_jr_wq ) {
+		DMERR("[%s] Failed to create the kmirror_syncd_jr workqueue", mirror_sync_target.name);
+		destroy_workqueue(dms_share_wq);
+		destroy_workqueue(dms_wq);
 		return r;
 	}
 
-	for (i = 0; i < curr_ms_instances; i++) {
-		atomic_set( &reconf_ms[i].in_use, 0 );
-		reconf_ms[i].current_ms = NULL;
-		memset( reconf_ms[i].devname, 0, DEVNAME_MAXLEN );
+	/* initialize the instance registry (grows with the instances) */
+	dms_reg_bits = DMS_REG_MIN_BITS;
+	dms_reg_count = 0;
+	dms_reg_hash = dms_reg_alloc(dms_reg_bits);
+	if ( !dms_reg_hash ) {
+		DMERR("[%s] Failed to allocate memory for the instance registry", mirror_sync_target.name);
+		destroy_workqueue(dms_jr_wq);
+		destroy_workqueue(dms_share_wq);
+		destroy_workqueue(dms_wq);
+		return r;
 	}
 
 	r = dm_register_target(&mirror_sync_target);
@@ -2512,7 +7411,10 @@ static int __init dm_mirror_sync_init(void)
 	return 0;
 
 bad_target:
-	kfree( reconf_ms );
+	kvfree( dms_reg_hash );
+	destroy_workqueue(dms_jr_wq);
+	destroy_workqueue(dms_share_wq);
+	destroy_workqueue(dms_wq);
 	return r;
 }
 
@@ -2522,7 +7424,10 @@ static void __exit dm_mirror_sync_exit(void)
 
 	dm_unregister_target(&mirror_sync_target);
 
-	kfree( reconf_ms );
+	kvfree( dms_reg_hash );
+	destroy_workqueue(dms_jr_wq);
+	destroy_workqueue(dms_share_wq);
+	destroy_workqueue(dms_wq);
 }
 
 /* Module hooks */
@@ -72,12 +72,103 @@
 
 #define ENABLE_CHECK_MIRROR_CMDS /* enables check_mirror data support */
 
-#define MAX_MIRRORS	8
+/* the leg masks (live, attached, dm_io errors) are one word */
+#define MAX_MIRRORS	BITS_PER_LONG
 
-#define MAX_DMS_INSTANCES 2048
+/* legs written by one dm_io (regions on the stack), more go as several dm_io */
+#define DMS_IO_GROUP	8
+
+/* source legs copying in parallel in a resync batch */
+#define DMS_RESYNC_MAX_SRCS	8
+
+/* dm_io clients (& their mempools) are shared by up to this many instances */
+#define DMS_IO_CLIENT_SHARE	64
+
+/* Registry of the instances by dm device name: starts with 2^MIN buckets and
+ * doubles when there are more instances than buckets (no instance limit) */
+#define DMS_REG_MIN_BITS	6
+#define DMS_REG_MAX_BITS	20
 
 #define MAX_ERR_MESSAGES 20
 
+/* Resync region size (in sectors, as a shift) => 1 MiB regions.
+ * Writes that miss a leg are tracked per region, so that a reinstated
+ * leg only needs to catch up the regions written while it was away. */
+#define DMS_REGION_SHIFT	11
+
+/* Health prober defaults for failed legs [tunable via io_cmd set_probe]. */
+#define DMS_DEFAULT_PROBE_INTERVAL	5000	/* msecs between probe rounds, 0 == off */
+#define DMS_DEFAULT_PROBE_THRESHOLD	3		/* consecutive good reads to reinstate */
+
+/* Housekeeping rounds (warm-up of caught-up legs, heat decay), independent of the
+ * prober, and the rounds a caught-up leg needs to get its full share of reads back. */
+#define DMS_TICK_INTERVAL	5000	/* msecs */
+#define DMS_WARM_STEPS	8
+
+/* Window (msecs) over which the resync copy rate is measured & limited. */
+#define DMS_RESYNC_RATE_WINDOW	1000
+
+/* Rebuild engine tuning:
+ * - hot regions (heat >= DMS_HEAT_HOT I/Os per decay period) are copied first,
+ * - the cold sweep of the stale map is bounded to DMS_RESYNC_SCAN regions per batch,
+ * - copies back off while foreground latency is DMS_RESYNC_LAT_FACTOR x its baseline. */
+#define DMS_HEAT_HOT			8
+#define DMS_HOT_RING			64
+#define DMS_RESYNC_SCAN			4096
+#define DMS_RESYNC_LAT_FACTOR	2
+#define DMS_RESYNC_MAX_DELAY	1000	/* msecs */
+
+/* Least load read policy: reads stay on the last leg unless its disk is more
+ * loaded than the least loaded one by this much (%) [io_balance least_load hyst] */
+#define DMS_DEFAULT_LL_HYST		25
+
+/* Write-behind ("async") leg defaults [tunable via io_cmd set_async_limits]:
+ * writes to an async leg are not waited on, as long as the leg lags behind
+ * by less than these (then new writes wait for it to catch up). */
+#define DMS_DEFAULT_BEHIND_MAX_KB	(64 * 1024)	/* outstanding KiB per leg */
+#define DMS_DEFAULT_BEHIND_MAX_LAG	5000		/* msecs of the oldest outstanding write */
+
+/* Max I/O length the device splits bios to [max_io_len feature arg / io_cmd] */
+#define DMS_DEFAULT_MAX_IO_LEN		(1 << 13)	/* sectors == 4 MB, 0 == no split */
+#define DMS_MIN_MAX_IO_LEN			8			/* sectors == 4 KiB */
+
+/* QoS limits [io_cmd set_qos_read/write]: a bucket holds up to this much of its
+ * rate as a burst, bios over it are deferred (max limits below) */
+#define DMS_QOS_BURST_MS		100
+#define DMS_QOS_MAX_IOPS		(1 << 24)
+#define DMS_QOS_MAX_KBPS		(1 << 24)	/* 16 GiB/s */
+
+/* Ordered write journal of a remote leg [journal feature arg]: a ring on a local
+ * device, with a superblock (first 4 KiB) and entries of a 4 KiB header + data. */
+#define DMS_JOURNAL_MAGIC		0x4a534d44	/* "DMSJ" */
+#define DMS_JOURNAL_VERSION		1
+#define DMS_JOURNAL_HDR_SECTORS	8			/* keeps the entry data 4 KiB aligned */
+#define DMS_JOURNAL_RING_START	8			/* sectors, after the superblock */
+#define DMS_JOURNAL_BATCH		(16 << 10)	/* max journal sectors replayed per batch (8 MiB) */
+#define DMS_JOURNAL_BATCH_ENTRIES 256
+
+/* WRITE_ZEROES reaches dm targets since kernel 4.12: offloaded like WRITE_SAME */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,12,0)
+#define DMS_HAVE_WRITE_ZEROES
+#endif
+
+struct dms_journal_sb {
+	__le32 magic;
+	__le32 version;
+	__le64 ring_sectors;
+	__le64 tail_seq;		/* first entry not replayed yet */
+	__le64 tail_pos;
+} __attribute__((packed));
+
+struct dms_journal_hdr {
+	__le32 magic;
+	__le32 flags;			/* REQ_PREFLUSH / REQ_FUA of the write */
+	__le64 seq;
+	__le64 sector;			/* target sector */
+	__le32 nr_sectors;
+	__le32 crc;				/* crc32c of the data */
+} __attribute__((packed));
+
 /*-----------------------------------------------------------------
  * Mirror set structures.
  *---------------------------------------------------------------*/
@@ -87,13 +178,83 @@ struct mirror_sync_set;
 typedef enum _dms_read_policy {
 	DMS_ROUND_ROBIN,
 	DMS_CUSTOM_WEIGHTED,
-	DMS_LOGICAL_PARTITION
+	DMS_LOGICAL_PARTITION,
+	DMS_LEAST_LOAD
 } dms_read_policy;
 
 enum dm_raid1_error {
 	DM_RAID1_WRITE_ERROR,
 	DM_RAID1_SYNC_ERROR,
-	DM_RAID1_READ_ERROR
+	DM_RAID1_READ_ERROR,
+	DMS_LEG_DETACHED	/* not an error: taken out of the set by io_cmd detach_leg */
+};
+
+/* Sync state of a leg (only meaningful while the leg has no error bits set) */
+typedef enum _dms_leg_state {
+	DMS_LEG_INSYNC,		/* fully in sync, gets reads by policy */
+	DMS_LEG_RECOVERING,	/* failed or reinstated, stale regions pending copy */
+	DMS_LEG_WARMING		/* caught up, gradually returned to read selection */
+} dms_leg_state;
+
+/* How far flushes/FUA writes wait for write-behind legs */
+typedef enum _dms_behind_flush {
+	DMS_BEHIND_FLUSH_LOCAL,	/* only the synchronous legs, async legs flush behind */
+	DMS_BEHIND_FLUSH_ALL	/* async legs catch up & flush before completion */
+} dms_behind_flush;
+
+/* Load of a physical disk, shared by the legs of all instances on it: a
+ * module-global registry, keyed by the dev_t of the whole disk of the leg */
+#define DMS_DISK_HASH_BITS	8
+
+/* Fair share of the shared disks [module param mirror_sync_share_depth]: while a
+ * disk has that many I/Os in flight, the I/Os of the legs on it wait, and are
+ * dispatched by deficit round-robin over the instances, by bytes: each gets a
+ * quantum by its weight [io_cmd set_share_weight] per round. */
+#define DMS_DEFAULT_SHARE_WEIGHT	100
+#define DMS_MAX_SHARE_WEIGHT		1000
+#define DMS_SHARE_QUANTUM			4096	/* bytes per weight unit & round */
+#define DMS_SHARE_MIN_COST			4096	/* bytes charged for small/empty I/Os */
+
+struct dms_disk {
+	struct hlist_node node;
+	dev_t dev;
+	int nid;					/* NUMA node of its request queue (HBA) */
+	unsigned int users;			/* legs on the disk [dms_disks_lock] */
+	atomic_t inflight_ios;		/* I/Os in flight from all instances */
+	atomic_t inflight_sectors;
+	unsigned long lat_us;		/* read latency (EWMA, 1/8 weight per read) */
+
+	/* fair share dispatcher of the legs on the disk */
+	spinlock_t share_lock;
+	unsigned int share_inflight;	/* I/Os it dispatched, in flight */
+	struct list_head share_active;	/* legs with I/Os waiting, in round-robin order */
+	struct work_struct share_work;	/* dispatches after completions */
+};
+
+/* A leg I/O through the fair share dispatcher of its disk */
+struct dms_share_io {
+	struct list_head list;		/* in the queue of the leg */
+	struct mirror *m;
+	struct bio *bio;
+	unsigned int cost;			/* bytes charged to the leg */
+	unsigned int idx;			/* region of the write (bmi_wm index) */
+	int shared;					/* dispatched by the disk (else sent directly) */
+	struct dm_io_region where;
+	struct dm_io_request req;
+};
+
+/* A test read of a failed leg: owned by the leg & the bio, so that nothing
+ * waits for a hung leg to complete it (the prober looks at it next round) */
+enum dms_probe_state {
+	DMS_PROBE_INFLIGHT,
+	DMS_PROBE_OK,
+	DMS_PROBE_FAILED,
+};
+
+struct dms_probe {
+	atomic_t refs;
+	int state;					/* dms_probe_state */
+	struct page *page;
 };
 
 struct mirror {
@@ -102,6 +263,100 @@ struct mirror {
 	struct mirror_sync_set *ms;
 	struct dm_dev *dev;
 	sector_t offset;
+
+	atomic_t state;				/* dms_leg_state of this leg */
+	unsigned long *stale_map;	/* regions written while this leg was out of sync */
+	atomic_t probe_ok;			/* consecutive successful probe reads (while failed) */
+	atomic_t probe_seq;			/* rotates the probed region */
+	struct dms_probe *probe;	/* last test read (prober only) */
+	atomic_t warm_level;		/* read share (x/DMS_WARM_STEPS) while warming */
+	atomic_t warm_reads;
+
+	/* Write-behind: writes to an async leg complete without waiting for it */
+	int async;
+	spinlock_t behind_lock;			/* protects the behind tree/list/map */
+	struct rb_root behind_tree;		/* in-flight behind writes, by sector range */
+	struct list_head behind_list;	/* ... and in submission order (oldest first) */
+	atomic_t behind_ios;
+	atomic_t behind_sectors;
+	unsigned long *behind_map;		/* regions written since the leg last caught up */
+
+	int discards;					/* the leg supports discards */
+
+	/* Zero detection (thin/remote legs): all-zero writes go as WRITE_SAME/ZEROES */
+	int zero_detect;
+	atomic_t zero_kb;				/* data KiB not shipped to the leg */
+	atomic_t zero_ios;
+
+	/* In-flight I/O on the leg, against the caps of the set */
+	atomic_t inflight_ios;
+	atomic_t inflight_sectors;
+	struct dms_disk *disk;			/* shared load of its disk (all instances) */
+	int nid;						/* NUMA node of the disk */
+
+	/* Fair share: the leg is the flow of its instance on the disk */
+	struct list_head share_active;	/* in the active flows of the disk */
+	struct list_head share_queue;	/* I/Os waiting for the dispatcher */
+	unsigned int share_queued;
+	int share_deficit;				/* bytes it may still send in this round */
+
+	/* Flush elision: no flush needed if no write completed since the last one */
+	atomic_t wr_gen;				/* writes completed on the leg */
+	unsigned int flush_gen;			/* wr_gen covered by its last good flush */
+	unsigned int flush_snap;		/* wr_gen at the start of the flush round */
+
+	atomic_t weight;				/* Adjustable weight [for custom weighted scheme]. */
+};
+
+struct dms_bio_map_info;
+
+/* Failed reads queued on a CPU (lock-free), redispatched by a work on that CPU
+ * (the shared dms_wq is per-CPU): a leg failure under load is spread on all CPUs */
+struct dms_retry_cpu {
+	struct llist_head list;			/* bmi->retry_node of the reads, newest first */
+	struct work_struct work;
+	struct mirror_sync_set *ms;
+};
+
+/* Entry points of the I/O path, picked by the shape of the set at ctr time:
+ * a set of two legs has its own (no loops over the legs). write returns 1 once
+ * issued, 0 if all legs are dead, or DMS_WRITE_DEFER if it can't go without
+ * blocking (nothing issued, the caller queues it: see dms_defer_add()) */
+#define DMS_WRITE_DEFER 2
+
+struct dms_io_ops {
+	int (*write)(struct dms_bio_map_info *bmi, struct bio *bio);
+	struct mirror *(*read)(struct mirror_sync_set *ms, struct bio *bio);
+};
+
+/* QoS limit as a token bucket (GCRA): a bio may go while the theoretical
+ * arrival time of its first unit is at most DMS_QOS_BURST_MS ahead of now */
+struct dms_bucket {
+	u64 rate;				/* units per second, 0 == no limit */
+	u64 tat;				/* theoretical arrival time (ns) of the next unit */
+};
+
+/* QoS state of one direction (reads / writes) */
+struct dms_qos {
+	struct dms_bucket iops;
+	struct dms_bucket bw;	/* bytes per second */
+	struct bio_list queue;	/* deferred bios, in arrival order */
+	unsigned int queued;
+	atomic_t deferred;		/* bios deferred since the table load */
+};
+
+/* A dm_io client shared by instances */
+struct dms_io_client {
+	struct list_head list;
+	struct dm_io_client *client;
+	unsigned int users;			/* instances using it [dms_io_clients_lock] */
+};
+
+/* The legs attached to an instance (published with RCU, see dms_legs_publish()) */
+struct dms_leg_set {
+	unsigned long attached;		/* bitmap, by leg index */
+	unsigned int nr;			/* legs attached */
+	struct mirror *leg[0];		/* ...and the legs, in index order */
 };
 
 #define DEVNAME_MAXLEN 16
@@ -109,16 +364,20 @@ struct mirror {
 struct mirror_sync_set {
 	struct dm_target *ti;
 
-	spinlock_t lock;	/* protects the lists and mirror_sync_set config */
-	struct bio_list read_failures;
 
 	struct dm_io_client *io_client;
+	struct dms_io_client *io_shared;	/* ...which is shared with other instances */
 
 	atomic_t suspend; /* flag set for suspend... */
+	atomic_t requeued; /* bios pushed back to dm core by the last noflush suspend */
 
 	struct mirror *default_mirror;	/* Default mirror */
 
 	unsigned int nr_mirrors;		/* number of mirrors */
+	const struct dms_io_ops *ops;	/* I/O path for nr_mirrors */
+	unsigned long live_mask;		/* the legs alive, by index (see mirror_is_alive()) */
+	struct dms_leg_set __rcu *legs;	/* the attached ones, changed by the leg messages */
+	struct mutex legs_lock;			/* serializes the leg messages */
 
 	/* Read balancing policy fields
 	 * Policies supported: 1. Round robin 2. Logical partitioning */
@@ -127,12 +386,15 @@ struct mirror_sync_set {
 	atomic_t lp_io_chunk;	/* Adjustable io chunk size in KBytes [for logical partitioning scheme]. */
 	atomic_t rr_ios_set;	/* Adjustable default ios [for round-robin scheme]. */
 	atomic_t rr_ios;		/* Current read ios counter [for round-robin scheme]. */
+	atomic_t pair_reads;	/* Reads counter [for round-robin of a pair, see dms_read_pair()]. */
 	struct mirror *read_mirror; /* Last mirror read [for round-robin scheme]. */
-	atomic_t mirror_weights[MAX_MIRRORS];	/* Adjustable mirror weights [for custom weighted scheme]. */
 	atomic_t mirror_weight_max_live;		/* Current live mirror with max weight [for custom weighted scheme]. */
+	atomic_t ll_hyst;		/* Load difference (%) to move away from the last leg [for least load scheme]. */
+	atomic_t numa_reads;	/* Reads go to a leg on the node of the submitting CPU... */
+	atomic_t numa_margin;	/* ...unless it is more loaded (%) than the one chosen by the policy. */
+	atomic_t numa_local;	/* Reads moved to a leg on the local node. */
 
-	struct workqueue_struct *kmirror_syncd_wq;
-	struct work_struct kmirror_syncd_work;
+	struct dms_retry_cpu __percpu *retry;	/* read retries, queued on the CPU they failed on */
 
 	atomic_t supress_err_messages;		/* Counter/flag of printing I/O error messages. */
 
@@ -146,10 +408,122 @@ struct mirror_sync_set {
 
 	struct work_struct trigger_event;	/* to trigger event work queue */
 
-	unsigned long reconfig_idx;	/* index in reconfig space for suspend/resume parameter passing */
+	struct hlist_node reg_node;	/* in the registry, for passing parameters on reconfig */
+	int legs_carried;			/* leg state taken over from the previous table (first resume) */
 
 	unsigned errmsg_last_time;	/* time store for suppressing error messages... */
 
+	/* Health probing of failed legs & resync of reinstated ones */
+	unsigned long nr_regions;			/* resync regions in the target */
+	struct delayed_work probe_work;
+	struct delayed_work tick_work;		/* housekeeping (see DMS_TICK_INTERVAL) */
+	atomic_t probe_interval;			/* msecs between probe rounds, 0 == disabled */
+	atomic_t probe_threshold;			/* consecutive good probes to reinstate a leg */
+	struct dm_kcopyd_client *kcopyd_client;	/* while the resync work runs */
+	struct work_struct resync_work;
+	atomic_t resync_stop;				/* flag set to stop probing/resync (suspend/dtr) */
+	unsigned long resync_batch[DMS_RESYNC_MAX_SRCS];	/* regions being copied (one per source leg) */
+	atomic_t resync_nr;					/* number of regions in resync_batch[] */
+	struct mirror *resync_mirror;		/* leg the regions are being copied to */
+	unsigned long resync_cursor;		/* sweep position in the stale map */
+	int resync_hot_pass;				/* sweep takes only hot regions in this pass */
+	unsigned int resync_delay_ms;		/* adaptive pause between copy batches */
+	int resync_busy;					/* copies in flight (no latency baseline updates) */
+	unsigned int resync_epoch;			/* write epoch, flipped for every region copy */
+	atomic_t resync_inflight[2];		/* writes in flight per epoch */
+	wait_queue_head_t resync_wait;
+	atomic_t resync_regions_done;		/* regions copied since the table load */
+	atomic_t resync_rate;				/* max copy rate in KiB/s, 0 == unlimited */
+	atomic_t resync_kbps;				/* measured copy rate in KiB/s */
+
+	/* Region heat (foreground I/Os per region, decayed every housekeeping round),
+	 * tracked while any leg is out of sync to copy the hot regions first. */
+	int heat_on;
+	unsigned char *heat;
+	unsigned char *heat_gen;			/* heat_round a region was last decayed in */
+	unsigned char heat_round;			/* decay rounds, mod 256 */
+	unsigned long hot_ring[DMS_HOT_RING];	/* regions that recently turned hot */
+	atomic_t hot_head;
+
+	/* Write-behind limits & flush consistency of the async legs */
+	atomic_t behind_max_kb;
+	atomic_t behind_max_lag;			/* msecs */
+	atomic_t behind_flush;				/* dms_behind_flush */
+	wait_queue_head_t behind_wait;
+
+	/* Writes that can't go without blocking (e.g. an async leg lagging too far
+	 * behind): queued in arrival order, mapped by defer_work as the I/O in their
+	 * way completes (see dms_defer_kick()) */
+	spinlock_t defer_lock;				/* protects defer_queue */
+	struct bio_list defer_queue;
+	unsigned int defer_queued;			/* incl. the one defer_work is trying */
+	struct work_struct defer_work;		/* maps the deferred writes */
+	atomic_t defer_gen;					/* kicks, for the flush rounds waiting */
+	wait_queue_head_t defer_wait;
+
+	/* Ordered write journal of a remote leg: writes to jr_leg go to the journal
+	 * first, the replayer applies them to the leg in order */
+	struct mirror *jr_leg;
+	struct dm_dev *jr_dev;
+	sector_t jr_ring_sectors;
+	spinlock_t jr_lock;					/* protects the entries & ring positions */
+	struct list_head jr_inflight;		/* not acknowledged yet, in journal order */
+	struct list_head jr_entries;		/* acknowledged, not replayed yet, in journal order */
+	u64 jr_head_seq;
+	sector_t jr_head;					/* where the next entry goes */
+	u64 jr_tail_seq;
+	sector_t jr_tail;					/* first entry not replayed yet */
+	sector_t jr_used;					/* ring sectors in use */
+	unsigned int jr_nr;					/* entries in the journal */
+	wait_queue_head_t jr_wait;
+	struct work_struct jr_work;
+	atomic_t jr_stop;
+	void *jr_buf;						/* replay batch buffer */
+	struct dms_journal_sb *jr_sb;
+	atomic_t jr_replayed;				/* entries replayed since the table load */
+	atomic_t jr_kbps;					/* measured replay rate in KiB/s */
+
+	atomic_t max_io_len;				/* sectors bios are split to, 0 == no split */
+
+	/* Per-leg in-flight caps: writes are deferred while a live leg is at them (0 == no cap) */
+	atomic_t cap_kb;
+	atomic_t cap_ios;
+	atomic_t cap_waits;					/* writes deferred for a capped leg */
+	wait_queue_head_t cap_wait;			/* waits for the I/O in flight on a leg to drain */
+
+	/* QoS limits of reads/writes: bios over them wait in qos[] for qos_work */
+	spinlock_t qos_lock;				/* protects qos[] */
+	struct dms_qos qos[2];				/* indexed by READ / WRITE */
+	int qos_leg_cost;					/* writes cost once per live leg */
+	struct delayed_work qos_work;		/* dispatches the deferred bios */
+
+	atomic_t share_weight;				/* fair share of the instance on shared disks */
+
+	/* K-of-N write quorum: writes complete once K legs acked, 0 == all legs */
+	atomic_t write_quorum;
+	atomic_t quorum_early;				/* writes completed ahead of stragglers */
+
+	/* Flush sequencing: concurrent flushes are merged into rounds, one at a time */
+	spinlock_t flush_lock;
+	int flush_busy;						/* round running (or queued) */
+	struct bio *flush_leader;			/* the flush issued for the round */
+	struct bio_list flush_round;		/* flushes completing with the leader */
+	struct bio_list flush_pending;		/* flushes for the next round */
+	struct work_struct flush_work;		/* starts the next round */
+	atomic_t flush_rounds;
+	atomic_t flush_merged;				/* flushes completed by another's round */
+	atomic_t flush_elided;				/* leg flushes skipped (nothing written) */
+
+	atomic_t zero_legs;					/* legs with zero detection on */
+
+	/* WRITE_SAME/WRITE_ZEROES: offloaded to the legs, or written out on the others */
+	atomic_t wsame_offloaded;
+	atomic_t wsame_fallback;
+
+	/* Foreground latency (usecs, EWMA) & its baseline while no copies run */
+	unsigned long fg_lat_us;
+	unsigned long fg_lat_base_us;
+
 	char name[ DEVNAME_MAXLEN ];
 
 	struct mirror mirror[0];	/* CAUTION: this field MUST BE the LAST ONE in this struct! */
@@ -158,10 +532,24 @@ struct mirror_sync_set {
 struct dms_bio_map_info {
 	struct mirror *bmi_m;
 	struct mirror_sync_set *bmi_ms;
-	void * bi_private;
+	struct llist_node retry_node;	/* in the retry queue of a CPU (failed reads) */
+	int bmi_requeue;			/* pushed back to dm core (noflush suspend) */
 	unsigned int nr_live;
-	struct mirror *bmi_wm[MAX_MIRRORS];
+	unsigned int resync_epoch;	/* write epoch this write was counted in */
+	atomic_t bmi_wait;			/* legs (dm_io) + journal entry, to complete the write */
+	u64 start_ns;				/* submission time, for foreground latency */
+	atomic_t share_parts;		/* leg writes sent separately (fair share) */
+	unsigned long share_err;	/* ...and the ones that failed, by bmi_wm index */
+	struct dms_share_io *share_ios;
 	struct dm_bio_details bmi_bd;
+	u8 bmi_wm[0];				/* legs written (index in ms->mirror[]), nr_mirrors of them */
+};
+
+/* a dm_io of the legs bmi_wm[base...] of a write (sets above DMS_IO_GROUP legs):
+ * these follow bmi_wm[] in the per-bio data (see dms_bmi_size()) */
+struct dms_io_group {
+	struct bio *bio;
+	unsigned int base;
 };
 
 #if 0
@@ -169,15 +557,11 @@ static spinlock_t dms_pool_lock;	/* protects the mempool from side-effects :) */
 static mempool_t *dms_bio_map_info_pool = NULL;
 #endif
 
-/* we need a way to pass parameters over to the new ms at reconfig time */
-struct reconfig_ms_set {
-	atomic_t in_use;
-	struct mirror_sync_set *current_ms;
-	char devname[ DEVNAME_MAXLEN ];
-} __attribute__((packed));
-
-/* Current instances of mirror_sync devices... */
-int curr_ms_instances = MAX_DMS_INSTANCES;
-
-static struct reconfig_ms_set *reconf_ms = NULL;
+/* we need a way to pass parameters over to the new ms at reconfig time:
+ * the live instances are hashed by device name (the old and the new table
+ * of a device are both in it while a reload is in progress) */
+static DEFINE_MUTEX(dms_reg_lock);		/* protects the registry (ctr/dtr only) */
+static struct hlist_head *dms_reg_hash = NULL;
+static unsigned int dms_reg_bits;		/* 2^bits buckets */
+static unsigned int dms_reg_count;		/* instances in the registry */
 
@@ -0,0 +1,74 @@
+#!/bin/bash
+
+# Discard-heavy benchmark on a mirror_sync device (e.g. over SSD or thin legs):
+# fills a filesystem with files, deletes most of them and times fstrim, for a
+# number of rounds. Prints the time per round and the discard counters of the
+# legs (from /sys/block/<leg>/stat, kernel >= 4.18, else just the times).
+
+# CAUTION: this is ONLY a shortcut for the specific TEST VM SETUP!!
+
+# CAUTION: THIS TEST OVERWRITES THE WHOLE DMS DEVICE USED!
+
+if [ $# -lt 1 ] || [ $# -gt 4 ] ; then
+	echo "Usage: $0 <dms device name> [rounds] [fill MiB] [mount dir]"
+	exit -1
+fi
+
+dms_devname=$1
+rounds=${2:-5}
+fill_mb=${3:-4096}
+mnt=${4:-/mnt/dms_trim}
+dms_device="/dev/mapper/$dms_devname"
+
+if [ ! -b $dms_device ]; then
+	echo "Device $dms_device does not exist!"
+	exit -1
+fi
+
+# the legs of the set: <start> <len> mirror_sync <#legs> <leg> <offset>...
+table=( `/sbin/dmsetup table $dms_devname` )
+if [ "${table[2]}" != "mirror_sync" ]; then
+	echo "Device $dms_devname is not a mirror_sync device!"
+	exit -1
+fi
+nr_legs=${table[3]}
+
+leg_discards() {
+	local idx dev sum=""
+	for (( idx=0; idx<$nr_legs; idx++ )); do
+		dev=${table[$(( 4 + 2 * $idx ))]}
+		# major:minor -> sysfs name
+		[ -b $dev ] && dev=`printf "%d:%d" 0x$(stat -L -c %t $dev) 0x$(stat -L -c %T $dev)`
+		stat=( `cat /sys/dev/block/$dev/stat 2>/dev/null` )
+		sum+=" $idx:${stat[14]:-n/a}"
+	done
+	echo $sum
+}
+
+echo -n 'DISCARD GRANULARITY (bytes): '
+cat /sys/block/`basename $(readlink -f $dms_device)`/queue/discard_granularity
+
+mkdir -p $mnt
+/sbin/mkfs.ext4 -q -F -E nodiscard $dms_device || exit -1
+mount -o nodiscard $dms_device $mnt || exit -1
+
+for (( r=1; r<=$rounds; r++ )); do
+	# many files, so that the freed space is fragmented
+	for (( f=0; f<$fill_mb/64; f++ )); do
+		dd if=/dev/urandom of=$mnt/f$f bs=1M count=64 conv=fsync status=none
+	done
+	find $mnt -name 'f*[1-9]' -delete
+	sync
+
+	before=`leg_discards`
+	start=`date +%s.%N`
+	/sbin/fstrim -v $mnt
+	end=`date +%s.%N`
+	echo "ROUND $r: fstrim took `echo "$end - $start" | bc` secs (leg discard I/Os before: $before after: `leg_discards`)"
+	rm -f $mnt/f*
+done
+
+umount $mnt
+echo -n 'DMS STATUS:'
+/sbin/dmsetup status $dms_devname
+echo 'ALL DONE!'
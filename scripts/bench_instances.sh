@@ -0,0 +1,65 @@
+#!/bin/bash
+
+# Table load benchmark for hosts with many mirror_sync devices: creates N small
+# devices on the same two legs, reloads all of them (reload/suspend/resume, as
+# on a migration) and removes them, timing each phase. The legs are only opened,
+# no I/O is done on them. Also prints the memory (MemAvailable, Slab) & kernel
+# threads taken per device once all are created.
+
+# CAUTION: this is ONLY a shortcut for the specific TEST VM SETUP!!
+
+if [ $# -lt 2 ] || [ $# -gt 4 ] ; then
+	echo "Usage: $0 <leg 1 /dev/ice> <leg 2 /dev/ice> [instances] [sectors per device]"
+	exit -1
+fi
+
+leg1=$1
+leg2=$2
+instances=${3:-10000}
+sectors=${4:-2048}
+prefix=dmsb
+
+if [ ! -b $leg1 ] || [ ! -b $leg2 ]; then
+	echo "Device(s) $leg1 and/or $leg2 does not exist!"
+	exit -1
+fi
+
+if ! /sbin/dmsetup targets | grep -q mirror_sync ; then
+	echo "The mirror_sync target is not loaded!"
+	exit -1
+fi
+
+table="0 $sectors mirror_sync core 2 64 nosync 2 $leg1 0 $leg2 0"
+
+phase() {
+	local name=$1 cmd=$2 i start end
+	start=`date +%s.%N`
+	for (( i=0; i<$instances; i++ )); do
+		$cmd $prefix$i || { echo "$name of $prefix$i FAILED!"; exit -1; }
+	done
+	end=`date +%s.%N`
+	echo "$name: $instances devices in `echo "$end - $start" | bc` secs" \
+		"(`echo "scale=3; ($end - $start) * 1000000 / $instances" | bc` usecs/device)"
+}
+
+# memory in KiB & kernel threads of the system
+mem_kb() { grep "^$1:" /proc/meminfo | awk '{ print $2 }'; }
+nr_kthreads() { ps -e -o comm= | grep -c -e kmirror_syncd -e kcopyd; }
+
+snapshot() { avail=`mem_kb MemAvailable`; slab=`mem_kb Slab`; threads=`nr_kthreads`; }
+
+create() { /sbin/dmsetup create $1 --table "$table"; }
+reload() { /sbin/dmsetup reload $1 --table "$table" && /sbin/dmsetup suspend $1 && /sbin/dmsetup resume $1; }
+remove() { /sbin/dmsetup remove $1; }
+
+snapshot
+avail0=$avail; slab0=$slab; threads0=$threads
+phase CREATE create
+snapshot
+echo "PER DEVICE: `echo "scale=1; ($avail0 - $avail) / $instances" | bc` KiB memory" \
+	"(`echo "scale=1; ($slab - $slab0) / $instances" | bc` KiB slab)," \
+	"`echo "scale=2; ($threads - $threads0) / $instances" | bc` kmirror_syncd/kcopyd threads"
+phase RELOAD reload
+phase REMOVE remove
+
+echo 'ALL DONE!'
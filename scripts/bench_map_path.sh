@@ -0,0 +1,77 @@
+#!/bin/bash
+
+# Map path cost benchmark: runs 4k random reads & writes (fio, direct I/O) on
+# null_blk devices, first on one of them directly and then on a mirror_sync
+# device over them, and prints the IOPS and the CPU cycles per I/O of each
+# (perf stat, all CPUs). The difference is the cost of the target per I/O.
+# With 2 legs, the mirror_sync device is run with the two-leg I/O path and
+# then with the generic one (mirror_sync_pair_path=0), to compare them.
+
+# CAUTION: this is ONLY a shortcut for the specific TEST VM SETUP!!
+
+if [ $# -gt 3 ] ; then
+	echo "Usage: $0 [legs] [fio jobs] [runtime secs]"
+	exit -1
+fi
+
+legs=${1:-2}
+jobs=${2:-`nproc`}
+runtime=${3:-30}
+dms_devname=dmsnull
+dms_device="/dev/mapper/$dms_devname"
+
+for tool in fio perf; do
+	if ! which $tool >/dev/null 2>&1; then
+		echo "$tool is needed!"
+		exit -1
+	fi
+done
+
+# memory backed legs, no latency: only the CPU cost of the stack is left
+/sbin/modprobe -r null_blk 2>/dev/null
+/sbin/modprobe null_blk nr_devices=$legs queue_mode=2 irqmode=0 gb=8 || exit -1
+
+sectors=`/sbin/blockdev --getsz /dev/nullb0`
+dms_devs=""
+for (( idx=0; idx<$legs; idx++ )); do
+	dms_devs+=" /dev/nullb$idx 0"
+done
+
+pair_param=/sys/module/dm_mirror_sync/parameters/mirror_sync_pair_path
+
+# (re)create the device: the I/O path of a set is picked at table load
+create() {
+	/sbin/dmsetup remove $dms_devname 2>/dev/null
+	[ -w $pair_param ] && echo $1 > $pair_param
+	/sbin/dmsetup create $dms_devname --table "0 $sectors mirror_sync core 2 64 nosync $legs$dms_devs" || exit -1
+}
+
+run() {
+	local name=$1 dev=$2 rw=$3 out iops cycles
+	out=`perf stat -a -x, -e cycles -o /tmp/$dms_devname.perf \
+		fio --name=$name --filename=$dev --rw=$rw --bs=4k --direct=1 --ioengine=libaio \
+			--iodepth=32 --numjobs=$jobs --time_based --runtime=$runtime --group_reporting \
+			--output-format=terse --terse-version=3`
+	# terse v3: read IOPS is field 8, write IOPS field 49
+	iops=`echo "$out" | awk -F';' '{ print $8 + $49 }'`
+	cycles=`grep cycles /tmp/$dms_devname.perf | cut -d, -f1`
+	echo "$name $rw: $iops IOPS, `echo "$cycles / ($iops * $runtime)" | bc` cycles/IO"
+}
+
+for rw in randread randwrite; do
+	run nullb /dev/nullb0 $rw
+	create 1
+	run mirror_sync $dms_device $rw
+	if [ $legs -eq 2 ] && [ -w $pair_param ]; then
+		create 0
+		run mirror_sync_generic $dms_device $rw
+	fi
+done
+[ -w $pair_param ] && echo 1 > $pair_param
+
+echo -n 'DMS STATUS:'
+/sbin/dmsetup status $dms_devname
+/sbin/dmsetup remove $dms_devname
+/sbin/modprobe -r null_blk
+rm -f /tmp/$dms_devname.perf
+echo 'ALL DONE!'
@@ -0,0 +1,60 @@
+#!/bin/bash
+
+# Read latency during a forced leg failure on a mirror_sync device: runs a
+# random read fio job and, half way through, switches one leg (which must be
+# a dm device itself, e.g. linear) to an error table, so that its reads fail
+# and get retried on the other legs. Prints the completion latency percentiles
+# of the whole run and the fail/retry status of the set.
+
+# CAUTION: this is ONLY a shortcut for the specific TEST VM SETUP!!
+
+# CAUTION: THE FAILED LEG GETS OUT OF SYNC, IT HAS TO BE RESYNCED AFTERWARDS!
+
+if [ $# -lt 2 ] || [ $# -gt 5 ] ; then
+	echo "Usage: $0 <dms device name> <dm name of the leg to fail> [runtime secs] [block size] [jobs]"
+	exit -1
+fi
+
+dms_devname=$1
+leg_devname=$2
+runtime=${3:-60}
+bs=${4:-4k}
+jobs=${5:-4}
+dms_device="/dev/mapper/$dms_devname"
+
+if [ ! -b $dms_device ] || [ ! -b /dev/mapper/$leg_devname ]; then
+	echo "Device $dms_device or /dev/mapper/$leg_devname does not exist!"
+	exit -1
+fi
+
+leg_table=`/sbin/dmsetup table $leg_devname` || exit -1
+leg_size=`/sbin/blockdev --getsz /dev/mapper/$leg_devname`
+
+restore_leg() {
+	/sbin/dmsetup suspend --noflush $leg_devname
+	echo "$leg_table" | /sbin/dmsetup load $leg_devname
+	/sbin/dmsetup resume $leg_devname
+}
+trap restore_leg EXIT
+
+fail_leg() {
+	sleep $(( $runtime / 2 ))
+	echo "FAILING LEG $leg_devname at `date +%T`..."
+	/sbin/dmsetup suspend --noflush $leg_devname
+	echo "0 $leg_size error" | /sbin/dmsetup load $leg_devname
+	/sbin/dmsetup resume $leg_devname
+}
+
+echo -n 'DMS STATUS BEFORE:'
+/sbin/dmsetup status $dms_devname
+
+fail_leg &
+fio --name=failover --filename=$dms_device --rw=randread --bs=$bs \
+	--direct=1 --ioengine=libaio --iodepth=32 --numjobs=$jobs \
+	--time_based --runtime=$runtime --group_reporting \
+	--percentile_list=50:99:99.9:99.99:100 | grep -A 8 'clat percentiles\|IOPS='
+wait
+
+echo -n 'DMS STATUS AFTER:'
+/sbin/dmsetup status $dms_devname
+echo 'ALL DONE!'
@@ -0,0 +1,78 @@
+#!/bin/bash
+
+# Table reload stall benchmark: builds a mirror_sync device over a fast leg and
+# a slow one (a dm-delay device over the 2nd leg), keeps small direct reads &
+# writes going on it and reloads the table a number of times, with a plain and
+# with a noflush suspend. The I/O pause of a reload is the longest gap between
+# two completed I/Os while it runs.
+
+# CAUTION: this is ONLY a shortcut for the specific TEST VM SETUP!!
+
+# CAUTION: THIS TEST OVERWRITES THE LEGS USED!
+
+if [ $# -lt 2 ] || [ $# -gt 4 ] ; then
+	echo "Usage: $0 <leg 1 /dev/ice> <leg 2 /dev/ice> [leg 2 delay ms] [reloads]"
+	exit -1
+fi
+
+leg1=$1
+leg2=$2
+delay_ms=${3:-500}
+reloads=${4:-5}
+dms_devname=dmsp
+slow_devname=dmsp_slow
+dms_device="/dev/mapper/$dms_devname"
+iolog=/tmp/$dms_devname.io.log
+
+if [ ! -b $leg1 ] || [ ! -b $leg2 ]; then
+	echo "Device(s) $leg1 and/or $leg2 does not exist!"
+	exit -1
+fi
+
+sectors=`/sbin/blockdev --getsz $leg1`
+[ `/sbin/blockdev --getsz $leg2` -lt $sectors ] && sectors=`/sbin/blockdev --getsz $leg2`
+
+/sbin/dmsetup create $slow_devname --table "0 $sectors delay $leg2 0 $delay_ms" || exit -1
+table="0 $sectors mirror_sync core 2 64 nosync 2 $leg1 0 /dev/mapper/$slow_devname 0"
+/sbin/dmsetup create $dms_devname --table "$table" || exit -1
+
+# one timestamp per completed I/O: 4k direct writes & reads at random offsets
+io_loop() {
+	local blocks=$(( $sectors / 8 ))
+	while true; do
+		off=$(( ($RANDOM * 32768 + $RANDOM) % $blocks ))
+		dd if=/dev/zero of=$dms_device bs=4k count=1 seek=$off oflag=direct status=none
+		dd if=$dms_device of=/dev/null bs=4k count=1 skip=$off iflag=direct status=none
+		date +%s.%N
+	done
+}
+
+for mode in "" "--noflush"; do
+	max=0
+	for (( r=1; r<=$reloads; r++ )); do
+		io_loop > $iolog &
+		pid=$!
+		sleep 2
+
+		start=`date +%s.%N`
+		/sbin/dmsetup reload $dms_devname --table "$table" || exit -1
+		/sbin/dmsetup suspend $mode $dms_devname && /sbin/dmsetup resume $dms_devname || exit -1
+		end=`date +%s.%N`
+
+		sleep 2
+		kill $pid; wait $pid 2>/dev/null
+
+		# the longest gap between I/O completions around the reload
+		pause=`awk -v s=$start -v e=$end '{ if (p && $1 >= s && p <= e && $1 - p > m) m = $1 - p; p = $1 } END { printf "%.3f", m }' $iolog`
+		echo "RELOAD ${mode:-(flush)} $r: swap took `echo "$end - $start" | bc` secs, I/O pause $pause secs"
+		[ `echo "$pause > $max" | bc` -eq 1 ] && max=$pause
+	done
+	echo "RELOAD ${mode:-(flush)}: max I/O pause $max secs (leg 2 delay $delay_ms ms)"
+done
+
+echo -n 'DMS STATUS:'
+/sbin/dmsetup status $dms_devname
+/sbin/dmsetup remove $dms_devname
+/sbin/dmsetup remove $slow_devname
+rm -f $iolog
+echo 'ALL DONE!'
@@ -0,0 +1,55 @@
+#!/bin/bash
+
+# Adds a new (empty) leg to a live mirror_sync device. The table is reloaded
+# with the new leg marked "rebuild": it gets all new writes at once and the
+# existing data is copied to it in the background, while the device is in use.
+
+# CAUTION: this is ONLY a shortcut for the specific TEST VM SETUP!!
+
+if [ $# -lt 2 ] || [ $# -gt 3 ] ; then
+	echo "Usage: $0 <dms device name> <new leg /dev/ice> [max copy rate KiB/s]"
+	exit -1
+fi
+
+dms_devname=$1
+new_leg=$2
+copy_rate=${3:-0}
+dms_device="/dev/mapper/$dms_devname"
+
+if [ ! -b $dms_device ] || [ ! -b $new_leg ]; then
+	echo "Device(s) $dms_device and/or $new_leg does not exist!"
+	exit -1
+fi
+
+# current table: <start> <len> mirror_sync <#legs> <leg> <offset>...
+table=( `/sbin/dmsetup table $dms_devname` )
+if [ "${table[2]}" != "mirror_sync" ]; then
+	echo "Device $dms_devname is not a mirror_sync device!"
+	exit -1
+fi
+dmssize=${table[1]}
+nr_legs=${table[3]}
+
+dms_devs=""
+for (( idx=0; idx<$nr_legs; idx++ )); do
+	dms_devs+=" ${table[$(( 4 + 2 * $idx ))]} ${table[$(( 5 + 2 * $idx ))]}"
+done
+
+echo -n '[BEFORE] DMS STATUS:'
+/sbin/dmsetup status $dms_devname
+
+new_table="0 $dmssize mirror_sync core 2 64 nosync $(( $nr_legs + 1 ))$dms_devs $new_leg 0 2 rebuild $nr_legs"
+echo "Reloading DMS with NEW table: $new_table"
+/sbin/dmsetup reload $dms_devname --table "$new_table" || exit -1
+
+# NOTE: the suspend only lasts for the table swap, the copy runs after resume
+# (noflush: the pending I/O is requeued to the new table, not waited for)
+/sbin/dmsetup suspend --noflush $dms_devname
+/sbin/dmsetup resume $dms_devname
+echo 'DMS RELOAD OK!'
+
+/sbin/dmsetup message $dms_devname 0 "io_cmd set_resync_rate $copy_rate 0"
+
+echo -n '[AFTER] DMS STATUS:'
+/sbin/dmsetup status $dms_devname
+echo 'ALL DONE!'